@@ -5,48 +5,141 @@
   See the file COPYING.
 */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+// for fallocate and FALLOC_FL_PUNCH_HOLE
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "block.h"
+#include "stats.h"
 
 int diskfile = -1;
 
-void disk_open(const char* diskfile_path)
+// Cleared once the image turns out not to support holes, so zeros are
+// written straight away from then on
+static int punch_works = 1;
+
+#define ZERO_RUN 64	// blocks block_zero writes at a time without holes
+static const char zero_blocks[ZERO_RUN * BLOCK_SIZE];
+
+// block_sync: syncs started so far and finished so far, one at a time,
+// and what the last one returned
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t syncs_started, syncs_done;
+static int sync_error;
+
+/** Open the disk image, which must exist
+ *
+ * Returns 0, or -errno if it can't be opened.
+ */
+int disk_open(const char* diskfile_path)
 {
     if(diskfile >= 0){
-	return;
+	return 0;
     }
     
-    diskfile = open(diskfile_path, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
+    diskfile = open(diskfile_path, O_RDWR);
     if (diskfile < 0) {
+	int err = -errno;
 	perror("disk_open failed");
-	exit(EXIT_FAILURE);
+	return err;
     }
+    punch_works = 1;
+    return 0;
 }
 
 void disk_close()
 {
     if(diskfile >= 0){
 	close(diskfile);
+	diskfile = -1;
     }
 }
 
+/* Whether a buffer holds nothing but zeros */
+static int all_zero(const char *buf, size_t length)
+{
+    return length == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, length - 1) == 0);
+}
+
+/** Give the space of @count consecutive blocks back to the host filesystem
+ *
+ * They read as zeros afterwards.  Returns 0, or -errno if the image
+ * can't have holes (-EOPNOTSUPP) or the call failed, in which case the
+ * blocks are left as they were.
+ */
+int block_punch(const int64_t block_num, const int64_t count)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    int works = __atomic_load_n(&punch_works, __ATOMIC_RELAXED);
+
+    if (count <= 0)
+	return 0;
+    if (works
+	&& fallocate(diskfile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		     (off_t) block_num * BLOCK_SIZE, (off_t) count * BLOCK_SIZE) == 0) {
+	stats_count(STATS_BLOCKS_PUNCHED, count);
+	return 0;
+    }
+    if (works && errno != EOPNOTSUPP && errno != ENOSYS)
+	return -errno;
+    __atomic_store_n(&punch_works, 0, __ATOMIC_RELAXED);
+#endif
+    return -EOPNOTSUPP;
+}
+
+/** Make @count consecutive blocks read as zeros
+ *
+ * Punches them out of the image where it can have holes, and writes
+ * zeros over them where it can't.  Returns 0, or -errno on failure.
+ */
+int block_zero(const int64_t block_num, const int64_t count)
+{
+    int64_t done;
+    int n;
+
+    if (block_punch(block_num, count) == 0)
+	return 0;
+    for (done = 0; done < count; done += n) {
+	n = count - done < ZERO_RUN ? count - done : ZERO_RUN;
+	if (pwrite(diskfile, zero_blocks, (size_t) n * BLOCK_SIZE,
+		   (off_t) (block_num + done) * BLOCK_SIZE) < 0) {
+	    perror("block_zero failed");
+	    return -errno;
+	}
+	stats_count(STATS_BLOCK_WRITES, 1);
+	stats_count(STATS_BLOCKS_WRITTEN, n);
+    }
+    return 0;
+}
+
 /** Read a block from an open file
  *
- * Read should return (1) exactly @BLOCK_SIZE when succeeded, or (2) 0 when the requested block has never been touched before, or (3) a negtive value when failed. 
- * In cases of error or return value equals to 0, the content of the @buf is set to 0.
+ * Read should return (1) exactly @BLOCK_SIZE when succeeded, or (2) less when the requested block lies (partly) past the end of the image, or (3) a negtive value when failed. 
+ * Whatever wasn't read, all of it on error, is set to 0; holes read as 0 anyway.
  */
-int block_read(const int block_num, void *buf)
+int block_read(const int64_t block_num, void *buf)
 {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat <= 0){
-	memset(buf, 0, BLOCK_SIZE);
+    retstat = pread(diskfile, buf, BLOCK_SIZE, (off_t) block_num * BLOCK_SIZE);
+    stats_count(STATS_BLOCK_READS, 1);
+    stats_count(STATS_BLOCKS_READ, 1);
+    if (retstat < BLOCK_SIZE){
+	memset((char *) buf + (retstat > 0 ? retstat : 0), 0, BLOCK_SIZE - (retstat > 0 ? retstat : 0));
 	if(retstat<0)
 	perror("block_read failed");
     }
@@ -56,15 +149,111 @@ int block_read(const int block_num, void *buf)
 
 /** Write a block to an open file
  *
- * Write should return exactly @BLOCK_SIZE except on error. 
+ * Write should return exactly @BLOCK_SIZE except on error.  A block of
+ * zeros is punched out rather than written where the image allows.
  */
-int block_write(const int block_num, const void *buf)
+int block_write(const int64_t block_num, const void *buf)
 {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    if (all_zero(buf, BLOCK_SIZE) && block_punch(block_num, 1) == 0)
+	return BLOCK_SIZE;
+    retstat = pwrite(diskfile, buf, BLOCK_SIZE, (off_t) block_num * BLOCK_SIZE);
+    stats_count(STATS_BLOCK_WRITES, 1);
+    stats_count(STATS_BLOCKS_WRITTEN, 1);
     if (retstat < 0)
 	perror("block_write failed");
     
     return retstat;
 }
 
+/** Read @count consecutive blocks with a single call
+ *
+ * Returns the number of bytes read or a negative value on failure.  As
+ * with block_read, whatever lies past the end of the file reads as 0.
+ */
+int block_read_run(const int64_t block_num, const int count, void *buf)
+{
+    int retstat = 0;
+    size_t length = (size_t) count * BLOCK_SIZE;
+    retstat = pread(diskfile, buf, length, (off_t) block_num * BLOCK_SIZE);
+    stats_count(STATS_BLOCK_READS, 1);
+    stats_count(STATS_BLOCKS_READ, count);
+    if (retstat < 0) {
+	memset(buf, 0, length);
+	perror("block_read_run failed");
+    } else if (retstat < length) {
+	memset((char *) buf + retstat, 0, length - retstat);
+    }
+
+    return retstat;
+}
+
+/** Write @count consecutive blocks with a single call
+ *
+ * Returns @count * @BLOCK_SIZE except on error.  As with block_write,
+ * blocks of zeros are punched out instead; a run with some among
+ * other data takes one call per stretch of either.
+ */
+int block_write_run(const int64_t block_num, const int count, const void *buf)
+{
+    const char *data = buf;
+    int retstat = 0;
+    int i, n, zero;
+
+    for (i = 0; i < count; i += n) {
+	zero = all_zero(data + (size_t) i * BLOCK_SIZE, BLOCK_SIZE);
+	for (n = 1; i + n < count; n++)
+	    if (all_zero(data + (size_t) (i + n) * BLOCK_SIZE, BLOCK_SIZE) != zero)
+		break;
+	if (zero && block_punch(block_num + i, n) == 0)
+	    continue;
+	retstat = pwrite(diskfile, data + (size_t) i * BLOCK_SIZE, (size_t) n * BLOCK_SIZE,
+			 (off_t) (block_num + i) * BLOCK_SIZE);
+	stats_count(STATS_BLOCK_WRITES, 1);
+	stats_count(STATS_BLOCKS_WRITTEN, n);
+	if (retstat < 0) {
+	    perror("block_write_run failed");
+	    return retstat;
+	}
+    }
+
+    return (int) ((size_t) count * BLOCK_SIZE);
+}
+
+/** Make everything written to the image so far durable
+ *
+ * Callers that come in while a sync is running all wait for the next
+ * one, which the first of them starts once the running one is done,
+ * so however many there are, they cost at most two syncs of the image
+ * between them.  Returns 0, or -errno if that sync failed.
+ */
+int block_sync(void)
+{
+    uint64_t want, n;
+    int retstat;
+
+    pthread_mutex_lock(&sync_lock);
+    // the sync running now may have started before what the caller wrote
+    want = syncs_started + 1;
+    while (syncs_done < want) {
+	if (syncs_started > syncs_done) {
+	    pthread_cond_wait(&sync_cond, &sync_lock);
+	    continue;
+	}
+	n = ++syncs_started;
+	pthread_mutex_unlock(&sync_lock);
+#ifdef HAVE_FDATASYNC
+	retstat = fdatasync(diskfile) < 0 ? -errno : 0;
+#else
+	retstat = fsync(diskfile) < 0 ? -errno : 0;
+#endif
+	stats_count(STATS_SYNCS, 1);
+	pthread_mutex_lock(&sync_lock);
+	syncs_done = n;
+	sync_error = retstat;
+	pthread_cond_broadcast(&sync_cond);
+    }
+    retstat = sync_error;
+    pthread_mutex_unlock(&sync_lock);
+    return retstat;
+}
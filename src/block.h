@@ -8,11 +8,18 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <stdint.h>
+
 #define BLOCK_SIZE 512
 
-void disk_open(const char* diskfile_path);
+int disk_open(const char* diskfile_path);
 void disk_close();
-int block_read(const int block_num, void *buf);
-int block_write(const int block_num, const void *buf);
+int block_read(const int64_t block_num, void *buf);
+int block_write(const int64_t block_num, const void *buf);
+int block_read_run(const int64_t block_num, const int count, void *buf);
+int block_write_run(const int64_t block_num, const int count, const void *buf);
+int block_punch(const int64_t block_num, const int64_t count);
+int block_zero(const int64_t block_num, const int64_t count);
+int block_sync(void);
 
 #endif
@@ -0,0 +1,274 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  File data held back by delayed allocation.  A write into blocks of
+  a file that have no data block yet doesn't allocate one: libsfs
+  keeps the new contents here, in memory, and only when they are
+  written out, after delalloc_ms or sooner when memory or a sync asks
+  for it, gives all the file's held blocks their data blocks at once,
+  in as few contiguous runs as the free space allows.  A file written
+  a little at a time gets laid out in one piece rather than in the
+  order its writes happened to come in, and a file removed before then
+  never takes any space in the image at all.
+
+  A held block is never mapped: its place in the file is a hole on
+  disk until it is written out.  Reads see the held contents over the
+  hole.
+
+  Nothing here has a lock of its own.  libsfs calls in with meta_lock
+  held, and only touches the contents of a held block (the buffers
+  handed out here, which stay put until taken or dropped) while it
+  holds a range lock on that block.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "delalloc.h"
+
+#define DELALLOC_HASH 256	// buckets of the table of files with held blocks
+
+int delalloc_kb = 8192;
+int delalloc_ms = 1000;
+
+struct held_block {
+    int64_t block;		// in the file
+    char *data;			// BLOCK_SIZE bytes
+};
+
+// The held blocks of one file, in file order
+struct held_file {
+    int inode_number;
+    struct held_block *list;
+    int count;
+    int size;			// room in list
+    struct timespec since;	// when the oldest of them was held (CLOCK_MONOTONIC)
+    struct held_file *next;	// in its hash bucket
+};
+
+static struct held_file *files[DELALLOC_HASH];
+static int64_t total = 0;
+
+static struct held_file **bucket(int inode_number)
+{
+    return &files[(unsigned) inode_number % DELALLOC_HASH];
+}
+
+static struct held_file *lookup(int inode_number)
+{
+    struct held_file *f;
+
+    for (f = *bucket(inode_number); f != NULL; f = f->next) {
+	if (f->inode_number == inode_number)
+	    return f;
+    }
+    return NULL;
+}
+
+static void forget(struct held_file *f)
+{
+    struct held_file **p;
+
+    for (p = bucket(f->inode_number); *p != f; p = &(*p)->next)
+	;
+    *p = f->next;
+    free(f->list);
+    free(f);
+}
+
+// Index of the first held block at or after @block
+static int position(struct held_file *f, int64_t block)
+{
+    int lo = 0, hi = f->count;
+
+    // blocks are mostly held in file order, so try the end first
+    if (hi == 0 || f->list[hi - 1].block < block)
+	return hi;
+    while (lo < hi) {
+	int mid = lo + (hi - lo) / 2;
+	if (f->list[mid].block < block)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/** The held contents of a file block, NULL if it isn't held */
+char *delalloc_find(int inode_number, int64_t block)
+{
+    struct held_file *f = lookup(inode_number);
+    int i;
+
+    if (f == NULL)
+	return NULL;
+    i = position(f, block);
+    return i < f->count && f->list[i].block == block ? f->list[i].data : NULL;
+}
+
+/** Hold a file block that isn't held yet, as zeroes
+ *
+ * Returns the buffer for its contents, NULL if out of memory.
+ */
+char *delalloc_hold(int inode_number, int64_t block)
+{
+    char *data = calloc(1, BLOCK_SIZE);
+
+    if (data == NULL)
+	return NULL;
+    if (delalloc_put(inode_number, block, data) != 0) {
+	free(data);
+	return NULL;
+    }
+    return data;
+}
+
+/** Hold a file block that isn't held yet, with contents of its own
+ *
+ * The buffer, allocated with malloc, is ours from here on.  Returns
+ * -ENOMEM if there is no room to keep it.
+ */
+int delalloc_put(int inode_number, int64_t block, char *data)
+{
+    struct held_file *f = lookup(inode_number);
+    int i;
+
+    if (f == NULL) {
+	f = calloc(1, sizeof(struct held_file));
+	if (f == NULL)
+	    return -ENOMEM;
+	f->inode_number = inode_number;
+	clock_gettime(CLOCK_MONOTONIC, &f->since);
+	f->next = *bucket(inode_number);
+	*bucket(inode_number) = f;
+    }
+    if (f->count == f->size) {
+	int size = f->size ? f->size * 2 : 16;
+	struct held_block *list = realloc(f->list, size * sizeof(struct held_block));
+	if (list == NULL) {
+	    if (f->count == 0)
+		forget(f);
+	    return -ENOMEM;
+	}
+	f->list = list;
+	f->size = size;
+    }
+    i = position(f, block);
+    memmove(f->list + i + 1, f->list + i, (f->count - i) * sizeof(struct held_block));
+    f->list[i].block = block;
+    f->list[i].data = data;
+    f->count++;
+    total++;
+    return 0;
+}
+
+/** Stop holding the held blocks of a file from @first to @last
+ *
+ * Up to @max of them, in file order; their numbers go to @blocks and
+ * their buffers, which are the caller's to free from here on, to
+ * @data.  Returns how many were taken.
+ */
+int delalloc_take(int inode_number, int64_t first, int64_t last, int64_t *blocks, char **data, int max)
+{
+    struct held_file *f = lookup(inode_number);
+    int i, n;
+
+    if (f == NULL)
+	return 0;
+    i = position(f, first);
+    for (n = 0; n < max && i + n < f->count && f->list[i + n].block <= last; n++) {
+	blocks[n] = f->list[i + n].block;
+	data[n] = f->list[i + n].data;
+    }
+    memmove(f->list + i, f->list + i + n, (f->count - i - n) * sizeof(struct held_block));
+    f->count -= n;
+    total -= n;
+    if (f->count == 0)
+	forget(f);
+    return n;
+}
+
+/** Throw away the held blocks of a file from @first to @last
+ *
+ * Returns how many there were.
+ */
+int64_t delalloc_drop(int inode_number, int64_t first, int64_t last)
+{
+    struct held_file *f = lookup(inode_number);
+    int i, n;
+
+    if (f == NULL)
+	return 0;
+    i = position(f, first);
+    for (n = 0; i + n < f->count && f->list[i + n].block <= last; n++)
+	free(f->list[i + n].data);
+    memmove(f->list + i, f->list + i + n, (f->count - i - n) * sizeof(struct held_block));
+    f->count -= n;
+    total -= n;
+    if (f->count == 0)
+	forget(f);
+    return n;
+}
+
+/** How many blocks of a file are held
+ *
+ * If there are any, the first and last of them go to @first and
+ * @last.
+ */
+int64_t delalloc_held(int inode_number, int64_t *first, int64_t *last)
+{
+    struct held_file *f = lookup(inode_number);
+
+    if (f == NULL)
+	return 0;
+    *first = f->list[0].block;
+    *last = f->list[f->count - 1].block;
+    return f->count;
+}
+
+/** How many blocks are held altogether */
+int64_t delalloc_total(void)
+{
+    return total;
+}
+
+/** The file whose held blocks have waited longest
+ *
+ * Returns its inode number, -1 if nothing is held.  If @since isn't
+ * NULL, when the first of them was held goes there (CLOCK_MONOTONIC).
+ */
+int delalloc_oldest(struct timespec *since)
+{
+    struct held_file *f, *oldest = NULL;
+    int i;
+
+    for (i = 0; i < DELALLOC_HASH; i++) {
+	for (f = files[i]; f != NULL; f = f->next) {
+	    if (oldest == NULL || f->since.tv_sec < oldest->since.tv_sec
+		|| (f->since.tv_sec == oldest->since.tv_sec && f->since.tv_nsec < oldest->since.tv_nsec))
+		oldest = f;
+	}
+    }
+    if (oldest == NULL)
+	return -1;
+    if (since != NULL)
+	*since = oldest->since;
+    return oldest->inode_number;
+}
+
+/** Throw away everything still held */
+void delalloc_destroy(void)
+{
+    int i;
+
+    for (i = 0; i < DELALLOC_HASH; i++) {
+	while (files[i] != NULL)
+	    delalloc_drop(files[i]->inode_number, 0, INT64_MAX);
+    }
+}
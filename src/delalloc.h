@@ -0,0 +1,27 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _DELALLOC_H_
+#define _DELALLOC_H_
+
+#include <stdint.h>
+#include <time.h>
+
+extern int delalloc_kb;
+extern int delalloc_ms;
+
+char *delalloc_find(int inode_number, int64_t block);
+char *delalloc_hold(int inode_number, int64_t block);
+int delalloc_put(int inode_number, int64_t block, char *data);
+int delalloc_take(int inode_number, int64_t first, int64_t last, int64_t *blocks, char **data, int max);
+int64_t delalloc_drop(int inode_number, int64_t first, int64_t last);
+int64_t delalloc_held(int inode_number, int64_t *first, int64_t *last);
+int64_t delalloc_total(void);
+int delalloc_oldest(struct timespec *since);
+void delalloc_destroy(void);
+
+#endif
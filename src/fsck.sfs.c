@@ -0,0 +1,925 @@
+/*
+  Checks an sfs image, and repairs it with -y.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  usage:  fsck.sfs [-n | -y] [-j threads] image
+
+  The image must not be mounted.  Commits a crash left in the journal
+  are put in place first (with -y; without it, fsck.sfs stops there),
+  and then only the metadata is read, in four passes:
+
+  1. The inode table is streamed in large sequential reads by all the
+     threads at once (-j, one per CPU by default), keeping a copy of
+     every inode the inode bitmap has in use.  Stretches of the table
+     with none in use aren't read at all.
+  2. The directory tree is walked from the root, checking each entry
+     and finding which inodes are in it.
+  3. The threads follow the block pointers of the files in the tree,
+     claiming every data block they name in a data bitmap rebuilt in
+     memory.  A pointer outside the data region or past the end of its
+     file is bad.  Blocks named more than once are only noted; one
+     thread then goes through the tree again in inode order, and the
+     first to name each of them keeps it while the others get a copy
+     of their own, so which file keeps what doesn't depend on how the
+     threads ran.
+  4. The bitmaps on the image are compared with the rebuilt ones, and
+     the free counts in the superblock with what those leave.
+
+  Every problem found is reported.  Without -y nothing is written;
+  with it, bad entries and pointers are dropped, shared blocks copied
+  (or, with no room for the copy, dropped), inodes in no
+  directory and blocks no file has are freed (the blocks punched out
+  of the image), the rebuilt bitmaps written out and the image marked
+  clean.  Exits as fsck(8) does: 0 if the image was fine, 1 if
+  problems were fixed, 4 if some were left, 8 if it couldn't be
+  checked at all.
+*/
+
+#include "params.h"
+#include "block.h"
+#include "journal.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_UNFIXED 4
+#define FSCK_ERROR 8
+#define FSCK_USAGE 16
+
+#define FSCK_RUN 256		// blocks read at a time streaming the inode table and bitmaps
+#define MAX_THREADS 64
+
+extern int diskfile;
+
+// An inode the inode bitmap has in use
+struct file {
+    inode node;
+    int ino;
+    int in_tree;		// the root, or named by an entry in the tree
+    int dirty;			// node changed, to be written back
+    int past_end;		// pointers dropped for being past the end of the file
+};
+
+static const char *image;
+static int fix;
+static int nthreads;
+static struct file *files;	// in inode order
+static int nfiles;
+static int *file_of;		// index into files of each inode, -1 if free
+static unsigned char *inode_map;	// the inode bitmap as on the image
+static unsigned char *data_used;	// the data bitmap, rebuilt from the files
+static unsigned char *data_shared;	// blocks pass 3 found named more than once
+static int shared_found;
+static int next_job;		// the next chunk or file for a thread to take
+static int problems;
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void usage()
+{
+    fprintf(stderr, "usage:  fsck.sfs [-n | -y] [-j threads] image\n");
+    exit(FSCK_USAGE);
+}
+
+/* Reports a problem and counts it; what -y does about it is said by
+ * the message, so it only adds that it was done
+ */
+static void problem(const char *fmt, ...)
+{
+    va_list ap;
+
+    pthread_mutex_lock(&print_lock);
+    problems++;
+    printf("%s: ", image);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("%s\n", fix ? " (fixed)" : "");
+    pthread_mutex_unlock(&print_lock);
+}
+
+static int test_bit(const unsigned char *map, int64_t n)
+{
+    return (map[n / BITS_PER_BYTE] >> (ZERO_INDEX_BITS - n % BITS_PER_BYTE)) & 1;
+}
+
+static int64_t bitmap_bytes(int64_t bits)
+{
+    return (bits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK * BLOCK_SIZE;
+}
+
+/* Reads a bitmap off the image in chunks of FSCK_RUN blocks */
+static void read_bitmap(int64_t start, int64_t bytes, unsigned char *map)
+{
+    int64_t blk;
+    int n;
+
+    for (blk = 0; blk < bytes / BLOCK_SIZE; blk += n) {
+	n = bytes / BLOCK_SIZE - blk < FSCK_RUN ? bytes / BLOCK_SIZE - blk : FSCK_RUN;
+	block_read_run(start + blk, n, map + blk * BLOCK_SIZE);
+    }
+}
+
+/* Marks a data block as used in the rebuilt bitmap; any thread may
+ * INPUT: the block, counted from the start of the data region
+ * OUTPUT: 0, 1 if something had claimed it already, or -1 if it is
+ *         outside the data region (block 0, the root's record, is
+ *         claimed up front)
+ */
+static int claim(int64_t block)
+{
+    unsigned char bit;
+
+    if (block <= 0 || block >= info.dataregion_blocks)
+	return -1;
+    bit = 1 << (ZERO_INDEX_BITS - block % BITS_PER_BYTE);
+    return (__atomic_fetch_or(&data_used[block / BITS_PER_BYTE], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+static void unclaim(int64_t block)
+{
+    unsigned char bit = 1 << (ZERO_INDEX_BITS - block % BITS_PER_BYTE);
+
+    __atomic_fetch_and(&data_used[block / BITS_PER_BYTE], (unsigned char) ~bit, __ATOMIC_RELAXED);
+}
+
+// Notes a block claimed a second time, for share_blocks
+static void mark_shared(int64_t block)
+{
+    unsigned char bit = 1 << (ZERO_INDEX_BITS - block % BITS_PER_BYTE);
+
+    __atomic_fetch_or(&data_shared[block / BITS_PER_BYTE], bit, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared_found, 1, __ATOMIC_RELAXED);
+}
+
+/* Runs a pass on every thread, the calling one among them; each takes
+ * jobs from next_job until there are none left
+ */
+static void run_threads(void *(*pass)(void *))
+{
+    pthread_t threads[MAX_THREADS];
+    int i, started;
+
+    next_job = 0;
+    for (started = 0; started < nthreads - 1; started++)
+	if (pthread_create(&threads[started], NULL, pass, NULL) != 0)
+	    break;
+    pass(NULL);
+    for (i = 0; i < started; i++)
+	pthread_join(threads[i], NULL);
+}
+
+/* Pass 1: copies the inodes in use out of the inode table, a chunk of
+ * FSCK_RUN blocks at a time
+ */
+static void *scan_inodes(void *arg)
+{
+    inode_block *buf = malloc(FSCK_RUN * sizeof(inode_block));
+    int64_t per_group = (info.inode_blocks + SFS_INODE_GROUPS - 1) / SFS_INODE_GROUPS;
+    int64_t first, blk;
+    int n, i, ino, any;
+
+    if (buf == NULL) {
+	perror("fsck.sfs");
+	exit(FSCK_ERROR);
+    }
+    while ((first = (int64_t) __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED) * FSCK_RUN)
+	   < info.inode_blocks) {
+	n = info.inode_blocks - first < FSCK_RUN ? info.inode_blocks - first : FSCK_RUN;
+	// FSCK_RUN blocks of inodes are a whole number of bitmap bytes
+	any = 0;
+	for (i = first * INODES_PER_BLOCK / BITS_PER_BYTE;
+	     i < (first + n) * INODES_PER_BLOCK / BITS_PER_BYTE && !any; i++)
+	    any = inode_map[i] != 0;
+	if (!any)
+	    continue;
+	block_read_run(info.inode_blocks_start + first, n, buf);
+	for (blk = first; blk < first + n; blk++) {
+	    // blocks not zeroed yet hold only free inodes, as libsfs has them
+	    if (blk % per_group >= info.inode_table_init[blk / per_group])
+		memset(&buf[blk - first], 0, sizeof(inode_block));
+	    for (i = 0; i < INODES_PER_BLOCK; i++) {
+		ino = blk * INODES_PER_BLOCK + i;
+		if (file_of[ino] >= 0)
+		    files[file_of[ino]].node = buf[blk - first].list[i];
+	    }
+	}
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Pass 2: walks the tree from the root, dropping entries that are
+ * damaged, name an inode that isn't in use or is in the tree already,
+ * or repeat a name.  Directories hold 12 entries at most, so this is
+ * little I/O and done by one thread.
+ */
+static void walk_tree()
+{
+    filepath_block fblock, names[12];
+    struct file *dir, *child;
+    int *queue, head = 0, tail = 0;
+    const char *bad;
+    int64_t pointer;
+    int j, k, c, nnames;
+
+    queue = malloc(nfiles * sizeof(int));
+    if (queue == NULL) {
+	perror("fsck.sfs");
+	exit(FSCK_ERROR);
+    }
+
+    // the root is inode 0, and its record data block 0
+    block_read(info.dataregion_blocks_start, &fblock);
+    if (strcmp(fblock.filepath, "/") != 0 || fblock.inode != 0) {
+	problem("the root directory's record is damaged, rewriting it");
+	if (fix) {
+	    memset(&fblock, 0, sizeof(fblock));
+	    strcpy(fblock.filepath, "/");
+	    block_write(info.dataregion_blocks_start, &fblock);
+	}
+    }
+    data_used[0] |= 1 << ZERO_INDEX_BITS;
+    dir = &files[file_of[0]];
+    dir->in_tree = 1;
+    if (!(dir->node.flags & SFS_DIR)) {
+	problem("the root inode is not a directory, making it one");
+	dir->node.flags |= SFS_DIR;
+	dir->dirty = 1;
+    }
+    queue[tail++] = file_of[0];
+
+    while (head < tail) {
+	dir = &files[queue[head++]];
+	if (dir->node.indirect_ptr != 0 || dir->node.tree_ptr != 0 || dir->node.tree_height != 0) {
+	    problem("directory inode %d has indirect blocks, dropping them", dir->ino);
+	    dir->node.indirect_ptr = 0;
+	    dir->node.tree_ptr = 0;
+	    dir->node.tree_height = 0;
+	    dir->dirty = 1;
+	}
+	nnames = 0;
+	for (j = 0; j < 12; j++) {
+	    pointer = dir->node.direct_ptrs[j];
+	    if (pointer == 0)
+		continue;
+	    bad = NULL;
+	    child = NULL;
+	    c = claim(pointer);
+	    if (c < 0) {
+		bad = "points outside the data region";
+	    } else if (c > 0) {
+		bad = "points to a block already in use";
+	    } else {
+		block_read(info.dataregion_blocks_start + pointer, &fblock);
+		if (memchr(fblock.filepath, '\0', sizeof(fblock.filepath)) == NULL
+		    || fblock.filepath[0] == '\0' || strchr(fblock.filepath, '/') != NULL)
+		    bad = "has a damaged name";
+		else if (fblock.inode <= 0 || fblock.inode >= info.total_inodes
+			 || file_of[fblock.inode] < 0)
+		    bad = "names an inode that is not in use";
+		else if ((child = &files[file_of[fblock.inode]])->in_tree)
+		    bad = "names an inode already in the tree";
+		for (k = 0; k < nnames && bad == NULL; k++)
+		    if (strcmp(names[k].filepath, fblock.filepath) == 0)
+			bad = "repeats a name";
+		if (bad != NULL)
+		    unclaim(pointer);
+	    }
+	    if (bad != NULL) {
+		problem("entry %d of directory inode %d %s, dropping it", j, dir->ino, bad);
+		dir->node.direct_ptrs[j] = 0;
+		dir->dirty = 1;
+		continue;
+	    }
+	    names[nnames++] = fblock;
+	    child->in_tree = 1;
+	    if (child->node.flags & SFS_DIR)
+		queue[tail++] = child - files;
+	}
+    }
+    free(queue);
+}
+
+// What a pointer names, by how many levels of pointer blocks are under it
+static const char *const pointer_kinds[SFS_MAX_HEIGHT + 1] = {
+    "pointer", "indirect block", "double indirect block", "triple indirect block",
+    "level 4 pointer block", "level 5 pointer block", "level 6 pointer block"
+};
+
+/* Checks a pointer of a file, and the pointers under it if it names a
+ * pointer block, dropping the bad ones.  A block claimed already is
+ * left to share_blocks, and what is under it to whoever claimed it.
+ * INPUT: the file, the pointer, the first file block it covers, how
+ *        many levels of pointer blocks it names (0 for a data block),
+ *        the file's length in blocks
+ * OUTPUT: 1 if the pointer was dropped, otherwise 0
+ */
+static int check_pointer(struct file *f, int64_t *pointer, int64_t first, int depth, int64_t blocks)
+{
+    int64_t ptrs[PTRS_PER_BLOCK], span = 1;
+    const char *bad = NULL;
+    int i, c, changed = 0;
+
+    if (*pointer == 0)
+	return 0;
+    // the ones past the end are reported once for the whole file
+    if (first >= blocks) {
+	f->past_end++;
+	*pointer = 0;
+	return 1;
+    }
+    c = claim(*pointer);
+    if (c > 0) {
+	mark_shared(*pointer);
+	return 0;
+    }
+    if (c < 0)
+	bad = "points outside the data region";
+    if (bad != NULL) {
+	problem("inode %d: the %s for file block %lld %s, dropping it", f->ino,
+		pointer_kinds[depth], (long long) first, bad);
+	*pointer = 0;
+	return 1;
+    }
+    if (depth == 0)
+	return 0;
+
+    for (i = 1; i < depth; i++)
+	span *= PTRS_PER_BLOCK;
+    block_read(info.dataregion_blocks_start + *pointer, ptrs);
+    for (i = 0; i < PTRS_PER_BLOCK; i++)
+	changed |= check_pointer(f, &ptrs[i], first + i * span, depth - 1, blocks);
+    if (changed && fix)
+	block_write(info.dataregion_blocks_start + *pointer, ptrs);
+    return 0;
+}
+
+/* Pass 3: checks the size and block pointers of each file in the tree */
+static void *check_files(void *arg)
+{
+    int64_t max = (int64_t) MAX_FILE_BLOCKS * BLOCK_SIZE;
+    int64_t blocks;
+    struct file *f;
+    inode *node;
+    int i, j;
+
+    while ((i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED)) < nfiles) {
+	f = &files[i];
+	node = &f->node;
+	if (!f->in_tree || (node->flags & SFS_DIR))
+	    continue;
+	if (node->size < 0 || node->size > max) {
+	    problem("inode %d has size %lld, setting it to %lld", f->ino,
+		    (long long) node->size, (long long) (node->size < 0 ? 0 : max));
+	    node->size = node->size < 0 ? 0 : max;
+	    f->dirty = 1;
+	}
+	blocks = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	for (j = 0; j < 12; j++)
+	    f->dirty |= check_pointer(f, &node->direct_ptrs[j], j, 0, blocks);
+	f->dirty |= check_pointer(f, &node->indirect_ptr, 12, 1, blocks);
+	if ((node->tree_ptr == 0) != (node->tree_height == 0)
+	    || node->tree_height < 0 || node->tree_height > SFS_MAX_HEIGHT) {
+	    problem("inode %d has a pointer tree %d levels high, dropping it", f->ino, node->tree_height);
+	    node->tree_ptr = 0;
+	    node->tree_height = 0;
+	    f->dirty = 1;
+	}
+	f->dirty |= check_pointer(f, &node->tree_ptr, SFS_TREE_FIRST, node->tree_height, blocks);
+	if (node->tree_ptr == 0)
+	    node->tree_height = 0;
+	if (f->past_end > 0)
+	    problem("inode %d has %d block pointers past the end of the file, dropping them",
+		    f->ino, f->past_end);
+    }
+    return NULL;
+}
+
+// A pointer naming a block pass 3 found named more than once
+struct sharer {
+    int64_t block;
+    int file;			// index into files
+    int64_t first;		// the first file block it covers, or the entry for a directory
+    int depth;			// levels of pointer blocks it names, -1 for a directory entry
+    int64_t holder;		// the pointer block it is in, 0 if in the inode
+    int slot;			// where in there: the pointer, or 12 for the indirect block and 13 for the tree in an inode
+    int seq;			// in the order share_blocks found them
+};
+
+static struct sharer *sharers;
+static int nsharers, sharers_size;
+static unsigned char *sharer_seen;	// blocks share_blocks has found a first sharer of
+static unsigned char *data_marked_map;	// the data bitmap as on the image, while copying
+static int64_t *spares;		// blocks taken for copies
+static int nspares, spares_size;
+static int64_t spare_next = 1;
+
+static void add_sharer(struct file *f, int64_t block, int64_t first, int depth, int64_t holder, int slot)
+{
+    if (nsharers == sharers_size) {
+	sharers_size = sharers_size ? 2 * sharers_size : 64;
+	sharers = realloc(sharers, sharers_size * sizeof(struct sharer));
+	if (sharers == NULL) {
+	    perror("fsck.sfs");
+	    exit(FSCK_ERROR);
+	}
+    }
+    sharers[nsharers] = (struct sharer) { block, f - files, first, depth, holder, slot, nsharers };
+    nsharers++;
+}
+
+/* Finds the pointers of a file naming shared blocks, going under a
+ * pointer block only from the first pointer naming it, as pass 3
+ * went under it only once
+ * INPUT: the file, the pointer, the first file block it covers, how
+ *        many levels of pointer blocks it names, the file's length in
+ *        blocks, and where the pointer is (see struct sharer)
+ * OUTPUT: none
+ */
+static void find_sharers(struct file *f, int64_t pointer, int64_t first, int depth, int64_t blocks,
+			 int64_t holder, int slot)
+{
+    int64_t ptrs[PTRS_PER_BLOCK], span = 1;
+    int i;
+
+    // the pointers pass 3 dropped, which without -y are still there
+    if (pointer <= 0 || pointer >= info.dataregion_blocks || first >= blocks)
+	return;
+    if (test_bit(data_shared, pointer)) {
+	add_sharer(f, pointer, first, depth, holder, slot);
+	if (test_bit(sharer_seen, pointer))
+	    return;
+	sharer_seen[pointer / BITS_PER_BYTE] |= 1 << (ZERO_INDEX_BITS - pointer % BITS_PER_BYTE);
+    }
+    if (depth == 0)
+	return;
+
+    for (i = 1; i < depth; i++)
+	span *= PTRS_PER_BLOCK;
+    block_read(info.dataregion_blocks_start + pointer, ptrs);
+    for (i = 0; i < PTRS_PER_BLOCK; i++)
+	find_sharers(f, ptrs[i], first + i * span, depth - 1, blocks, pointer, i);
+}
+
+/* Takes a data block for a copy, one that no file has and that the
+ * image has free too, so pass 4 finds the same with -y or without
+ * INPUT: none
+ * OUTPUT: the block, 0 if the data region is full
+ */
+static int64_t take_spare()
+{
+    while (spare_next < info.dataregion_blocks
+	   && (test_bit(data_used, spare_next) || test_bit(data_marked_map, spare_next)))
+	spare_next++;
+    if (spare_next >= info.dataregion_blocks)
+	return 0;
+    if (nspares == spares_size) {
+	spares_size = spares_size ? 2 * spares_size : 64;
+	spares = realloc(spares, spares_size * sizeof(int64_t));
+	if (spares == NULL) {
+	    perror("fsck.sfs");
+	    exit(FSCK_ERROR);
+	}
+    }
+    claim(spare_next);
+    spares[nspares++] = spare_next;
+    return spare_next++;
+}
+
+// Gives back the blocks taken for copies since there were @mark of them
+static void return_spares(int mark)
+{
+    if (nspares > mark && spares[mark] < spare_next)
+	spare_next = spares[mark];
+    while (nspares > mark)
+	unclaim(spares[--nspares]);
+}
+
+/* Copies a block for a file, and if it is a pointer block what is
+ * under it too, leaving out pointers that are bad for that file; the
+ * copy is only written with -y
+ * INPUT: the block, how many levels of pointer blocks it is, the first
+ *        file block it covers, the file's length in blocks
+ * OUTPUT: the copy, 0 if there is no room for it all
+ */
+static int64_t copy_block(int64_t block, int depth, int64_t first, int64_t blocks)
+{
+    int64_t ptrs[PTRS_PER_BLOCK], span = 1, copy;
+    int i;
+
+    if ((copy = take_spare()) == 0)
+	return 0;
+    if (depth > 0 || fix)
+	block_read(info.dataregion_blocks_start + block, ptrs);
+    if (depth > 0) {
+	for (i = 1; i < depth; i++)
+	    span *= PTRS_PER_BLOCK;
+	for (i = 0; i < PTRS_PER_BLOCK; i++) {
+	    if (ptrs[i] <= 0 || ptrs[i] >= info.dataregion_blocks || first + i * span >= blocks)
+		ptrs[i] = 0;
+	    else if ((ptrs[i] = copy_block(ptrs[i], depth - 1, first + i * span, blocks)) == 0)
+		return 0;
+	}
+    }
+    if (fix)
+	block_write(info.dataregion_blocks_start + copy, ptrs);
+    return copy;
+}
+
+static void describe_sharer(const struct sharer *s, char *buf, size_t size)
+{
+    int ino = files[s->file].ino;
+
+    if (s->depth < 0)
+	snprintf(buf, size, "entry %lld of directory inode %d", (long long) s->first, ino);
+    else
+	snprintf(buf, size, "the %s for file block %lld of inode %d", pointer_kinds[s->depth],
+		 (long long) s->first, ino);
+}
+
+static int compare_sharers(const void *a, const void *b)
+{
+    const struct sharer *x = a, *y = b;
+
+    if (x->block != y->block)
+	return x->block < y->block ? -1 : 1;
+    return x->seq - y->seq;
+}
+
+/* Pass 3, for blocks named more than once: goes through the tree in
+ * inode order, directories first (pass 2 has settled their entries
+ * before any file), finding every pointer to them.  The first keeps
+ * the block; every other one gets a copy of its own, or is dropped if
+ * there is no room left for it.  One thread does it all, so the
+ * outcome is the same on every run, with -y or without.
+ */
+static void share_blocks()
+{
+    char keeper[128], other[128];
+    struct sharer *s, *k = NULL;
+    struct file *f;
+    int64_t blocks, copy, ptrs[PTRS_PER_BLOCK];
+    int i, j, mark;
+
+    sharer_seen = calloc(bitmap_bytes(info.dataregion_blocks), 1);
+    data_marked_map = malloc(bitmap_bytes(info.dataregion_blocks));
+    if (sharer_seen == NULL || data_marked_map == NULL) {
+	perror("fsck.sfs");
+	exit(FSCK_ERROR);
+    }
+    read_bitmap(info.dataregion_bitmap_start, bitmap_bytes(info.dataregion_blocks), data_marked_map);
+    for (i = 0; i < nfiles; i++) {
+	f = &files[i];
+	if (!f->in_tree || !(f->node.flags & SFS_DIR))
+	    continue;
+	mark = nsharers;
+	for (j = 0; j < 12; j++)
+	    find_sharers(f, f->node.direct_ptrs[j], j, 0, 12, 0, j);
+	// they were found as data blocks, but are entries
+	for (j = mark; j < nsharers; j++)
+	    sharers[j].depth = -1;
+    }
+    for (i = 0; i < nfiles; i++) {
+	f = &files[i];
+	if (!f->in_tree || (f->node.flags & SFS_DIR))
+	    continue;
+	blocks = (f->node.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	for (j = 0; j < 12; j++)
+	    find_sharers(f, f->node.direct_ptrs[j], j, 0, blocks, 0, j);
+	find_sharers(f, f->node.indirect_ptr, 12, 1, blocks, 0, 12);
+	find_sharers(f, f->node.tree_ptr, SFS_TREE_FIRST, f->node.tree_height, blocks, 0, 13);
+    }
+    free(sharer_seen);
+
+    qsort(sharers, nsharers, sizeof(struct sharer), compare_sharers);
+    for (s = sharers; s < sharers + nsharers; s++) {
+	if (s == sharers || s[-1].block != s->block) {
+	    k = s;
+	    continue;
+	}
+	f = &files[s->file];
+	blocks = (f->node.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	mark = nspares;
+	copy = copy_block(s->block, s->depth, s->first, blocks);
+	if (copy == 0)
+	    return_spares(mark);
+	describe_sharer(k, keeper, sizeof(keeper));
+	describe_sharer(s, other, sizeof(other));
+	problem("data block %lld is named by %s and by %s, %s the latter", (long long) s->block,
+		keeper, other, copy != 0 ? "copying it for" : "with no room to copy it, dropping");
+	if (s->holder == 0) {
+	    if (s->slot < 12)
+		f->node.direct_ptrs[s->slot] = copy;
+	    else if (s->slot == 12)
+		f->node.indirect_ptr = copy;
+	    else if ((f->node.tree_ptr = copy) == 0)
+		f->node.tree_height = 0;
+	    f->dirty = 1;
+	} else if (fix) {
+	    block_read(info.dataregion_blocks_start + s->holder, ptrs);
+	    ptrs[s->slot] = copy;
+	    block_write(info.dataregion_blocks_start + s->holder, ptrs);
+	}
+    }
+    free(data_marked_map);
+    free(sharers);
+    free(spares);
+}
+
+/* Writes back an inode pass 2 or 3 changed, zeroing the inode table up
+ * to it first if libsfs hasn't got that far
+ */
+static void write_inode(struct file *f)
+{
+    int64_t per_group = (info.inode_blocks + SFS_INODE_GROUPS - 1) / SFS_INODE_GROUPS;
+    int64_t blk = f->ino / INODES_PER_BLOCK;
+    int64_t group = blk / per_group;
+    inode_block buf;
+
+    if (blk % per_group >= info.inode_table_init[group]) {
+	block_zero(info.inode_blocks_start + group * per_group + info.inode_table_init[group],
+		   blk % per_group + 1 - info.inode_table_init[group]);
+	info.inode_table_init[group] = blk % per_group + 1;
+    }
+    block_read(info.inode_blocks_start + blk, &buf);
+    buf.list[f->ino % INODES_PER_BLOCK] = f->node;
+    block_write(info.inode_blocks_start + blk, &buf);
+}
+
+// What pass 4 finds in the data bitmap, added up over the threads
+static int64_t data_in_use;	// blocks the rebuilt bitmap has in use
+static int64_t data_marked;	// blocks the image's marks in use
+static int64_t data_leaked;	// marked, but no file has them
+static int64_t data_missing;	// some file has them, but not marked
+
+/* Pass 4, for the data bitmap: compares the image's with the rebuilt
+ * one a chunk of FSCK_RUN blocks at a time, and with -y writes the
+ * rebuilt one over it and punches out the blocks it frees
+ */
+static void *check_data_bitmap(void *arg)
+{
+    unsigned char *disk = malloc(FSCK_RUN * BLOCK_SIZE);
+    int64_t nblocks = bitmap_bytes(info.dataregion_blocks) / BLOCK_SIZE;
+    int64_t blk, byte, bit, start, last, used = 0, marked = 0, leaked = 0, missing = 0;
+    uint64_t dw, rw;
+    unsigned char mask, d, r;
+    int n, differ;
+
+    if (disk == NULL) {
+	perror("fsck.sfs");
+	exit(FSCK_ERROR);
+    }
+    while ((blk = (int64_t) __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED) * FSCK_RUN) < nblocks) {
+	n = nblocks - blk < FSCK_RUN ? nblocks - blk : FSCK_RUN;
+	block_read_run(info.dataregion_bitmap_start + blk, n, disk);
+	differ = 0;
+	byte = blk * BLOCK_SIZE;
+	// a word at a time while all its bits are in the data region
+	for (; byte < (blk + n) * BLOCK_SIZE
+	       && (byte + sizeof(uint64_t)) * BITS_PER_BYTE <= info.dataregion_blocks;
+	     byte += sizeof(uint64_t)) {
+	    dw = *(uint64_t *) (disk + byte - blk * BLOCK_SIZE);
+	    rw = *(uint64_t *) (data_used + byte);
+	    used += __builtin_popcountll(rw);
+	    marked += __builtin_popcountll(dw);
+	    if (dw != rw) {
+		differ = 1;
+		leaked += __builtin_popcountll(dw & ~rw);
+		missing += __builtin_popcountll(rw & ~dw);
+	    }
+	}
+	// then a byte at a time, masking off bits past the end
+	for (; byte < (blk + n) * BLOCK_SIZE; byte++) {
+	    last = info.dataregion_blocks - byte * BITS_PER_BYTE;
+	    mask = last >= BITS_PER_BYTE ? 0xff : last <= 0 ? 0 : (unsigned char) (0xff << (BITS_PER_BYTE - last));
+	    d = disk[byte - blk * BLOCK_SIZE];
+	    r = data_used[byte];
+	    used += __builtin_popcount(r);
+	    marked += __builtin_popcount(d & mask);
+	    if (d != r) {
+		differ = 1;
+		leaked += __builtin_popcount(d & ~r & mask);
+		missing += __builtin_popcount(r & ~d & mask);
+	    }
+	}
+	if (!differ || !fix)
+	    continue;
+	block_write_run(info.dataregion_bitmap_start + blk, n, data_used + blk * BLOCK_SIZE);
+	// punch each run of blocks freed
+	start = -1;
+	for (bit = blk * BITS_PER_BLOCK; bit <= (blk + n) * BITS_PER_BLOCK && bit <= info.dataregion_blocks; bit++) {
+	    if (bit < (blk + n) * BITS_PER_BLOCK && bit < info.dataregion_blocks
+		&& test_bit(disk, bit - blk * BITS_PER_BLOCK) && !test_bit(data_used, bit)) {
+		if (start < 0)
+		    start = bit;
+	    } else if (start >= 0) {
+		block_punch(info.dataregion_blocks_start + start, bit - start);
+		start = -1;
+	    }
+	}
+    }
+    free(disk);
+
+    __atomic_add_fetch(&data_in_use, used, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&data_marked, marked, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&data_leaked, leaked, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&data_missing, missing, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* Pass 4, for the inode bitmap: frees the inodes in use that are in no
+ * directory, and writes the rebuilt bitmap with -y
+ * INPUT: none
+ * OUTPUT: how many inodes are in use; all nfiles of them are marked
+ */
+static int check_inode_bitmap()
+{
+    int64_t bytes = bitmap_bytes(info.total_inodes);
+    unsigned char *map = calloc(bytes, 1);
+    int i, used = 0;
+
+    if (map == NULL) {
+	perror("fsck.sfs");
+	exit(FSCK_ERROR);
+    }
+    for (i = 0; i < nfiles; i++) {
+	if (!files[i].in_tree) {
+	    problem("inode %d is in use but in no directory, freeing it", files[i].ino);
+	    continue;
+	}
+	map[files[i].ino / BITS_PER_BYTE] |= 1 << (ZERO_INDEX_BITS - files[i].ino % BITS_PER_BYTE);
+	used++;
+    }
+    if (fix && memcmp(map, inode_map, bytes) != 0)
+	block_write_run(info.inode_bitmap_start, bytes / BLOCK_SIZE, map);
+    free(map);
+    return used;
+}
+
+static void write_superblock(int clean, int64_t free_data, int64_t free_inodes)
+{
+    super_block sblock;
+
+    memset(&sblock, 0, sizeof(sblock));
+    info.clean = clean;
+    info.free_datablocks = free_data;
+    info.free_inodes = free_inodes;
+    sblock.list[0] = info;
+    block_write(0, &sblock);
+}
+
+int main(int argc, char *argv[])
+{
+    super_block sblock;
+    struct timespec t0, t1;
+    struct stat sb;
+    const char *bad;
+    int64_t inodes_used;
+    int c, i, n, was_clean;
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((c = getopt(argc, argv, "nyj:")) != -1) {
+	switch (c) {
+	case 'n':
+	    fix = 0;
+	    break;
+	case 'y':
+	    fix = 1;
+	    break;
+	case 'j':
+	    nthreads = atoi(optarg);
+	    if (nthreads <= 0)
+		usage();
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind != argc - 1)
+	usage();
+    image = argv[optind];
+    nthreads = nthreads < 1 ? 1 : nthreads > MAX_THREADS ? MAX_THREADS : nthreads;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if (disk_open(image) != 0 || fstat(diskfile, &sb) < 0)
+	return FSCK_ERROR;
+    if (block_read(0, &sblock) != BLOCK_SIZE || sblock.list[0].magic != SFS_MAGIC) {
+	fprintf(stderr, "%s: not an sfs image\n", image);
+	return FSCK_ERROR;
+    }
+    info = sblock.list[0];
+    if (info.version != SFS_VERSION) {
+	fprintf(stderr, "%s: layout version %d, not %d\n", image, info.version, SFS_VERSION);
+	return FSCK_ERROR;
+    }
+    if ((bad = check_metadata_info(sb.st_size)) != NULL) {
+	fprintf(stderr, "%s: can't check, the superblock is damaged: %s\n", image, bad);
+	return FSCK_ERROR;
+    }
+    // checked without the commits still in the journal, the image
+    // would seem to have lost whatever they did
+    n = journal_replay(!fix);
+    if (n < 0) {
+	problem("the header of the journal is damaged, clearing the journal");
+	if (fix)
+	    journal_format();
+    }
+    else if (n > 0 && !fix) {
+	printf("%s: the journal holds %d transaction%s not yet in place, run with -y to replay\n",
+	       image, n, n == 1 ? "" : "s");
+	return FSCK_UNFIXED;
+    }
+    else if (n > 0) {
+	printf("%s: replayed %d transaction%s from the journal\n", image, n, n == 1 ? "" : "s");
+	block_read(0, &sblock);
+	info = sblock.list[0];
+	if (info.magic != SFS_MAGIC || (bad = check_metadata_info(sb.st_size)) != NULL) {
+	    fprintf(stderr, "%s: the journal left a damaged superblock: %s\n", image,
+		    info.magic != SFS_MAGIC ? "not an sfs superblock" : bad);
+	    return FSCK_ERROR;
+	}
+	info.clean = 0;
+    }
+    was_clean = info.clean;
+    if (!was_clean)
+	printf("%s: was not unmounted cleanly\n", image);
+
+    inode_map = calloc(bitmap_bytes(info.total_inodes), 1);
+    data_used = calloc(bitmap_bytes(info.dataregion_blocks), 1);
+    data_shared = calloc(bitmap_bytes(info.dataregion_blocks), 1);
+    file_of = malloc(info.total_inodes * sizeof(int));
+    if (inode_map == NULL || data_used == NULL || data_shared == NULL || file_of == NULL) {
+	perror("fsck.sfs");
+	return FSCK_ERROR;
+    }
+    read_bitmap(info.inode_bitmap_start, bitmap_bytes(info.total_inodes), inode_map);
+    if (!test_bit(inode_map, 0)) {
+	problem("the root inode is marked free, marking it");
+	inode_map[0] |= 1 << ZERO_INDEX_BITS;
+    }
+    for (i = 0; i < info.total_inodes; i++)
+	file_of[i] = test_bit(inode_map, i) ? nfiles++ : -1;
+    files = calloc(nfiles, sizeof(struct file));
+    if (files == NULL) {
+	perror("fsck.sfs");
+	return FSCK_ERROR;
+    }
+    for (i = 0, n = 0; i < info.total_inodes; i++)
+	if (file_of[i] >= 0)
+	    files[n++].ino = i;
+
+    run_threads(scan_inodes);
+    // from here on the image may be changed; until it is all done, it
+    // is marked as if it wasn't unmounted cleanly
+    if (fix)
+	write_superblock(0, info.free_datablocks, info.free_inodes);
+    walk_tree();
+    run_threads(check_files);
+    if (shared_found)
+	share_blocks();
+
+    if (fix)
+	for (i = 0; i < nfiles; i++)
+	    if (files[i].dirty && files[i].in_tree)
+		write_inode(&files[i]);
+    inodes_used = check_inode_bitmap();
+    run_threads(check_data_bitmap);
+    // the copies share_blocks made aren't marked yet, with -y or without
+    data_missing -= nspares;
+    if (data_leaked > 0)
+	problem("%lld data blocks are marked in use but no file has them, freeing them",
+		(long long) data_leaked);
+    if (data_missing > 0)
+	problem("%lld data blocks in use are marked free, marking them", (long long) data_missing);
+    // counts on an image not unmounted cleanly are redone by libsfs anyway
+    if (was_clean && (info.free_datablocks != info.dataregion_blocks - data_marked
+		      || info.free_inodes != info.total_inodes - nfiles))
+	problem("the free counts in the superblock don't match the bitmaps, correcting them");
+    if (fix) {
+	write_superblock(1, info.dataregion_blocks - data_in_use, info.total_inodes - inodes_used);
+	fsync(diskfile);
+    }
+    disk_close();
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("%s: %lld/%lld data blocks, %lld/%lld inodes in use, %d problem%s, checked in %.2f s\n",
+	   image, (long long) data_in_use, (long long) info.dataregion_blocks,
+	   (long long) inodes_used, (long long) info.total_inodes, problems, problems == 1 ? "" : "s",
+	   (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+
+    if (problems == 0)
+	return FSCK_OK;
+    return fix ? FSCK_FIXED : FSCK_UNFIXED;
+}
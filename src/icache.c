@@ -0,0 +1,100 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  The in-core inode table.  The kernel is allowed to keep a file's
+  pages across opens (keep_cache) only when nothing changed the file
+  since the previous open; the generation counters kept here are how
+  sfs tells the two cases apart.
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "icache.h"
+#include "stats.h"
+
+static struct icache_entry *table = NULL;
+static int table_size = 0;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int icache_init(int total_inodes)
+{
+    table = calloc(total_inodes, sizeof(struct icache_entry));
+    if (table == NULL)
+	return -1;
+    table_size = total_inodes;
+
+    return 0;
+}
+
+void icache_destroy()
+{
+    free(table);
+    table = NULL;
+    table_size = 0;
+}
+
+/** Forget everything known about an inode
+ *
+ * Called when an inode number is handed out to a new file, so the new
+ * file cannot inherit the cached pages of the one it replaces.
+ */
+void icache_reset(int inode_number)
+{
+    if (inode_number < 0 || inode_number >= table_size)
+	return;
+
+    pthread_mutex_lock(&table_lock);
+    table[inode_number].mod_gen++;
+    table[inode_number].open_gen = 0;
+    pthread_mutex_unlock(&table_lock);
+}
+
+/** Record that the contents or size of a file changed */
+void icache_modified(int inode_number)
+{
+    if (inode_number < 0 || inode_number >= table_size)
+	return;
+
+    pthread_mutex_lock(&table_lock);
+    table[inode_number].mod_gen++;
+    pthread_mutex_unlock(&table_lock);
+}
+
+/** Record an open of a file
+ *
+ * Returns 1 if the file has not been modified since it was last
+ * opened, i.e. the kernel may keep the pages it already has.
+ */
+int icache_open(int inode_number)
+{
+    int keep;
+
+    if (inode_number < 0 || inode_number >= table_size)
+	return 0;
+
+    pthread_mutex_lock(&table_lock);
+    keep = (table[inode_number].open_gen == table[inode_number].mod_gen);
+    table[inode_number].open_gen = table[inode_number].mod_gen;
+    pthread_mutex_unlock(&table_lock);
+    stats_count(keep ? STATS_CACHE_HITS : STATS_CACHE_MISSES, 1);
+
+    return keep;
+}
+
+/** How many inodes have in-core state, out of how many entries */
+void icache_occupancy(int *used, int *size)
+{
+    int i, n = 0;
+
+    pthread_mutex_lock(&table_lock);
+    for (i = 0; i < table_size; i++)
+	if (table[i].mod_gen != 0 || table[i].open_gen != 0)
+	    n++;
+    *size = table_size;
+    pthread_mutex_unlock(&table_lock);
+    *used = n;
+}
@@ -0,0 +1,25 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _ICACHE_H_
+#define _ICACHE_H_
+
+// In-core state kept for every inode while the filesystem is mounted.
+// None of this is ever written to the disk image.
+struct icache_entry {
+    unsigned long mod_gen;	// bumped every time the file is changed
+    unsigned long open_gen;	// value of mod_gen seen by the last open
+};
+
+int icache_init(int total_inodes);
+void icache_destroy();
+void icache_reset(int inode_number);
+void icache_modified(int inode_number);
+int icache_open(int inode_number);
+void icache_occupancy(int *used, int *size);
+
+#endif
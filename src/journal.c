@@ -0,0 +1,911 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  The metadata journal.  Changes to the bitmaps, the inode table,
+  directory entries, pointer blocks and the superblock are not written
+  in place as they are made: journal_write keeps the new contents of
+  the block in memory, in the running transaction, and journal_read
+  sees them there.  Every journal_commit_ms, or sooner once enough has
+  piled up, a thread commits the running transaction while the next
+  one fills: its blocks go to the journal, a region mkfs.sfs reserves
+  after the inode table, in one sequential write followed by a single
+  fdatasync, and only then to their places in the image, with no sync
+  of their own.  However many operations a transaction gathers, they
+  cost one write and one sync, and after a crash journal_replay puts
+  back what the last commits had not yet put in place.
+
+  The journal is a header block followed by a ring of records, one per
+  transaction:
+
+    descriptor  the sequence number of the transaction and up to
+		JOURNAL_ENTRIES entries, each a block whose contents
+		follow or a range of blocks freed in it (a revoke)
+    contents    one block for each block entry of the descriptor
+    ...         more descriptors and contents, for a big transaction
+    commit      the sequence number, the length of the record and a
+		checksum of everything in it before
+
+  The header names the record replay starts from.  Blocks put in place
+  after a commit are only known to be on disk once the next commit has
+  synced, so the header moves up a record at a time, written along
+  with the record after it.  The commit block is written with the rest
+  of its record, not after a sync of its own; the checksum tells a
+  record cut short.  File data is written outside the journal, so a
+  crash can lose file data written since the last commit, even where
+  the metadata made it.
+
+  A revoke keeps replay from putting back an older copy of a block
+  freed since, which may hold file data by then.  Until the commit
+  freeing a block is on disk, a crash would leave the block where it
+  was, so journal_reusable keeps it from being allocated again before
+  then; once the commit is on disk its space goes back to the host
+  (block_punch).
+
+  An operation brackets its changes with journal_begin and journal_end
+  so they land in one transaction even when it lets go of the lock in
+  between, as libsfs_write does while it writes the data: a running
+  transaction is not handed to the commit thread while any operation
+  is inside it.
+
+  Until journal_start, and after journal_stop, reads and writes go
+  straight to the image, as they do on an image with no journal.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "block.h"
+#include "journal.h"
+#include "log.h"
+#include "stats.h"
+
+extern int diskfile;
+
+#define JOURNAL_MAGIC 0x4c4e524a	// "JRNL" on disk, in the header
+#define JOURNAL_DESC_MAGIC 0x43534544	// "DESC"
+#define JOURNAL_COMMIT_MAGIC 0x54494d43	// "CMIT"
+#define JOURNAL_ENTRIES ((BLOCK_SIZE - 16) / 8)	// held by a descriptor, an even number
+#define JOURNAL_HASH 4096	// buckets of the table of blocks not yet in place
+#define CHECKSUM_INIT 2166136261u
+
+// The running transaction is committed early once it holds an eighth
+// of the ring, and calls wait in journal_begin once it holds a quarter
+#define JOURNAL_BATCH(ring) ((ring) / 8 + 1)
+#define JOURNAL_FULL(ring) ((ring) / 4 + 1)
+
+int journal_commit_ms = 50;
+
+struct journal_header {
+    uint32_t magic;
+    uint32_t unused;
+    uint64_t seq;		// lowest sequence number replay takes
+    int64_t offset;		// where in the ring replay starts
+    char pad[BLOCK_SIZE - 24];
+};
+
+// An entry of 0 or more is a block whose contents follow; -(first + 1)
+// is a revoke of the blocks from first on, how many in the next entry
+struct journal_desc {
+    uint32_t magic;
+    uint32_t count;		// entries used
+    uint64_t seq;
+    int64_t entries[JOURNAL_ENTRIES];
+};
+
+struct journal_commit {
+    uint32_t magic;
+    uint32_t checksum;		// of the blocks of the record before this one
+    uint64_t seq;
+    int64_t length;		// blocks in the record, this one included
+    char pad[BLOCK_SIZE - 24];
+};
+
+struct extent {
+    int64_t first;
+    int64_t count;
+    uint64_t seq;		// of the transaction freeing it, for replay
+};
+
+struct extents {
+    struct extent *list;
+    int count, size;
+};
+
+struct txn;
+
+// A block changed by a transaction, not yet put in place
+struct jblock {
+    int64_t number;
+    struct txn *txn;
+    int revoked;		// freed since, not to be put in place
+    struct jblock *hash_next;	// newer copies of a block come first
+    struct jblock *txn_next;
+    char data[BLOCK_SIZE];
+};
+
+struct txn {
+    uint64_t seq;
+    int nblocks;
+    struct jblock *blocks;
+    struct extents freed;	// revoked, and punched once committed
+};
+
+// Guards the table, both transactions and the state of the commits.
+// Taken after the caller's lock when both are held.
+static pthread_mutex_t jlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;	// wakes the commit thread
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;	// a commit finished
+static pthread_cond_t room_cond = PTHREAD_COND_INITIALIZER;	// a new transaction was started
+static pthread_cond_t swap_cond = PTHREAD_COND_INITIALIZER;	// the last operation in the old one ended
+
+// Changed with both the caller's lock and jlock held, so either will
+// do for reading it
+static int active = 0;
+static int stopping = 0;
+static pthread_t commit_thread;
+static pthread_mutex_t *caller_lock;
+
+// Operations between journal_begin and journal_end, and whether the
+// commit thread is waiting for them to finish to swap out the running
+// transaction.  Guarded by the caller's lock.
+static int updates = 0;
+static int swapping = 0;
+
+static struct jblock *table[JOURNAL_HASH];
+static struct txn txns[2];
+static struct txn *running = &txns[0];
+static uint64_t committed_seq;	// everything up to it is on disk
+static uint64_t sync_seq;	// journal_sync is waiting for it
+static int commit_error;
+
+// The ring, used by the commit thread alone.  live counts the blocks
+// from the record the header on disk names up to head, which must be
+// kept; last_* is the record before head, 0 long if the header already
+// names head.
+static int64_t ring_blocks;
+static int64_t head, live;
+static uint64_t last_seq;
+static int64_t last_offset, last_length;
+
+// Blocks in the image, which replay writes no further than
+static int64_t image_blocks;
+
+static int64_t ring_block(int64_t offset)
+{
+    return info.journal_start + 1 + offset % ring_blocks;
+}
+
+// FNV-1a, which is plenty to tell a record cut short
+static uint32_t checksum(uint32_t sum, const void *buf, size_t length)
+{
+    const unsigned char *p = buf;
+    size_t i;
+
+    for (i = 0; i < length; i++)
+	sum = (sum ^ p[i]) * 16777619u;
+    return sum;
+}
+
+static int write_header(uint64_t seq, int64_t offset)
+{
+    struct journal_header h;
+
+    memset(&h, 0, sizeof(h));
+    h.magic = JOURNAL_MAGIC;
+    h.seq = seq;
+    h.offset = offset;
+    return block_write(info.journal_start, &h) == BLOCK_SIZE ? 0 : -EIO;
+}
+
+static int extent_add(struct extents *e, int64_t first, int64_t count, uint64_t seq)
+{
+    struct extent *last = e->count > 0 ? &e->list[e->count - 1] : NULL;
+
+    if (last != NULL && last->seq == seq && last->first + last->count == first) {
+	last->count += count;
+	return 0;
+    }
+    if (e->count == e->size) {
+	int size = e->size > 0 ? e->size * 2 : 16;
+	struct extent *list = realloc(e->list, size * sizeof(struct extent));
+
+	if (list == NULL)
+	    return -ENOMEM;
+	e->list = list;
+	e->size = size;
+    }
+    e->list[e->count].first = first;
+    e->list[e->count].count = count;
+    e->list[e->count].seq = seq;
+    e->count++;
+    return 0;
+}
+
+static struct jblock **bucket(int64_t number)
+{
+    return &table[(uint64_t) number % JOURNAL_HASH];
+}
+
+// The newest copy of a block not yet in place, NULL if there is none
+static struct jblock *lookup(int64_t number)
+{
+    struct jblock *b;
+
+    for (b = *bucket(number); b != NULL; b = b->hash_next)
+	if (b->number == number)
+	    return b;
+    return NULL;
+}
+
+static void unhash(struct jblock *b)
+{
+    struct jblock **p = bucket(b->number);
+
+    while (*p != b)
+	p = &(*p)->hash_next;
+    *p = b->hash_next;
+}
+
+/** Read a metadata block, as the last journal_write left it */
+int journal_read(int64_t block, void *buf)
+{
+    struct jblock *b;
+
+    if (active) {
+	pthread_mutex_lock(&jlock);
+	b = lookup(block);
+	if (b != NULL) {
+	    memcpy(buf, b->data, BLOCK_SIZE);
+	    pthread_mutex_unlock(&jlock);
+	    return BLOCK_SIZE;
+	}
+	pthread_mutex_unlock(&jlock);
+    }
+    return block_read(block, buf);
+}
+
+/** Write a metadata block as part of the running transaction
+ *
+ * Returns BLOCK_SIZE, as block_write does, or -errno.
+ */
+int journal_write(int64_t block, const void *buf)
+{
+    struct jblock *b;
+
+    if (!active)
+	return block_write(block, buf);
+    pthread_mutex_lock(&jlock);
+    b = lookup(block);
+    if (b == NULL || b->txn != running) {
+	b = malloc(sizeof(struct jblock));
+	if (b == NULL) {
+	    pthread_mutex_unlock(&jlock);
+	    log_error("journal_write: out of memory for block %lld\n", (long long) block);
+	    return -ENOMEM;
+	}
+	b->number = block;
+	b->txn = running;
+	b->hash_next = *bucket(block);
+	*bucket(block) = b;
+	b->txn_next = running->blocks;
+	running->blocks = b;
+	if (++running->nblocks == JOURNAL_BATCH(ring_blocks))
+	    pthread_cond_signal(&commit_cond);
+    }
+    b->revoked = 0;
+    memcpy(b->data, buf, BLOCK_SIZE);
+    pthread_mutex_unlock(&jlock);
+    return BLOCK_SIZE;
+}
+
+/** Free @count blocks from @first on, metadata or file data
+ *
+ * Copies of them in the journal are revoked, and their space goes back
+ * to the host once the running transaction is committed.
+ */
+void journal_free(int64_t first, int64_t count)
+{
+    struct jblock *b;
+    int64_t i;
+
+    if (!active) {
+	block_punch(first, count);
+	return;
+    }
+    pthread_mutex_lock(&jlock);
+    for (i = first; i < first + count; i++)
+	for (b = *bucket(i); b != NULL; b = b->hash_next)
+	    if (b->number == i)
+		b->revoked = 1;
+    if (extent_add(&running->freed, first, count, running->seq) != 0)
+	log_error("journal_free: out of memory, blocks %lld.. may come back in a replay\n",
+		  (long long) first);
+    pthread_mutex_unlock(&jlock);
+}
+
+/** How many blocks from @block on, up to @count, may be allocated again
+ *
+ * Blocks freed by a transaction that isn't on disk yet may not: after
+ * a crash they would still belong where they were.  Returns -n instead
+ * if @block is the first of n such blocks in a row.  Called with the
+ * caller's lock held.
+ */
+int64_t journal_reusable(int64_t block, int64_t count)
+{
+    const struct extent *x;
+    int64_t n = count;
+    int i, j;
+
+    if (!active)
+	return count;
+    pthread_mutex_lock(&jlock);
+    for (j = 0; j < 2; j++) {
+	for (i = 0; i < txns[j].freed.count; i++) {
+	    x = &txns[j].freed.list[i];
+	    if (block >= x->first && block < x->first + x->count) {
+		pthread_mutex_unlock(&jlock);
+		return block - (x->first + x->count);
+	    }
+	    if (x->first > block && x->first - block < n)
+		n = x->first - block;
+	}
+    }
+    pthread_mutex_unlock(&jlock);
+    return n;
+}
+
+/** Whether blocks freed so far wait for a commit to be allocated again */
+int journal_freeing(void)
+{
+    int freeing;
+
+    if (!active)
+	return 0;
+    pthread_mutex_lock(&jlock);
+    freeing = txns[0].freed.count > 0 || txns[1].freed.count > 0;
+    pthread_mutex_unlock(&jlock);
+    return freeing;
+}
+
+/** Start an operation that changes metadata
+ *
+ * Called with the caller's lock held, before changing anything.  Waits
+ * while the running transaction is full or being swapped out; from
+ * then until journal_end, it can't be, so everything the operation
+ * changes, even across letting go of the lock, is committed together.
+ */
+void journal_begin(void)
+{
+    if (!active)
+	return;
+    while (swapping || running->nblocks >= JOURNAL_FULL(ring_blocks)) {
+	pthread_cond_signal(&commit_cond);
+	pthread_cond_wait(&room_cond, caller_lock);
+    }
+    updates++;
+}
+
+/** End an operation journal_begin started, with the caller's lock held */
+void journal_end(void)
+{
+    if (!active)
+	return;
+    if (--updates == 0 && swapping)
+	pthread_cond_signal(&swap_cond);
+}
+
+// Has the commit thread commit up to @seq and waits for it, with jlock
+// held, which it lets go of
+static int wait_commit(uint64_t seq)
+{
+    int retstat;
+
+    if (seq > sync_seq)
+	sync_seq = seq;
+    pthread_cond_signal(&commit_cond);
+    while (committed_seq < seq)
+	pthread_cond_wait(&done_cond, &jlock);
+    retstat = commit_error;
+    pthread_mutex_unlock(&jlock);
+    return retstat;
+}
+
+/** Commit everything written so far and wait until it is on disk
+ *
+ * Called without the caller's lock.  Returns 0, or -errno if a commit
+ * has failed since the journal was started.
+ */
+int journal_sync(void)
+{
+    uint64_t seq;
+
+    pthread_mutex_lock(&jlock);
+    if (!active) {
+	pthread_mutex_unlock(&jlock);
+	return block_sync();
+    }
+    seq = running->nblocks > 0 || running->freed.count > 0 ? running->seq : running->seq - 1;
+    return wait_commit(seq);
+}
+
+/** Make the last change to @block durable, and file data written before it
+ *
+ * Called without the caller's lock.  Only the commit holding that
+ * change is waited for, not whatever came after it; with no change to
+ * the block waiting, a sync of the image is enough, shared with the
+ * other callers of block_sync.  Returns 0 or -errno.
+ */
+int journal_sync_block(int64_t block)
+{
+    struct jblock *b;
+
+    pthread_mutex_lock(&jlock);
+    b = active ? lookup(block) : NULL;
+    if (b == NULL) {
+	pthread_mutex_unlock(&jlock);
+	return block_sync();
+    }
+    return wait_commit(b->txn->seq);
+}
+
+// Hands back the space of the blocks a committed transaction freed,
+// which journal_reusable lets be allocated again from then on
+static void punch_freed(struct extents *e)
+{
+    int i;
+
+    for (i = 0; i < e->count; i++)
+	block_punch(e->list[i].first, e->list[i].count);
+    pthread_mutex_lock(&jlock);
+    e->count = 0;
+    pthread_mutex_unlock(&jlock);
+}
+
+// Puts the blocks of a transaction in place and drops them from the
+// table, all but those freed since
+static void checkpoint(struct txn *t)
+{
+    struct jblock *b, *next;
+
+    pthread_mutex_lock(&jlock);
+    for (b = t->blocks; b != NULL; b = next) {
+	next = b->txn_next;
+	if (!b->revoked)
+	    block_write(b->number, b->data);
+	unhash(b);
+	free(b);
+    }
+    t->blocks = NULL;
+    t->nblocks = 0;
+    pthread_mutex_unlock(&jlock);
+}
+
+static void add_entry(char *rec, int64_t *desc, int64_t *pos, uint64_t seq, int64_t entry)
+{
+    struct journal_desc *d = NULL;
+
+    if (*desc >= 0)
+	d = (struct journal_desc *) (rec + *desc * BLOCK_SIZE);
+    if (d == NULL || d->count == JOURNAL_ENTRIES) {
+	*desc = (*pos)++;
+	d = (struct journal_desc *) (rec + *desc * BLOCK_SIZE);
+	memset(d, 0, BLOCK_SIZE);
+	d->magic = JOURNAL_DESC_MAGIC;
+	d->seq = seq;
+    }
+    d->entries[d->count++] = entry;
+}
+
+// Lays out the record of a transaction, NULL if out of memory
+static char *make_record(struct txn *t, int64_t *length)
+{
+    struct journal_commit *c;
+    struct jblock *b;
+    int64_t images = 0, desc = -1, pos = 0;
+    char *rec;
+    int i;
+
+    pthread_mutex_lock(&jlock);
+    for (b = t->blocks; b != NULL; b = b->txn_next)
+	if (!b->revoked)
+	    images++;
+    *length = (2 * t->freed.count + images + JOURNAL_ENTRIES - 1) / JOURNAL_ENTRIES + images + 1;
+    rec = malloc(*length * BLOCK_SIZE);
+    if (rec == NULL) {
+	pthread_mutex_unlock(&jlock);
+	return NULL;
+    }
+    // revokes first, so none is split across descriptors
+    for (i = 0; i < t->freed.count; i++) {
+	add_entry(rec, &desc, &pos, t->seq, -(t->freed.list[i].first + 1));
+	add_entry(rec, &desc, &pos, t->seq, t->freed.list[i].count);
+    }
+    for (b = t->blocks; b != NULL; b = b->txn_next) {
+	if (b->revoked)
+	    continue;
+	add_entry(rec, &desc, &pos, t->seq, b->number);
+	memcpy(rec + pos++ * BLOCK_SIZE, b->data, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&jlock);
+
+    c = (struct journal_commit *) (rec + pos * BLOCK_SIZE);
+    memset(c, 0, BLOCK_SIZE);
+    c->magic = JOURNAL_COMMIT_MAGIC;
+    c->checksum = checksum(CHECKSUM_INIT, rec, pos * BLOCK_SIZE);
+    c->seq = t->seq;
+    c->length = *length;
+    return rec;
+}
+
+static int write_record(const char *rec, int64_t length)
+{
+    int64_t n = length < ring_blocks - head ? length : ring_blocks - head;
+
+    if (block_write_run(ring_block(head), n, rec) < 0)
+	return -EIO;
+    if (n < length && block_write_run(ring_block(0), length - n, rec + n * BLOCK_SIZE) < 0)
+	return -EIO;
+    return 0;
+}
+
+// Empties the ring, once what is in place is on disk
+static int reset_ring(uint64_t seq)
+{
+    int retstat = block_sync();
+
+    if (retstat == 0)
+	retstat = write_header(seq, head);
+    if (retstat == 0)
+	retstat = block_sync();
+    live = 0;
+    last_length = 0;
+    return retstat;
+}
+
+/*
+  Commits a transaction: writes its record and the header, syncs, then
+  puts its blocks in place and punches out the blocks it freed.  One
+  too big for the ring is written straight in place instead, which a
+  crash can leave half done.
+
+  INPUT: The transaction, no longer running
+  OUTPUT: 0, or -errno if it may not all be on disk
+
+*/
+static int commit(struct txn *t)
+{
+    int64_t length;
+    char *rec;
+    int retstat = 0;
+
+    if (t->nblocks == 0 && t->freed.count == 0)
+	return 0;
+    rec = make_record(t, &length);
+    if (rec != NULL && length == 1) {
+	// all it wrote was freed again
+	checkpoint(t);
+    }
+    else if (rec == NULL || length > ring_blocks) {
+	log_warn("journal: a transaction of %d blocks doesn't fit the journal, writing it in place\n",
+		 t->nblocks);
+	retstat = reset_ring(t->seq + 1);
+	checkpoint(t);
+	if (retstat == 0)
+	    retstat = block_sync();
+    }
+    else {
+	if (live + length > ring_blocks)
+	    retstat = reset_ring(t->seq);
+	// the header moves up to the last record, put in place before this sync
+	if (retstat == 0 && last_length > 0)
+	    retstat = write_header(last_seq, last_offset);
+	if (retstat == 0)
+	    retstat = write_record(rec, length);
+	if (retstat == 0)
+	    retstat = block_sync();
+	if (retstat == 0) {
+	    live = last_length + length;
+	    last_seq = t->seq;
+	    last_offset = head;
+	    last_length = length;
+	    head = (head + length) % ring_blocks;
+	    stats_count(STATS_JOURNAL_COMMITS, 1);
+	    stats_count(STATS_JOURNAL_BLOCKS, length);
+	}
+	checkpoint(t);
+    }
+    free(rec);
+    if (retstat != 0)
+	log_error("journal: commit %llu failed: %s\n", (unsigned long long) t->seq, strerror(-retstat));
+    punch_freed(&t->freed);
+    return retstat;
+}
+
+// When the next commit is due, journal_commit_ms from now
+static void deadline(struct timespec *ts)
+{
+    int ms = __atomic_load_n(&journal_commit_ms, __ATOMIC_RELAXED);
+
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000) {
+	ts->tv_sec++;
+	ts->tv_nsec -= 1000000000;
+    }
+}
+
+/*
+  The commit thread: starts a new transaction and commits the one that
+  was running whenever journal_commit_ms has passed with something in
+  it, it has grown to JOURNAL_BATCH, journal_sync wants it or
+  journal_stop is called
+
+  INPUT: none
+  OUTPUT: none
+
+*/
+static void *commit_worker(void *arg)
+{
+    struct timespec ts;
+    struct txn *t;
+    int stop = 0, retstat;
+
+    while (!stop) {
+	pthread_mutex_lock(&jlock);
+	deadline(&ts);
+	while (!stopping && sync_seq < running->seq
+	       && running->nblocks < JOURNAL_BATCH(ring_blocks)) {
+	    if (pthread_cond_timedwait(&commit_cond, &jlock, &ts) == ETIMEDOUT) {
+		if (running->nblocks > 0 || running->freed.count > 0)
+		    break;
+		deadline(&ts);
+	    }
+	}
+	stop = stopping;
+	pthread_mutex_unlock(&jlock);
+
+	pthread_mutex_lock(caller_lock);
+	swapping = 1;
+	while (updates > 0)
+	    pthread_cond_wait(&swap_cond, caller_lock);
+	swapping = 0;
+	pthread_mutex_lock(&jlock);
+	t = running;
+	running = t == &txns[0] ? &txns[1] : &txns[0];
+	running->seq = t->seq + 1;
+	pthread_cond_broadcast(&room_cond);
+	pthread_mutex_unlock(&jlock);
+	pthread_mutex_unlock(caller_lock);
+
+	retstat = commit(t);
+
+	pthread_mutex_lock(&jlock);
+	committed_seq = t->seq;
+	if (retstat != 0)
+	    commit_error = retstat;
+	pthread_cond_broadcast(&done_cond);
+	pthread_mutex_unlock(&jlock);
+    }
+    return NULL;
+}
+
+/** Lay out an empty journal on a new filesystem */
+int journal_format(void)
+{
+    int retstat;
+
+    if (info.journal_blocks == 0)
+	return 0;
+    // the ring may hold records of an older filesystem; a new sequence
+    // starting on a zeroed block keeps them from passing for ours
+    retstat = block_zero(info.journal_start + 1, 1);
+    if (retstat == 0)
+	retstat = write_header((uint64_t) time(NULL) << 32, 0);
+    return retstat;
+}
+
+// Whether a later transaction than @seq freed @block
+static int revoked(const struct extents *e, int64_t block, uint64_t seq)
+{
+    int i;
+
+    for (i = 0; i < e->count; i++)
+	if (e->list[i].seq > seq && block >= e->list[i].first
+	    && block < e->list[i].first + e->list[i].count)
+	    return 1;
+    return 0;
+}
+
+/*
+  Reads a record of the ring, and puts its blocks in place unless a
+  later record revokes them.  Sequence numbers only ever go up, so
+  whatever is left in the ring from before has a lower one.
+
+  INPUT: Where it starts, the lowest sequence number it may have (set to
+         the one it has), the revokes of the records found, which it
+         adds its own to unless applying
+  OUTPUT: Its length, 0 if there is no whole record there
+
+*/
+static int64_t read_record(int64_t offset, uint64_t *seq, struct extents *revokes, int apply)
+{
+    char buf[BLOCK_SIZE];
+    struct journal_desc d;
+    struct journal_commit *c = (struct journal_commit *) buf;
+    uint32_t sum = CHECKSUM_INIT;
+    int before = revokes->count;
+    int64_t pos = 0, entry;
+    uint64_t rec_seq = 0;
+    uint32_t i;
+
+    while (pos < ring_blocks) {
+	block_read(ring_block(offset + pos++), buf);
+	if (c->magic == JOURNAL_COMMIT_MAGIC && pos > 1) {
+	    if (c->seq != rec_seq || c->length != pos || c->checksum != sum)
+		break;
+	    *seq = rec_seq;
+	    return pos;
+	}
+	memcpy(&d, buf, sizeof(d));
+	if (pos == 1)
+	    rec_seq = d.seq;
+	if (d.magic != JOURNAL_DESC_MAGIC || d.seq != rec_seq || rec_seq < *seq
+	    || d.count > JOURNAL_ENTRIES)
+	    break;
+	sum = checksum(sum, buf, BLOCK_SIZE);
+	for (i = 0; i < d.count; i++) {
+	    entry = d.entries[i];
+	    if (entry < 0) {
+		if (++i == d.count
+		    || (!apply && extent_add(revokes, -(entry + 1), d.entries[i], rec_seq) != 0))
+		    goto bad;
+		continue;
+	    }
+	    if (entry >= image_blocks || pos >= ring_blocks
+		|| (entry >= info.journal_start && entry < info.journal_start + info.journal_blocks))
+		goto bad;
+	    block_read(ring_block(offset + pos++), buf);
+	    sum = checksum(sum, buf, BLOCK_SIZE);
+	    if (apply && !revoked(revokes, entry, rec_seq))
+		block_write(entry, buf);
+	}
+    }
+bad:
+    revokes->count = before;
+    return 0;
+}
+
+/** Put back what the journal holds of commits cut short by a crash
+ *
+ * Called on opening an image, before anything else reads it.  Returns
+ * how many transactions were found, or -errno if the journal is
+ * damaged.  With @check_only nothing is written.
+ */
+int journal_replay(int check_only)
+{
+    struct journal_header h;
+    struct extents revokes = { NULL, 0, 0 };
+    struct stat st;
+    int64_t offset, length, total = 0;
+    uint64_t seq;
+    int n = 0, i, retstat = 0;
+
+    if (info.journal_blocks == 0)
+	return 0;
+    if (fstat(diskfile, &st) < 0)
+	return -errno;
+    image_blocks = st.st_size / BLOCK_SIZE;
+    ring_blocks = info.journal_blocks - 1;
+    block_read(info.journal_start, &h);
+    if (h.magic != JOURNAL_MAGIC || h.offset < 0 || h.offset >= ring_blocks) {
+	log_error("journal: the header of the journal is damaged\n");
+	return -EINVAL;
+    }
+
+    // first the records that made it, and what they freed
+    seq = h.seq;
+    offset = h.offset;
+    while (total < ring_blocks && (length = read_record(offset, &seq, &revokes, 0)) > 0) {
+	offset = (offset + length) % ring_blocks;
+	total += length;
+	seq++;
+	n++;
+    }
+    if (n > 0 && !check_only) {
+	log_warn("journal: replaying %d transactions\n", n);
+	offset = h.offset;
+	seq = h.seq;
+	for (i = 0; i < n; i++) {
+	    offset = (offset + read_record(offset, &seq, &revokes, 1)) % ring_blocks;
+	    seq++;
+	}
+	retstat = block_sync();
+	if (retstat == 0)
+	    retstat = write_header(seq, offset);
+	if (retstat == 0)
+	    retstat = block_sync();
+    }
+    free(revokes.list);
+    return retstat != 0 ? retstat : n;
+}
+
+/** Start journaling metadata changes
+ *
+ * @lock is the caller's lock over all metadata, held for this call.
+ * The journal must have been replayed.
+ */
+int journal_start(pthread_mutex_t *lock)
+{
+    struct journal_header h;
+    int retstat;
+
+    if (info.journal_blocks == 0 || active)
+	return 0;
+    ring_blocks = info.journal_blocks - 1;
+    block_read(info.journal_start, &h);
+    if (h.magic != JOURNAL_MAGIC || h.offset < 0 || h.offset >= ring_blocks)
+	return -EINVAL;
+    // what was written in place so far goes to disk before any record
+    retstat = block_sync();
+    if (retstat != 0)
+	return retstat;
+    head = h.offset;
+    live = 0;
+    last_length = 0;
+    running = &txns[0];
+    running->seq = h.seq;
+    committed_seq = h.seq - 1;
+    sync_seq = 0;
+    commit_error = 0;
+    stopping = 0;
+    caller_lock = lock;
+    retstat = -pthread_create(&commit_thread, NULL, commit_worker, NULL);
+    if (retstat == 0) {
+	pthread_mutex_lock(&jlock);
+	active = 1;
+	pthread_mutex_unlock(&jlock);
+    }
+    return retstat;
+}
+
+/** Commit what is left and stop journaling, leaving the journal empty
+ *
+ * Called with the caller's lock held, which it lets go of while the
+ * last commit is made; no other calls may be in progress.
+ */
+void journal_stop(void)
+{
+    int i;
+
+    if (!active)
+	return;
+    pthread_mutex_lock(&jlock);
+    stopping = 1;
+    pthread_cond_signal(&commit_cond);
+    pthread_mutex_unlock(&jlock);
+    pthread_mutex_unlock(caller_lock);
+    pthread_join(commit_thread, NULL);
+    pthread_mutex_lock(caller_lock);
+
+    // everything is in place; once that is on disk nothing needs replaying
+    if (block_sync() == 0)
+	write_header(running->seq, head);
+    pthread_mutex_lock(&jlock);
+    active = 0;
+    for (i = 0; i < 2; i++) {
+	free(txns[i].freed.list);
+	memset(&txns[i], 0, sizeof(struct txn));
+    }
+    pthread_mutex_unlock(&jlock);
+}
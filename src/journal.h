@@ -0,0 +1,31 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+extern int journal_commit_ms;
+
+int journal_format(void);
+int journal_replay(int check_only);
+int journal_start(pthread_mutex_t *lock);
+void journal_stop(void);
+
+void journal_begin(void);
+void journal_end(void);
+int journal_read(int64_t block, void *buf);
+int journal_write(int64_t block, const void *buf);
+void journal_free(int64_t block, int64_t count);
+int64_t journal_reusable(int64_t block, int64_t count);
+int journal_freeing(void);
+int journal_sync(void);
+int journal_sync_block(int64_t block);
+
+#endif
@@ -0,0 +1,2700 @@
+/*
+  Simple File System
+
+  The filesystem proper: on-disk layout, allocators, path lookup and
+  the file operations, behind the API in libsfs.h.  Nothing in here
+  knows about FUSE; sfs.c adapts these calls to fuse_operations.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#include "params.h"
+#include "block.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "delalloc.h"
+#include "icache.h"
+#include "journal.h"
+#include "libsfs.h"
+#include "log.h"
+#include "prealloc.h"
+#include "rangelock.h"
+#include "stats.h"
+
+struct stat s;
+metadata_info info; 
+char * filepath;
+
+extern int diskfile;
+
+// Serializes everything that reads or changes metadata: the bitmaps,
+// the inode table and directory entries.  File data is read and
+// written outside of it, so a slow data read holds up nobody else;
+// the file blocks themselves are guarded by range locks (rangelock.c).
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The last inode a path resolved to on this thread, which is the one
+// the current request is about; see libsfs_last_inode.
+static __thread int req_inode = -1;
+
+// Why the last path walked on this thread did not resolve: -ENOENT,
+// or -ENOTDIR if a component before the last is not a directory
+static __thread int walk_error = -ENOENT;
+
+// Free data blocks and inodes, kept up to date by the bitmap setters
+// below so libsfs_statfs can report them without a scan.  Guarded by
+// meta_lock like the bitmaps themselves.
+static int64_t free_datablocks = 0;
+static int64_t free_inodes = 0;
+
+// Free data blocks promised to file data held by delayed allocation
+// (delalloc.c), which nothing else may allocate.  Guarded by
+// meta_lock; see held_reservation.
+static int64_t reserved_datablocks = 0;
+
+/*
+  The open image.  The block layer and everything above are process
+  wide, so there is at most one at a time; libsfs_open refuses a
+  second.  Guarded by meta_lock.
+*/
+struct libsfs {
+  char *image;
+};
+static struct libsfs *the_fs = NULL;
+
+// Inode table blocks the background zeroing does at a time
+#define INODE_INIT_RUN 64
+// How long the background zeroing gives up meta_lock between runs
+#define INODE_INIT_PAUSE_NS 1000000
+
+// Most blocks written out of delayed allocation in one call
+#define FLUSH_RUN_BLOCKS 2048
+
+// The thread zeroing the rest of the inode table, see libsfs_start.
+// Guarded by meta_lock; itable_cond wakes it to stop.
+static pthread_t itable_thread;
+static int itable_running = 0;
+static int itable_stop = 0;
+static pthread_cond_t itable_cond = PTHREAD_COND_INITIALIZER;
+
+// The thread writing out file data held by delayed allocation, see
+// libsfs_start; writes only hold data while it runs.  Guarded by
+// meta_lock; flush_cond wakes it early, to make room or to stop.
+static pthread_t flush_thread;
+static int flush_running = 0;
+static int flush_stop = 0;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+
+static void write_superblock(int clean);
+
+/*
+  Bitmap blocks needed to cover a number of blocks or inodes
+
+  INPUT: How many bits the bitmap holds
+  OUTPUT: How many blocks that takes, rounded up
+
+*/
+static int64_t bitmap_blocks(int64_t bits){
+  return (bits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+}
+
+/*
+  This function initializes all the structure: data_percent of the image is for data, the rest for metadata
+  The inode table gets what is left of the metadata share after the superblock, bitmaps and journal, up to
+  SFS_MAX_INODES; the journal follows it, and the data region gets the rest of the image.  Works for any size, with at most
+  a partial block at the end of the image unused.  The data bitmap is made big enough for the data
+  region of an image grown to max_size, so libsfs_grow can extend it in place.
+
+  INPUT: The total size of the file, the most it can be grown to (no more than total_size for no room
+         to grow), the share for data (SFS_DATA_PERCENT normally), the blocks for the journal (0 for none),
+         metadata_info pointer to store metadata value
+  OUTPUT: 0 on success, -1 if the image is too small to hold both an inode and a data block
+
+*/
+int get_metadata_info(int64_t total_size, int64_t max_size, int data_percent, int64_t journal_blocks, metadata_info * info){
+
+  int64_t total_blocks = total_size / BLOCK_SIZE;
+  int64_t data_blocks = total_blocks * data_percent / 100;
+  int64_t grow_bitmap = max_size > total_size ? bitmap_blocks(max_size / BLOCK_SIZE) : 0;
+  int64_t data_bitmap = bitmap_blocks(data_blocks) > grow_bitmap ? bitmap_blocks(data_blocks) : grow_bitmap;
+
+  // the metadata share holds the superblock, the data bitmap, the inode
+  // bitmap, the inode table and the journal; every inode bitmap block
+  // covers BITS_PER_BLOCK / INODES_PER_BLOCK blocks of the table
+  int64_t meta_blocks = total_blocks - data_blocks - 1 - data_bitmap - journal_blocks;
+  int64_t inode_blocks = meta_blocks * (BITS_PER_BLOCK / INODES_PER_BLOCK) / (BITS_PER_BLOCK / INODES_PER_BLOCK + 1);
+  if (inode_blocks > SFS_MAX_INODES / INODES_PER_BLOCK) {
+    inode_blocks = SFS_MAX_INODES / INODES_PER_BLOCK;
+  }
+  int64_t inode_bitmap = bitmap_blocks(inode_blocks * INODES_PER_BLOCK);
+
+  // then the data region and its bitmap take everything else
+  int64_t rest = total_blocks - 1 - inode_bitmap - inode_blocks - journal_blocks;
+  data_blocks = rest * BITS_PER_BLOCK / (BITS_PER_BLOCK + 1);
+  while (data_blocks + 1 + bitmap_blocks(data_blocks + 1) <= rest) {
+    data_blocks++;
+  }
+  data_bitmap = bitmap_blocks(data_blocks);
+  if (data_bitmap < grow_bitmap) {
+    data_bitmap = grow_bitmap;
+    data_blocks = rest - grow_bitmap;
+  }
+
+  memset(info, 0, sizeof(metadata_info));
+  info->disksize = total_size;
+  info->dataregion_blocks = data_blocks;
+  info->dataregion_bitmap_blocks = data_bitmap;
+  info->inode_blocks = inode_blocks;
+  info->inode_bitmap_blocks = inode_bitmap;
+  info->journal_blocks = journal_blocks;
+  
+  info->total_inodes = info->inode_blocks * INODES_PER_BLOCK;
+
+  info->dataregion_bitmap_start = 1;
+  info->inode_bitmap_start = 1 + info->dataregion_bitmap_blocks;
+
+  info->inode_blocks_start = 1 + info->dataregion_bitmap_blocks + info->inode_bitmap_blocks;
+  info->journal_start = info->inode_blocks_start + info->inode_blocks;
+  info->dataregion_blocks_start = info->journal_start + info->journal_blocks;
+
+  if (inode_blocks <= 0 || data_blocks <= 0) {
+    return -1;
+  }
+  return 0;
+
+}
+
+
+
+
+/*
+  Checks the status of a specific inode. Returns this value
+  
+
+  INPUT: The inode number to check
+  OUTPUT: The status (1 allocated, 0 unallocated)
+
+*/
+int check_inode_status(int inode_number){
+
+  char buffer[BLOCK_SIZE];
+  int blk_number = inode_number/(BITS_PER_BLOCK); //Finds out in which block bit is
+  journal_read(info.inode_bitmap_start + blk_number, buffer); //reads the block
+
+  int byte_offset = (inode_number - (BITS_PER_BLOCK * blk_number)) / BITS_PER_BYTE; //Finds how many bytes from begining that specific bit is
+  char * ptr = buffer + byte_offset; 
+  char data_bits = *ptr; //Obtains 8 bits in which desired bit is contained
+
+  int bit_offset = inode_number - (BITS_PER_BLOCK * blk_number) - (byte_offset * BITS_PER_BYTE); //where in the 8 bits the desired is lcoated
+  int bit = ZERO_INDEX_BITS - bit_offset; //counting offset from the MSB
+  
+
+  bit = (data_bits & ( 1 << bit )) >> bit; //Gets the required bit
+    
+  return bit;
+}
+
+
+/*
+  Sets the status of a specific inode. Returns this value
+  
+
+  INPUT: The inode number to set, the value to set it to
+  OUTPUT: The status (1 allocated, 0 unallocated)
+
+*/
+int set_inode_status(int inode_number, int status){
+
+  char buffer[BLOCK_SIZE];
+  int blk_number = inode_number/(BITS_PER_BLOCK); //Finds out in which block bit is
+  journal_read(info.inode_bitmap_start + blk_number, buffer); //reads the block
+
+  int byte_offset = (inode_number - (BITS_PER_BLOCK * blk_number)) / BITS_PER_BYTE;//Finds how many bytes from begining that specific bit is
+  char * ptr = buffer + byte_offset;
+  char data_bits = *ptr; //Obtains 8 bits in which desired bit is contained
+
+  int bit_offset = inode_number - (BITS_PER_BLOCK * blk_number) - (byte_offset * BITS_PER_BYTE); //where in the 8 bits the desired is lcoated
+  int bit = ZERO_INDEX_BITS - bit_offset;
+
+  if (((data_bits >> bit) & 1) != status) {
+    free_inodes += status ? -1 : 1;
+  }
+  data_bits ^= (-status ^ data_bits) & (1 << bit); //sets the required bit
+  *ptr = data_bits; //puts set of 8 bits back into buffer
+  journal_write(info.inode_bitmap_start + blk_number, buffer); //writes block back to file
+  return 0;
+
+}
+
+
+
+/*
+  Checks the status of a specific inode. Returns this value
+  
+
+  INPUT: The inode number to check
+  OUTPUT: The status (1 allocated, 0 unallocated)
+
+*/
+int check_dataregion_status(int64_t datablock_number){
+
+  char buffer[BLOCK_SIZE];
+  int64_t blk_number = datablock_number/(BITS_PER_BLOCK); //Finds out in which block bit is
+  journal_read(info.dataregion_bitmap_start + blk_number, buffer);  //reads the block
+
+  int byte_offset = (datablock_number - (BITS_PER_BLOCK * blk_number)) / BITS_PER_BYTE; //Finds how many bytes from begining that specific bit is
+  char * ptr = buffer + byte_offset; 
+  char data_bits = *ptr; //Obtains 8 bits in which desired bit is contained
+
+  int bit_offset = datablock_number - (BITS_PER_BLOCK * blk_number) - (byte_offset * BITS_PER_BYTE); //where in the 8 bits the desired is lcoated
+  int bit = ZERO_INDEX_BITS - bit_offset; //counting offset from the MSB
+  
+
+  bit = (data_bits & ( 1 << bit )) >> bit; //Gets the required bit
+    
+  return bit;
+}
+
+
+/*
+  Sets the status of a specific inode. Returns this value
+  
+
+  INPUT: The inode number to set, the value to set it to
+  OUTPUT: The status (1 allocated, 0 unallocated)
+
+*/
+int set_dataregion_status(int64_t datablock_number, int status){
+
+  char buffer[BLOCK_SIZE];
+  int64_t blk_number = datablock_number/(BITS_PER_BLOCK); //Finds out in which block bit is
+  journal_read(info.dataregion_bitmap_start + blk_number, buffer);  //reads the block
+
+  int byte_offset = (datablock_number - (BITS_PER_BLOCK * blk_number)) / BITS_PER_BYTE;//Finds how many bytes from begining that specific bit is
+  char * ptr = buffer + byte_offset;
+  char data_bits = *ptr; //Obtains 8 bits in which desired bit is contained
+
+  int bit_offset = datablock_number - (BITS_PER_BLOCK * blk_number) - (byte_offset * BITS_PER_BYTE); //where in the 8 bits the desired is lcoated
+  int bit = ZERO_INDEX_BITS - bit_offset;
+
+  if (((data_bits >> bit) & 1) != status) {
+    free_datablocks += status ? -1 : 1;
+  }
+  data_bits ^= (-status ^ data_bits) & (1 << bit); //sets the required bit
+  *ptr = data_bits; //puts set of 8 bits back into buffer
+  journal_write(info.dataregion_bitmap_start + blk_number, buffer); //writes block back to file
+  return 0;
+
+}
+
+/*
+  Sets the status of a run of consecutive data blocks, reading and
+  writing each bitmap block only once
+
+  INPUT: The first data block, how many, the value to set them to
+  OUTPUT: 0 on success
+
+*/
+int set_dataregion_run(int64_t datablock_number, int count, int status){
+
+  char bitmap[BLOCK_SIZE];
+  int64_t blk_number = -1;
+  int64_t i;
+  for (i = datablock_number; i < datablock_number + count; i++) {
+    if (i / BITS_PER_BLOCK != blk_number) {
+      if (blk_number != -1) {
+        journal_write(info.dataregion_bitmap_start + blk_number, bitmap);
+      }
+      blk_number = i / BITS_PER_BLOCK;
+      journal_read(info.dataregion_bitmap_start + blk_number, bitmap);
+    }
+    int byte_offset = (i % BITS_PER_BLOCK) / BITS_PER_BYTE;
+    int bit = ZERO_INDEX_BITS - (i % BITS_PER_BYTE);
+    if (((bitmap[byte_offset] >> bit) & 1) != status) {
+      free_datablocks += status ? -1 : 1;
+    }
+    bitmap[byte_offset] ^= (-status ^ bitmap[byte_offset]) & (1 << bit); //sets the required bit
+  }
+  if (blk_number != -1) {
+    journal_write(info.dataregion_bitmap_start + blk_number, bitmap);
+  }
+  return 0;
+
+}
+
+/*
+  Finds a run of free data blocks, up to a wanted length, passing over
+  those freed since the last commit (journal_reusable) and those set
+  aside for appending files (prealloc.c), and leaving as many free as
+  held file data has reserved
+
+  INPUT: Where to start looking, how many blocks are wanted, where to store how
+         many were found, whether the run must start right there
+  OUTPUT: The first data block of the run, -1 if there is none
+
+*/
+static int64_t scan_free_run(int64_t from, int want, int * got, int anchored){
+
+  char bitmap[BLOCK_SIZE];
+  int64_t blk_number = -1;
+  int64_t start = -1;
+  int length = 0;
+  int64_t i;
+  if (want > free_datablocks - reserved_datablocks) {
+    want = free_datablocks - reserved_datablocks;
+  }
+  if (want <= 0) {
+    return -1;
+  }
+  int limit = want;
+  for (i = from; i < info.dataregion_blocks && length < limit; i++) {
+    if (anchored && length == 0 && i > from) {
+      break;
+    }
+    if (i / BITS_PER_BLOCK != blk_number) {
+      blk_number = i / BITS_PER_BLOCK;
+      journal_read(info.dataregion_bitmap_start + blk_number, bitmap);
+    }
+    int byte_offset = (i % BITS_PER_BLOCK) / BITS_PER_BYTE;
+    // skip a whole byte of allocated blocks at once
+    if (length == 0 && i % BITS_PER_BYTE == 0 && bitmap[byte_offset] == (char) 0xff) {
+      i += BITS_PER_BYTE - 1;
+      continue;
+    }
+    int bit = ZERO_INDEX_BITS - (i % BITS_PER_BYTE);
+    if (bitmap[byte_offset] & (1 << bit)) {
+      if (length > 0) {
+        break;
+      }
+      continue;
+    }
+    if (length == 0) {
+      int64_t n = journal_reusable(info.dataregion_blocks_start + i, want);
+      if (n > 0) {
+        n = prealloc_clear(i, n);
+      }
+      if (n < 0) {
+        i += -n - 1;
+        continue;
+      }
+      start = i;
+      limit = n;
+    }
+    length++;
+  }
+  if (length == 0) {
+    return -1;
+  }
+  *got = length;
+  return start;
+
+}
+
+/*
+  Finds the first run of free data blocks, up to a wanted length.  The
+  blocks set aside for appending files give way once nothing else is
+  left.
+
+  INPUT: How many blocks are wanted, where to store how many were found
+  OUTPUT: The first data block of the run, -1 if the data region is full
+
+*/
+int64_t find_free_run(int want, int * got){
+
+  int64_t start = scan_free_run(0, want, got, 0);
+  if (start == -1 && prealloc_trim_all() > 0) {
+    start = scan_free_run(0, want, got, 0);
+  }
+  return start;
+
+}
+
+/*
+  The inode table is zeroed lazily, in SFS_INODE_GROUPS groups of this
+  many blocks; the last ones may be shorter, or empty on a small image
+
+  INPUT: none
+  OUTPUT: The blocks of the inode table in a full group
+
+*/
+static int inode_group_blocks(){
+  return (info.inode_blocks + SFS_INODE_GROUPS - 1) / SFS_INODE_GROUPS;
+}
+
+/*
+  Gets the number of inode table blocks in a group
+
+  INPUT: The group
+  OUTPUT: How many blocks it covers
+
+*/
+static int inode_group_size(int group){
+  int per_group = inode_group_blocks();
+  int size = info.inode_blocks - group * per_group;
+  return size < 0 ? 0 : size < per_group ? size : per_group;
+}
+
+/*
+  Checks whether a block of the inode table has been zeroed.  One that
+  hasn't holds only free inodes, and whatever was on the image before
+  mkfs.sfs.
+
+  INPUT: The block, counted from the start of the inode table
+  OUTPUT: 1 if it has been zeroed, 0 otherwise
+
+*/
+static int inode_block_ready(int blk_number){
+  int per_group = inode_group_blocks();
+  return blk_number % per_group < info.inode_table_init[blk_number / per_group];
+}
+
+/*
+  Zeroes the blocks of an inode group from where its zeroed part ends
+  through the given one, and records that in the superblock
+
+  INPUT: The last block to zero, counted from the start of the inode table
+  OUTPUT: none
+
+*/
+static void init_inode_blocks(int blk_number){
+
+  int per_group = inode_group_blocks();
+  int group = blk_number / per_group;
+  int first = group * per_group + info.inode_table_init[group];
+  block_zero(info.inode_blocks_start + first, blk_number + 1 - first);
+  info.inode_table_init[group] = blk_number + 1 - group * per_group;
+  write_superblock(0);
+}
+
+/*
+  Gets a copy of the specified inode at returns it to the user
+
+  INPUT: The inode number that is requested
+  OUTPUT: A struct containing the inode
+
+*/
+
+inode get_inode(int inode_number){
+    
+  inode node;
+  inode_block entry_buffer;
+  if (inode_number < 0 || inode_number >= info.total_inodes) {
+    log_error("get_inode: inode %d is out of range\n", inode_number);
+    memset(&node, 0, sizeof(inode));
+    return node;
+  }
+  int blk_number = inode_number / INODES_PER_BLOCK; // Finds which block to read
+  if (!inode_block_ready(blk_number)) {
+    memset(&node, 0, sizeof(inode)); // never used, so never written
+    return node;
+  }
+  journal_read(info.inode_blocks_start + blk_number, &entry_buffer); // Reads the block
+  
+  
+  int offset = inode_number - (INODES_PER_BLOCK * blk_number);
+  node = (entry_buffer.list[offset]);
+  return node;
+  
+}
+
+/*
+  Sets a certain inode in the metadata region
+
+  INPUT: The inode number to write to, the inode itself
+  OUTPUT: none
+
+*/
+void set_inode(int inode_number, inode node){
+
+  inode_block entry_buffer;
+  if (inode_number < 0 || inode_number >= info.total_inodes) {
+    log_error("set_inode: inode %d is out of range\n", inode_number);
+    return;
+  }
+  int blk_number = inode_number / INODES_PER_BLOCK; // Finds which block to read
+  if (!inode_block_ready(blk_number)) {
+    init_inode_blocks(blk_number);
+  }
+  journal_read(info.inode_blocks_start + blk_number, &entry_buffer); // Reads the block
+  
+  
+  int offset = inode_number - (INODES_PER_BLOCK * blk_number);
+  entry_buffer.list[offset] = node;
+  journal_write(info.inode_blocks_start + blk_number, &entry_buffer);
+  
+}
+
+/*
+  Gets the number of directories in a file path
+
+  INPUT: The file path
+  OUTPUT: the number of different portions of the filepath
+
+*/
+
+int get_num_dirs(const char * filepath){
+  int length = strlen(filepath);
+  char slash = 47;
+  int i, count;
+  count = 0;
+  for (i = 0; i < length; i++){
+    if (filepath[i] == slash)
+      count++;
+  }
+  return count;
+}
+
+/*
+  Get each file path returned as a char *
+
+  INPUT: The file path
+  OUTPUT: A char ** that points to each string in the filepath
+
+*/
+
+
+char ** parsePath(const char * filepath){
+
+  int length = strlen(filepath);
+  int i, count;
+  char slash = 47;
+  count = 0;
+
+  //Figures out how many "/" are present -- stores in count
+  for (i = 0; i < length; i++){
+    if (filepath[i] == slash)
+      count++;
+  }
+  
+
+  int * indices = (int * ) malloc ((count + 1) * sizeof(int)); //stores the index of each slash
+  int j = 0;
+  for (i = 0; i < length; i++){
+
+    if (filepath[i] == slash){
+      indices[j] = i;
+      j++;
+    }
+
+    
+  }
+  indices[count] = length; 
+
+  char ** strings = (char **) malloc(count * sizeof(char *)); //MUST FREE THIS LATER
+
+  for (i = 0; i < count; i++){
+    int size = (indices[i + 1] - indices[i]);
+    strings[i] = (char *) calloc(size, sizeof(char));
+    strncpy(strings[i], (filepath + indices[i] + 1), (size - 1));
+    
+  }
+  free(indices);
+  
+  return strings;
+
+}
+
+/*
+  Walks a path down from the root record, one component at a time
+
+  INPUT: The file path, where to store the filepath block of the last component (may be NULL)
+  OUTPUT: The inode number of the last component, -1 if it does not
+          exist or a component before it is not a directory (walk_error
+          tells which)
+
+*/
+static int walkPath(const char *path, int64_t *fblockNum) {
+
+  filepath_block fblock;
+  journal_read(info.dataregion_blocks_start, &fblock); // root record is data block 0
+  int inodeNum = fblock.inode;
+  walk_error = -ENOENT;
+  if (fblockNum != NULL) {
+    *fblockNum = 0;
+  }
+  if (strcmp(path, "/") == 0) {
+    req_inode = inodeNum;
+    return inodeNum;
+  }
+  int numOfDirs = get_num_dirs(path);
+  char ** fldrs = parsePath(path);
+  int i, j, gotem;
+  inode node;
+  // go through each inode of each folder in the path to find the inode for the filepath
+  for (i = 0; i < numOfDirs && inodeNum != -1; i++) {
+    node = get_inode(inodeNum);
+    if (!(node.flags & SFS_DIR)) {
+      walk_error = -ENOTDIR;
+      inodeNum = -1;
+      break;
+    }
+    gotem = 0;
+    // check each direct_ptr in inode until the correct entry is found
+    for (j = 0; j < 12; j++) {
+      if (node.direct_ptrs[j] == 0) {
+        continue;
+      }
+      journal_read(info.dataregion_blocks_start + node.direct_ptrs[j], &fblock);
+      if (strcmp(fblock.filepath, fldrs[i]) == 0) {
+        gotem = 1;
+        break;
+      }
+    }
+    if (gotem == 1 && (fblock.inode < 0 || fblock.inode >= info.total_inodes)) {
+      log_error("walkPath: the entry for %s names inode %d, which is out of range\n",
+                fldrs[i], fblock.inode);
+      inodeNum = -1;
+    }
+    else if (gotem == 1) {
+      inodeNum = fblock.inode;
+      if (fblockNum != NULL) {
+        *fblockNum = node.direct_ptrs[j];
+      }
+    }
+    else {
+      inodeNum = -1;
+    }
+  }
+  for (i = 0; i < numOfDirs; i++) {
+    free(fldrs[i]);
+  }
+  free(fldrs);
+  if (inodeNum != -1) {
+    req_inode = inodeNum;
+  }
+  return inodeNum;
+}
+
+/*
+  Finds the inode based on a filepath
+
+  INPUT: The file path
+  OUTPUT: An integer representing a inode, -1 if there is none
+
+*/
+int findInode(const char *path) {
+  return walkPath(path, NULL);
+}
+
+/*
+  Finds the filepath block based on a path
+
+  INPUT: The file path
+  OUTPUT: The data block holding the path's directory entry, -1 if there is none
+
+*/
+int64_t findFilepathBlock(const char *path) {
+  int64_t fblockNum;
+  if (walkPath(path, &fblockNum) == -1) {
+    return -1;
+  }
+  return fblockNum;
+}
+
+/*
+  Finds the inode of the directory a path lives in
+
+  INPUT: The file path
+  OUTPUT: The inode of the parent directory, -1 if there is none
+
+*/
+int findParentInode(const char *path) {
+  char * copy = strdup(path);
+  // the request is still about the path, not its directory
+  int saved = req_inode;
+  int inodeNum = findInode(dirname(copy));
+  req_inode = saved;
+  free(copy);
+  return inodeNum;
+}
+
+int64_t find_free_datablock(){
+  int got;
+  return find_free_run(1, &got);
+}
+
+/*
+  A block of pointers read while mapping a file; written back when the
+  walk moves on from it or ends, if it was changed
+*/
+struct ptr_block {
+  int64_t number;	// the data block it lives in, 0 for none
+  int dirty;
+  int64_t ptrs[PTRS_PER_BLOCK];
+};
+
+// Where a walk down a file's block pointers has got to
+struct file_walk {
+  inode * node;
+  struct ptr_block indirect;	// the indirect block
+  struct ptr_block tree[SFS_MAX_HEIGHT];	// the tree's block last used at each level, the lowest first
+};
+
+// How many file blocks a pointer block height levels above them maps
+static int64_t tree_span(int height){
+
+  int64_t span = 1;
+  while (height-- > 0) {
+    span *= PTRS_PER_BLOCK;
+  }
+  return span;
+}
+
+static void flush_walk(struct file_walk * w);
+
+static void flush_ptr_block(struct ptr_block * pb){
+  if (pb->dirty) {
+    journal_write(info.dataregion_blocks_start + pb->number, pb->ptrs);
+    pb->dirty = 0;
+  }
+}
+
+/*
+  Makes sure the pointer block a pointer names is the one held,
+  creating it if the pointer is 0 and asked to
+
+  INPUT: The pointer, the ptr_block to hold the block, whether to create it,
+         what to flag if the pointer is set
+  OUTPUT: 1 if the block is held, 0 if it isn't there (or, creating it, the disk is full)
+
+*/
+static int get_ptr_block(int64_t * pointer, struct ptr_block * pb, int alloc, int * changed){
+
+  int got;
+  if (*pointer == 0) {
+    int64_t start = alloc ? find_free_run(1, &got) : -1;
+    if (start == -1) {
+      return 0;
+    }
+    set_dataregion_run(start, 1, 1);
+    flush_ptr_block(pb);
+    memset(pb->ptrs, 0, sizeof(pb->ptrs));
+    pb->number = start;
+    pb->dirty = 1;
+    *pointer = start;
+    *changed = 1;
+  }
+  else if (pb->number != *pointer) {
+    flush_ptr_block(pb);
+    pb->number = *pointer;
+    journal_read(info.dataregion_blocks_start + pb->number, pb->ptrs);
+  }
+  return 1;
+}
+
+/*
+  Finds where the pointer to a file block is kept: in the inode, the
+  indirect block or the lowest pointer block of the tree.  Creating
+  pointer blocks, a tree too low for the block gets more levels on top,
+  the old top block becoming the first entry of each new one.
+
+  INPUT: The walk, the file block (below MAX_FILE_BLOCKS), whether to create
+         missing pointer blocks, where to store the ptr_block the pointer is
+         in (NULL for the inode)
+  OUTPUT: The pointer's address, NULL if a pointer block on the way is missing
+          (or, creating them, the disk is full)
+
+*/
+static int64_t * file_block_slot(struct file_walk * w, int64_t b, int alloc, struct ptr_block ** owner){
+
+  inode * node = w->node;
+  int node_changed, height, level;
+  int64_t * pointer;
+  *owner = NULL;
+  if (b < 12) {
+    return &node->direct_ptrs[b];
+  }
+  b -= 12;
+  if (b < PTRS_PER_BLOCK) {
+    if (!get_ptr_block(&node->indirect_ptr, &w->indirect, alloc, &node_changed)) {
+      return NULL;
+    }
+    *owner = &w->indirect;
+    return &w->indirect.ptrs[b];
+  }
+  b -= PTRS_PER_BLOCK;
+
+  height = node->tree_ptr == 0 ? 1 : node->tree_height;
+  while (b >= tree_span(height)) {
+    height++;
+  }
+  if (node->tree_ptr == 0) {
+    if (!get_ptr_block(&node->tree_ptr, &w->tree[height - 1], alloc, &node_changed)) {
+      return NULL;
+    }
+    node->tree_height = height;
+  }
+  while (node->tree_height < height) {
+    level = node->tree_height;
+    int64_t top = node->tree_ptr;
+    node->tree_ptr = 0;
+    if (!get_ptr_block(&node->tree_ptr, &w->tree[level], alloc, &node_changed)) {
+      node->tree_ptr = top;
+      return NULL;
+    }
+    w->tree[level].ptrs[0] = top;
+    node->tree_height = level + 1;
+  }
+
+  pointer = &node->tree_ptr;
+  node_changed = 0;
+  int * changed = &node_changed;
+  for (level = height; level > 0; level--) {
+    if (!get_ptr_block(pointer, &w->tree[level - 1], alloc, changed)) {
+      return NULL;
+    }
+    pointer = &w->tree[level - 1].ptrs[b / tree_span(level - 1) % PTRS_PER_BLOCK];
+    changed = &w->tree[level - 1].dirty;
+  }
+  *owner = &w->tree[0];
+  return pointer;
+}
+
+// Writes back whatever pointer blocks a walk changed
+static void flush_walk(struct file_walk * w){
+
+  int level;
+  flush_ptr_block(&w->indirect);
+  for (level = 0; level < SFS_MAX_HEIGHT; level++) {
+    flush_ptr_block(&w->tree[level]);
+  }
+}
+
+/*
+  Finds a run of free data blocks for a file, for its blocks from a
+  given one on.  A file allocating the blocks right after the ones it
+  allocated last is taken to be appended to: they come from the window
+  set aside for it (prealloc.c), and once that is used up, a new one
+  twice as big is set aside right after them, no bigger than a share
+  of what is free.  The blocks are not marked in use here.
+
+  INPUT: The inode, the first file block, how many blocks are wanted, where to
+         store how many were found
+  OUTPUT: The first data block of the run, -1 if the data region is full
+
+*/
+static int64_t alloc_run(int inodeNum, int64_t block, int want, int * got){
+
+  struct prealloc * pa = prealloc_get(inodeNum);
+  int64_t start;
+  if (pa->next == block && pa->count > 0) {
+    *got = want < pa->count ? want : pa->count;
+    start = pa->start;
+    pa->start += *got;
+    pa->count -= *got;
+    pa->next = block + *got;
+    stats_count(STATS_PREALLOC_BLOCKS, *got);
+    return start;
+  }
+  int64_t size = 0;
+  if (pa->next == block && !pa->released && prealloc_kb > 0) {
+    int64_t room = (free_datablocks - reserved_datablocks) / PREALLOC_SHARE;
+    size = pa->size == 0 ? PREALLOC_MIN : pa->size * 2;
+    size = size < (int64_t) prealloc_kb * 1024 / BLOCK_SIZE ? size : (int64_t) prealloc_kb * 1024 / BLOCK_SIZE;
+    size = size < room ? size : room;
+  }
+  // right after the last run if that is free, else wherever
+  start = size > 0 ? scan_free_run(pa->start, want + size, got, 1) : -1;
+  if (start == -1) {
+    start = find_free_run(want + size, got);
+  }
+  if (start == -1) {
+    return -1;
+  }
+  if (*got > want) {
+    pa->count = *got - want;
+    pa->size = pa->count;
+    *got = want;
+  }
+  // a file writing elsewhere than where its window is keeps it
+  if (pa->count == 0 || pa->next == block) {
+    pa->next = block + *got;
+    pa->start = start + *got;
+  }
+  return start;
+}
+
+/*
+  Maps a range of file blocks to data blocks in one pass, allocating
+  holes if asked to.  Holes are filled from as few contiguous runs of
+  data blocks as the bitmap allows, so a large write lands in one
+  piece wherever it can.
+
+  INPUT: The inode (updated in place when allocating) and its number, the first
+         file block, how many, where to store the data block numbers (0 for a hole),
+         where to flag newly allocated blocks (may be NULL), whether to allocate
+  OUTPUT: The number of blocks mapped, less than asked for only when the disk is full
+
+*/
+static int map_range(inode * node, int inodeNum, int64_t first, int count, int64_t * ptrs, char * fresh, int alloc){
+
+  struct file_walk w;
+  struct ptr_block * owner;
+  int64_t * slot;
+  int64_t start;
+  int i, got;
+  memset(&w, 0, sizeof(w));
+  w.node = node;
+  if (fresh != NULL) {
+    memset(fresh, 0, count);
+  }
+
+  int holes = 0;
+  for (i = 0; i < count; i++) {
+    slot = file_block_slot(&w, first + i, alloc, &owner);
+    if (slot == NULL && alloc) {
+      // no room for an indirect block: map what comes before it
+      count = i;
+      break;
+    }
+    ptrs[i] = slot == NULL ? 0 : *slot;
+    if (ptrs[i] == 0) {
+      holes++;
+    }
+  }
+
+  int mapped = count;
+  if (alloc) {
+    i = 0;
+    while (holes > 0) {
+      while (ptrs[i] != 0) {
+        i++;
+      }
+      start = alloc_run(inodeNum, first + i, holes, &got);
+      if (start == -1) {
+        break;
+      }
+      set_dataregion_run(start, got, 1);
+      holes -= got;
+      for (; got > 0; i++) {
+        if (ptrs[i] != 0) {
+          continue;
+        }
+        ptrs[i] = start++;
+        got--;
+        if (fresh != NULL) {
+          fresh[i] = 1;
+        }
+        slot = file_block_slot(&w, first + i, 1, &owner);
+        *slot = ptrs[i];
+        if (owner != NULL) {
+          owner->dirty = 1;
+        }
+      }
+    }
+    // out of space: stop at the first block that is still a hole
+    if (holes > 0) {
+      for (mapped = 0; mapped < count && ptrs[mapped] != 0; mapped++)
+        ;
+    }
+  }
+  flush_walk(&w);
+  return mapped;
+}
+
+/*
+  Frees the data blocks a list of pointers names, giving their space
+  back to the host filesystem once that is committed (journal_free),
+  and clears the pointers.  Does each run of consecutive blocks in one
+  go.
+
+  INPUT: The pointers, how many
+  OUTPUT: none
+
+*/
+static void free_ptrs(int64_t * ptrs, int count){
+
+  int i = 0;
+  while (i < count) {
+    int n = 1;
+    if (ptrs[i] == 0) {
+      i++;
+      continue;
+    }
+    while (i + n < count && ptrs[i + n] == ptrs[i] + n) {
+      n++;
+    }
+    set_dataregion_run(ptrs[i], n, 0);
+    journal_free(info.dataregion_blocks_start + ptrs[i], n);
+    memset(ptrs + i, 0, n * sizeof(int64_t));
+    i += n;
+  }
+}
+
+/*
+  Frees what a pointer block maps from a given one of its file blocks
+  on, and the pointer block itself if that is all of it
+
+  INPUT: Where the pointer block's number is kept (cleared if it is freed),
+         how many levels above the data it is, the first of the file blocks
+         it maps to free, counted from the first it maps, 0 or less for all
+  OUTPUT: none
+
+*/
+static void free_tree(int64_t * pointer, int height, int64_t from){
+
+  int64_t ptrs[PTRS_PER_BLOCK];
+  int64_t span = tree_span(height - 1);
+  int j;
+  if (*pointer == 0 || from >= span * PTRS_PER_BLOCK) {
+    return;
+  }
+  from = from < 0 ? 0 : from;
+  journal_read(info.dataregion_blocks_start + *pointer, ptrs);
+  if (height == 1) {
+    free_ptrs(ptrs + from, PTRS_PER_BLOCK - from);
+  }
+  else {
+    for (j = from / span; j < PTRS_PER_BLOCK; j++) {
+      free_tree(&ptrs[j], height - 1, from - j * span);
+    }
+  }
+  if (from == 0) {
+    free_ptrs(pointer, 1);
+  }
+  else {
+    journal_write(info.dataregion_blocks_start + *pointer, ptrs);
+  }
+}
+
+/*
+  Frees every data block of a file from a given file block on, leaving
+  holes in the image where they were
+
+  INPUT: The inode (updated in place), the first file block to free
+  OUTPUT: none
+
+*/
+static void free_blocks_from(inode * node, int64_t first){
+
+  if (first < 12) {
+    free_ptrs(node->direct_ptrs + first, 12 - first);
+  }
+  free_tree(&node->indirect_ptr, 1, first - 12);
+  // the tree keeps its height until it is gone altogether
+  free_tree(&node->tree_ptr, node->tree_height, first - SFS_TREE_FIRST);
+  if (node->tree_ptr == 0) {
+    node->tree_height = 0;
+  }
+}
+
+/*
+  Reads mapped file blocks into a block-aligned buffer, one read per
+  run of consecutive data blocks; holes come back as zeroes
+
+  INPUT: The data block numbers, how many, the buffer
+  OUTPUT: none
+
+*/
+static void read_runs(const int64_t * ptrs, int count, char * buf){
+
+  int i = 0;
+  while (i < count) {
+    int n = 1;
+    if (ptrs[i] == 0) {
+      memset(buf + i*BLOCK_SIZE, 0, BLOCK_SIZE);
+      i++;
+      continue;
+    }
+    while (i + n < count && ptrs[i + n] == ptrs[i] + n) {
+      n++;
+    }
+    block_read_run(info.dataregion_blocks_start + ptrs[i], n, buf + i*BLOCK_SIZE);
+    i += n;
+  }
+}
+
+/*
+  Writes a block-aligned buffer to mapped file blocks, one write per
+  run of consecutive data blocks; holes are left out
+
+  INPUT: The data block numbers, how many, the buffer
+  OUTPUT: none
+
+*/
+static void write_runs(const int64_t * ptrs, int count, const char * buf){
+
+  int i = 0;
+  while (i < count) {
+    int n = 1;
+    if (ptrs[i] == 0) {
+      i++;
+      continue;
+    }
+    while (i + n < count && ptrs[i + n] == ptrs[i] + n) {
+      n++;
+    }
+    block_write_run(info.dataregion_blocks_start + ptrs[i], n, buf + i*BLOCK_SIZE);
+    i += n;
+  }
+}
+
+/*
+  The most file data delayed allocation may hold in memory at once
+
+  INPUT: none
+  OUTPUT: The limit, in blocks
+
+*/
+static int64_t held_limit(){
+  return (int64_t) delalloc_kb * 1024 / BLOCK_SIZE;
+}
+
+/*
+  The pointer blocks mapping the file blocks from first to last could
+  need, not knowing which of them the file already has: at each level
+  of the tree those over the range, and, should the tree have to grow
+  to reach it, the one over the start of the file
+
+  INPUT: The first and last file block
+  OUTPUT: How many pointer blocks that is at most
+
+*/
+static int64_t ptr_blocks_spanned(int64_t first, int64_t last){
+
+  int64_t n = 0;
+  int height;
+  if (last >= 12 && first < SFS_TREE_FIRST) {
+    n++;
+  }
+  if (last >= SFS_TREE_FIRST) {
+    first = first > SFS_TREE_FIRST ? first - SFS_TREE_FIRST : 0;
+    last -= SFS_TREE_FIRST;
+    for (height = 1; height == 1 || last >= tree_span(height - 1); height++) {
+      n += last / tree_span(height) - first / tree_span(height) + 1;
+      if (first >= tree_span(height)) {
+        n++;
+      }
+    }
+  }
+  return n;
+}
+
+/*
+  The free data blocks the held data of a file (delalloc.c) keeps for
+  itself: a block for each held block and every pointer block they
+  could need, so writing them out later can't run out of space.
+  reserved_datablocks is the sum over all files, kept up to date by
+  adding the difference whenever the held blocks of a file change.
+
+  INPUT: The inode
+  OUTPUT: The blocks reserved
+
+*/
+static int64_t held_reservation(int inodeNum){
+
+  int64_t first, last;
+  int64_t held = delalloc_held(inodeNum, &first, &last);
+  return held == 0 ? 0 : held + ptr_blocks_spanned(first, last);
+}
+
+/*
+  Holds the unmapped blocks of a write in memory rather than giving
+  them data blocks now, if the memory delalloc_kb allows and the free
+  space to reserve for them are there.  Blocks already held stay held.
+
+  INPUT: The inode, the first file block, how many, their data blocks (0 for
+         none), where to store the contents held for each (NULL if mapped)
+  OUTPUT: 1 if every unmapped block is held, 0 if they need allocating now
+
+*/
+static int hold_blocks(int inodeNum, int64_t first, int count, const int64_t * ptrs, char ** held){
+
+  int64_t old = held_reservation(inodeNum);
+  int64_t lo = INT64_MAX, hi = -1;
+  int64_t n = delalloc_held(inodeNum, &lo, &hi);
+  int64_t added = 0;
+  int i;
+  for (i = 0; i < count; i++) {
+    held[i] = ptrs[i] == 0 ? delalloc_find(inodeNum, first + i) : NULL;
+    if (ptrs[i] == 0 && held[i] == NULL) {
+      lo = first + i < lo ? first + i : lo;
+      hi = first + i > hi ? first + i : hi;
+      added++;
+    }
+  }
+  if (added == 0) {
+    return 1;
+  }
+  if (!flush_running || delalloc_total() + added > held_limit()
+      || free_datablocks - reserved_datablocks < n + added + ptr_blocks_spanned(lo, hi) - old) {
+    return 0;
+  }
+  for (i = 0; i < count; i++) {
+    if (ptrs[i] == 0 && held[i] == NULL) {
+      held[i] = delalloc_hold(inodeNum, first + i);
+      if (held[i] == NULL) {
+        break;
+      }
+    }
+  }
+  reserved_datablocks += held_reservation(inodeNum) - old;
+  if (delalloc_total() > held_limit() / 2) {
+    pthread_cond_signal(&flush_cond);
+  }
+  return i == count;
+}
+
+/*
+  Stops holding held blocks of a file, giving up the space they
+  reserved, and hands them over to the caller
+
+  INPUT: The inode, the first and last file block, where to store the blocks
+         and their contents, the most to take
+  OUTPUT: How many were taken
+
+*/
+static int take_held(int inodeNum, int64_t first, int64_t last, int64_t * blocks, char ** data, int max){
+
+  int64_t old = held_reservation(inodeNum);
+  int taken = delalloc_take(inodeNum, first, last, blocks, data, max);
+  reserved_datablocks += held_reservation(inodeNum) - old;
+  return taken;
+}
+
+/*
+  Holds blocks taken with take_held again, reserving space for them
+  again, when they found no data block after all
+
+  INPUT: The inode, the blocks, their contents, how many
+  OUTPUT: none
+
+*/
+static void rehold(int inodeNum, const int64_t * blocks, char ** data, int count){
+
+  int64_t old = held_reservation(inodeNum);
+  int i;
+  for (i = 0; i < count; i++) {
+    if (delalloc_put(inodeNum, blocks[i], data[i]) != 0) {
+      log_error("rehold: out of memory, a block of inode %d is lost\n", inodeNum);
+      free(data[i]);
+    }
+  }
+  reserved_datablocks += held_reservation(inodeNum) - old;
+}
+
+/*
+  Throws away held blocks of a file and the space they reserved
+
+  INPUT: The inode, the first and last file block
+  OUTPUT: How many blocks were held
+
+*/
+static int64_t drop_held(int inodeNum, int64_t first, int64_t last){
+
+  int64_t old = held_reservation(inodeNum);
+  int64_t dropped = delalloc_drop(inodeNum, first, last);
+  reserved_datablocks += held_reservation(inodeNum) - old;
+  return dropped;
+}
+
+/*
+  Writes out the held blocks of a file: allocates data blocks for
+  them, each run of consecutive file blocks from as few contiguous
+  runs as the free space allows, and writes them one call per run.
+  Blocks that find no room stay held.
+
+  INPUT: The inode
+  OUTPUT: 0 on success, -errno if some of them are still held
+
+*/
+static int flush_held(int inodeNum){
+
+  struct range r;
+  int64_t first, last;
+  pthread_mutex_lock(&meta_lock);
+  int64_t held = delalloc_held(inodeNum, &first, &last);
+  pthread_mutex_unlock(&meta_lock);
+  if (held == 0) {
+    return 0;
+  }
+  // keep writes, reads and truncates of the held blocks out while
+  // they move from memory to the image
+  range_lock(&r, inodeNum, first, last, 1);
+  pthread_mutex_lock(&meta_lock);
+  held = delalloc_held(inodeNum, &first, &last);
+  int64_t * blocks = malloc(held * sizeof(int64_t));
+  int64_t * ptrs = malloc(held * sizeof(int64_t));
+  char ** data = malloc(held * sizeof(char *));
+  char * run = malloc(FLUSH_RUN_BLOCKS * BLOCK_SIZE);
+  if (held == 0 || blocks == NULL || ptrs == NULL || data == NULL || run == NULL) {
+    pthread_mutex_unlock(&meta_lock);
+    range_unlock(&r);
+    free(blocks);
+    free(ptrs);
+    free(data);
+    free(run);
+    return held == 0 ? 0 : -ENOMEM;
+  }
+  journal_begin();
+  int n = take_held(inodeNum, r.first, r.last, blocks, data, held);
+  inode node = get_inode(inodeNum);
+  int placed = 0;
+  int i, j, len;
+  while (placed < n) {
+    for (len = 1; placed + len < n && blocks[placed + len] == blocks[placed] + len; len++)
+      ;
+    int mapped = map_range(&node, inodeNum, blocks[placed], len, ptrs + placed, NULL, 1);
+    placed += mapped;
+    if (mapped < len) {
+      break;
+    }
+  }
+  set_inode(inodeNum, node);
+  rehold(inodeNum, blocks + placed, data + placed, n - placed);
+  pthread_mutex_unlock(&meta_lock);
+
+  i = 0;
+  while (i < placed) {
+    for (len = 1; i + len < placed && len < FLUSH_RUN_BLOCKS && ptrs[i + len] == ptrs[i] + len; len++)
+      ;
+    for (j = 0; j < len; j++) {
+      memcpy(run + j*BLOCK_SIZE, data[i + j], BLOCK_SIZE);
+      free(data[i + j]);
+    }
+    block_write_run(info.dataregion_blocks_start + ptrs[i], len, run);
+    i += len;
+  }
+  stats_count(STATS_DELALLOC_BLOCKS, placed);
+
+  pthread_mutex_lock(&meta_lock);
+  journal_end();
+  pthread_mutex_unlock(&meta_lock);
+  range_unlock(&r);
+  free(blocks);
+  free(ptrs);
+  free(data);
+  free(run);
+  if (placed < n) {
+    // the last free blocks may only be waiting for a commit
+    if (journal_freeing() && journal_sync() == 0) {
+      return flush_held(inodeNum);
+    }
+    log_warn("flush_held: out of data blocks writing out inode %d\n", inodeNum);
+    return -ENOSPC;
+  }
+  return 0;
+}
+
+int find_free_inode(){
+  int i;
+  int totalInodes = info.total_inodes;
+  for (i = 0; i < totalInodes; i++){
+    if (check_inode_status(i) == 0)
+      return i;
+    
+  }
+
+  return -1;
+}
+
+
+/*
+  Writes the in-core superblock out, with the free counts as they are
+
+  INPUT: Whether the filesystem is being left consistent (at unmount)
+  OUTPUT: none
+
+*/
+static void write_superblock(int clean){
+
+    super_block sblock;
+
+    memset(&sblock, 0, sizeof(super_block));
+    info.clean = clean;
+    info.free_datablocks = free_datablocks;
+    info.free_inodes = free_inodes;
+    sblock.list[0] = info;
+    journal_write(0, &sblock);
+}
+
+/*
+  The journal mkfs.sfs gives an image by default: a 64th of it, within
+  SFS_JOURNAL_MIN and SFS_JOURNAL_MAX blocks, but no more than an eighth
+  of a small image, which gets none if that is too little
+
+  INPUT: The size of the image in blocks
+  OUTPUT: How many blocks the journal takes
+
+*/
+static int64_t default_journal_blocks(int64_t total_blocks){
+
+  int64_t blocks = total_blocks / 64;
+  if (blocks > SFS_JOURNAL_MAX) {
+    blocks = SFS_JOURNAL_MAX;
+  }
+  if (blocks < SFS_JOURNAL_MIN) {
+    blocks = total_blocks / 8 >= SFS_JOURNAL_MIN ? SFS_JOURNAL_MIN : 0;
+  }
+  return blocks;
+}
+
+/*
+  Lays out an empty filesystem on the open image: the superblock, clear
+  bitmaps, an empty journal and the root directory.  On an image that can have holes the
+  rest is punched out; otherwise the inode table is zeroed later, a
+  group at a time, see init_inode_blocks.
+
+  INPUT: The share of the image for file data, in percent, the most the
+         image can be grown to, 0 for SFS_GROW_FACTOR times its size, and
+         the blocks for the journal, 0 for none or -1 for the default
+  OUTPUT: 0 on success, -errno otherwise
+
+*/
+static int format_image(int data_percent, int64_t max_size, int64_t journal_blocks){
+
+    inode node;
+    inode_block block;
+    int i;
+
+    //clearing all fields for the node
+    memset(&node, 0, sizeof(inode));
+
+  //clearing all fields for the inode_entry
+    for(i = 0; i < INODES_PER_BLOCK; i++){
+      
+      block.list[i] = node;
+
+    }
+
+    if (fstat(diskfile, &s) < 0) { //get file information
+      return -errno;
+    }
+    if (max_size == 0) {
+      max_size = (int64_t) s.st_size * SFS_GROW_FACTOR;
+    }
+    if (journal_blocks < 0) {
+      journal_blocks = default_journal_blocks(s.st_size / BLOCK_SIZE);
+    }
+    if (get_metadata_info(s.st_size, max_size, data_percent, journal_blocks, &info) != 0) { //gets all the metadata info
+      return -EINVAL;
+    }
+    info.magic = SFS_MAGIC;
+    info.version = SFS_VERSION;
+
+    // The old superblock goes first and the new one last, so an image
+    // whose format was cut short is never taken for a formatted one.
+    // Where the image can have holes, punching out all of it leaves
+    // everything zeroed without writing anything.
+    if (block_punch(0, s.st_size / BLOCK_SIZE) == 0) {
+      for (i = 0; i < SFS_INODE_GROUPS; i++) {
+        info.inode_table_init[i] = inode_group_size(i);
+      }
+    }
+    else {
+      log_debug("Writing the bitmaps\n");
+      block_zero(0, info.inode_blocks_start);
+      // the inode table is left as it is, but for the root's block
+      block_write(info.inode_blocks_start, &block);
+      info.inode_table_init[0] = 1;
+    }
+
+    free_datablocks = info.dataregion_blocks;
+    free_inodes = info.total_inodes;
+
+    // The root directory is inode 0, and its record is data block 0
+    filepath_block rblock;
+    memset(&rblock, 0, sizeof(filepath_block));
+    strcpy(rblock.filepath, "/");
+    rblock.inode = 0;
+    node.flags = SFS_DIR;
+    node.mtime = time(NULL);
+    set_inode_status(0, 1);
+    set_inode(0, node);
+    set_dataregion_status(0, 1);
+    block_write(info.dataregion_blocks_start, &rblock);
+    if (journal_format() != 0) {
+      return -EIO;
+    }
+
+    log_debug("Writing the superblock\n");
+    write_superblock(1);
+
+    return 0;
+}
+
+/*
+  Counts the clear bits of a bitmap
+
+  INPUT: The first block of the bitmap, how many bits are in use
+  OUTPUT: How many of them are clear
+
+*/
+static int64_t count_free(int64_t bitmap_start, int64_t bits){
+
+  unsigned char bitmap[BLOCK_SIZE];
+  int64_t i, used = 0;
+  for (i = 0; i < bits; ) {
+    if (i % BITS_PER_BLOCK == 0) {
+      block_read(bitmap_start + i / BITS_PER_BLOCK, bitmap);
+    }
+    // whole bytes at a time, then the bits of the last one
+    if (i % BITS_PER_BYTE == 0 && bits - i >= BITS_PER_BYTE) {
+      used += __builtin_popcount(bitmap[(i % BITS_PER_BLOCK) / BITS_PER_BYTE]);
+      i += BITS_PER_BYTE;
+      continue;
+    }
+    if (bitmap[(i % BITS_PER_BLOCK) / BITS_PER_BYTE] & (1 << (ZERO_INDEX_BITS - i % BITS_PER_BYTE))) {
+      used++;
+    }
+    i++;
+  }
+  return bits - used;
+}
+
+/*
+  Checks that the layout in info is one mkfs.sfs could have made, on an
+  image of the given size.  The image may be bigger than the superblock
+  says, if libsfs_grow was cut short; the next one picks up the space.
+
+  INPUT: The size of the image in bytes
+  OUTPUT: NULL if it is, otherwise what is wrong with it
+
+*/
+const char * check_metadata_info(int64_t image_size){
+
+  int i;
+  if (info.disksize > image_size || info.dataregion_blocks_start + info.dataregion_blocks > image_size / BLOCK_SIZE) {
+    return "the image is smaller than the filesystem";
+  }
+  if (info.total_inodes <= 0 || info.dataregion_blocks <= 0
+      || info.total_inodes != info.inode_blocks * INODES_PER_BLOCK
+      || info.total_inodes > SFS_MAX_INODES) {
+    return "bad block or inode count";
+  }
+  if (info.dataregion_bitmap_blocks < bitmap_blocks(info.dataregion_blocks)
+      || info.inode_bitmap_blocks < bitmap_blocks(info.total_inodes)) {
+    return "a bitmap is too small";
+  }
+  if (info.dataregion_bitmap_start != 1
+      || info.inode_bitmap_start != info.dataregion_bitmap_start + info.dataregion_bitmap_blocks
+      || info.inode_blocks_start != info.inode_bitmap_start + info.inode_bitmap_blocks
+      || info.journal_start != info.inode_blocks_start + info.inode_blocks
+      || info.dataregion_blocks_start != info.journal_start + info.journal_blocks) {
+    return "the regions are out of place";
+  }
+  if (info.journal_blocks < 0 || info.journal_blocks == 1) {
+    return "bad journal size";
+  }
+  for (i = 0; i < SFS_INODE_GROUPS; i++) {
+    if (info.inode_table_init[i] < 0 || info.inode_table_init[i] > inode_group_size(i)) {
+      return "bad inode table mark";
+    }
+  }
+  return NULL;
+}
+
+/*
+  Picks up an image formatted by mkfs.sfs: reads the layout from the
+  superblock and checks it, replays what the journal holds, and takes
+  the free block and inode counts from the superblock if the image was
+  unmounted cleanly, or counts them if not.  The image is marked in use
+  until libsfs_close.
+
+  INPUT: none
+  OUTPUT: 0 on success, -EINVAL if the image doesn't hold an sfs
+          filesystem of this version
+
+*/
+static int load_image(){
+
+  super_block sblock;
+  if (fstat(diskfile, &s) < 0) {
+    return -errno;
+  }
+  if (block_read(0, &sblock) != BLOCK_SIZE) {
+    log_error("libsfs_open: %s is too small to hold a filesystem\n", filepath);
+    return -EINVAL;
+  }
+  info = sblock.list[0];
+  // layouts before 3 had 32-bit fields, with the magic number eleventh
+  if (info.magic != SFS_MAGIC && ((int32_t *) &sblock)[10] == SFS_MAGIC) {
+    log_error("libsfs_open: %s has layout version %d, which is no longer supported\n",
+              filepath, ((int32_t *) &sblock)[11]);
+    return -EINVAL;
+  }
+  if (info.magic != SFS_MAGIC) {
+    log_error("libsfs_open: %s is not an sfs image\n", filepath);
+    return -EINVAL;
+  }
+  if (info.version != SFS_VERSION) {
+    log_error("libsfs_open: %s has layout version %d, not %d\n",
+              filepath, info.version, SFS_VERSION);
+    return -EINVAL;
+  }
+  const char * problem = check_metadata_info(s.st_size);
+  if (problem != NULL) {
+    log_error("libsfs_open: the superblock of %s doesn't match the image: %s\n", filepath, problem);
+    return -EINVAL;
+  }
+  int replayed = journal_replay(0);
+  if (replayed < 0) {
+    log_error("libsfs_open: can't replay the journal of %s\n", filepath);
+    return replayed;
+  }
+  if (replayed > 0) {
+    // the superblock may have been put back too
+    block_read(0, &sblock);
+    info = sblock.list[0];
+    problem = check_metadata_info(s.st_size);
+    if (info.magic != SFS_MAGIC || info.version != SFS_VERSION || problem != NULL) {
+      log_error("libsfs_open: the journal of %s left a bad superblock: %s\n", filepath,
+                problem != NULL ? problem : "not an sfs superblock");
+      return -EINVAL;
+    }
+    info.clean = 0;
+  }
+  if (info.clean) {
+    free_datablocks = info.free_datablocks;
+    free_inodes = info.free_inodes;
+  }
+  else {
+    log_warn("libsfs_open: %s was not unmounted cleanly, counting free space\n", filepath);
+    free_datablocks = count_free(info.dataregion_bitmap_start, info.dataregion_blocks);
+    free_inodes = count_free(info.inode_bitmap_start, info.total_inodes);
+  }
+  write_superblock(0);
+  return 0;
+}
+
+/*
+  Zeroes what is left of the inode table a run at a time, letting go of
+  meta_lock in between so requests hardly notice, until it is all done
+  or libsfs_close asks it to stop
+
+  INPUT: none
+  OUTPUT: none
+
+*/
+static void *itable_worker(void *arg){
+
+  struct timespec ts;
+  int group, last;
+
+  pthread_mutex_lock(&meta_lock);
+  while (!itable_stop) {
+    for (group = 0; group < SFS_INODE_GROUPS; group++) {
+      if (info.inode_table_init[group] < inode_group_size(group)) {
+        break;
+      }
+    }
+    if (group == SFS_INODE_GROUPS) {
+      log_info("inode table of %s zeroed\n", filepath);
+      break;
+    }
+    last = info.inode_table_init[group] + INODE_INIT_RUN;
+    last = last < inode_group_size(group) ? last : inode_group_size(group);
+    journal_begin();
+    init_inode_blocks(group * inode_group_blocks() + last - 1);
+    journal_end();
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += INODE_INIT_PAUSE_NS;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&itable_cond, &meta_lock, &ts);
+  }
+  pthread_mutex_unlock(&meta_lock);
+  return NULL;
+}
+
+/*
+  Writes out file data held by delayed allocation once it has waited
+  delalloc_ms, oldest first, and sooner while more than half of what
+  delalloc_kb allows is held.  A file whose blocks find no room is
+  left for a round before it is tried again.
+
+  INPUT: none
+  OUTPUT: none
+
+*/
+static void *flush_worker(void *arg){
+
+  struct timespec now, since, ts;
+  int64_t waited, wait;
+  int stuck = 0;
+
+  pthread_mutex_lock(&meta_lock);
+  while (!flush_stop) {
+    int inodeNum = delalloc_oldest(&since);
+    waited = 0;
+    if (inodeNum != -1) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      waited = (now.tv_sec - since.tv_sec) * 1000 + (now.tv_nsec - since.tv_nsec) / 1000000;
+    }
+    if (inodeNum != -1 && !stuck && (waited >= delalloc_ms || delalloc_total() > held_limit() / 2)) {
+      pthread_mutex_unlock(&meta_lock);
+      stuck = flush_held(inodeNum) != 0;
+      pthread_mutex_lock(&meta_lock);
+      continue;
+    }
+    stuck = 0;
+    wait = inodeNum == -1 || waited >= delalloc_ms ? delalloc_ms : delalloc_ms - waited;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += wait / 1000;
+    ts.tv_nsec += (wait % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&flush_cond, &meta_lock, &ts);
+  }
+  pthread_mutex_unlock(&meta_lock);
+  return NULL;
+}
+
+/*
+  Clears the data bitmap bits of blocks about to be added to the data
+  region, which mkfs.sfs left clear but which may hold leftovers from
+  before a grow that was cut short.  The partial bitmap block at the
+  start is rewritten; the whole ones after it are zeroed.
+
+  INPUT: The first and one past the last data block to clear
+  OUTPUT: 0 on success, -errno otherwise
+
+*/
+static int clear_dataregion_bits(int64_t first, int64_t last){
+
+  char bitmap[BLOCK_SIZE];
+  int64_t blk_number = first / BITS_PER_BLOCK;
+  int64_t i;
+  if (first % BITS_PER_BLOCK != 0) {
+    journal_read(info.dataregion_bitmap_start + blk_number, bitmap);
+    for (i = first; i < last && i / BITS_PER_BLOCK == blk_number; i++) {
+      bitmap[(i % BITS_PER_BLOCK) / BITS_PER_BYTE] &= ~(1 << (ZERO_INDEX_BITS - i % BITS_PER_BYTE));
+    }
+    if (journal_write(info.dataregion_bitmap_start + blk_number, bitmap) != BLOCK_SIZE) {
+      return -EIO;
+    }
+    blk_number++;
+  }
+  if (blk_number < bitmap_blocks(last)) {
+    return block_zero(info.dataregion_bitmap_start + blk_number, bitmap_blocks(last) - blk_number);
+  }
+  return 0;
+}
+
+/** Lay out an empty filesystem on an image, losing what was there
+ *
+ * The image must not be open.  With a size the image is first grown or
+ * shrunk to it; otherwise its current size is used.
+ */
+int libsfs_format(const char *image, const struct libsfs_format *params)
+{
+    int data_percent = SFS_DATA_PERCENT;
+    off_t max_size = 0;
+    int64_t journal_blocks = -1;
+    int retstat, fd;
+
+    if (params != NULL && params->data_percent != 0) {
+      data_percent = params->data_percent;
+    }
+    if (data_percent <= 0 || data_percent >= 100) {
+      return -EINVAL;
+    }
+    if (params != NULL && (params->size < 0 || params->max_size < 0)) {
+      return -EINVAL;
+    }
+    if (params != NULL) {
+      max_size = params->max_size;
+    }
+    if (params != NULL && params->journal_size != 0) {
+      // a header and at least one block of ring
+      journal_blocks = params->journal_size < 0 ? 0 : params->journal_size / BLOCK_SIZE;
+      if (params->journal_size > 0 && journal_blocks < 2) {
+        return -EINVAL;
+      }
+    }
+
+    pthread_mutex_lock(&meta_lock);
+    if (the_fs != NULL) {
+      pthread_mutex_unlock(&meta_lock);
+      return -EBUSY;
+    }
+    filepath = (char *) image;
+    // unlike libsfs_open, this makes the image if it isn't there
+    fd = open(image, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+      retstat = -errno;
+    }
+    else {
+      close(fd);
+      retstat = disk_open(image);
+    }
+    if (retstat == 0 && params != NULL && params->size != 0
+        && ftruncate(diskfile, params->size) < 0) {
+      retstat = -errno;
+    }
+    if (retstat == 0) {
+      retstat = format_image(data_percent, max_size, journal_blocks);
+    }
+    if (retstat == 0 && fsync(diskfile) < 0) {
+      retstat = -errno;
+    }
+    disk_close();
+    filepath = NULL;
+    pthread_mutex_unlock(&meta_lock);
+
+    return retstat;
+}
+
+/** Open a disk image
+ *
+ * With LIBSFS_FORMAT an empty filesystem is laid out first, with the
+ * default parameters; otherwise the image must hold one already, as
+ * mkfs.sfs leaves it.  Only one image can be open at a time (-EBUSY).
+ */
+int libsfs_open(const char *image, int flags, struct libsfs **fs)
+{
+    struct libsfs *new;
+    int retstat;
+
+    if (flags & LIBSFS_FORMAT) {
+      retstat = libsfs_format(image, NULL);
+      if (retstat != 0) {
+        return retstat;
+      }
+    }
+
+    new = calloc(1, sizeof(struct libsfs));
+    if (new == NULL || (new->image = strdup(image)) == NULL) {
+      free(new);
+      return -ENOMEM;
+    }
+
+    pthread_mutex_lock(&meta_lock);
+    if (the_fs != NULL) {
+      pthread_mutex_unlock(&meta_lock);
+      free(new->image);
+      free(new);
+      return -EBUSY;
+    }
+    filepath = new->image;
+    retstat = disk_open(image);
+    if (retstat == 0) {
+      retstat = load_image();
+    }
+    if (retstat == 0 && icache_init(info.total_inodes) != 0) {
+      log_error("libsfs_open: can't allocate the inode cache\n");
+      // leave it as load_image found it; the counts are right either way
+      write_superblock(1);
+      retstat = -ENOMEM;
+    }
+    if (retstat != 0) {
+      disk_close();
+      filepath = NULL;
+      pthread_mutex_unlock(&meta_lock);
+      free(new->image);
+      free(new);
+      return retstat;
+    }
+    the_fs = new;
+    pthread_mutex_unlock(&meta_lock);
+
+    log_info("libsfs_open: %s, %lld data blocks, %lld inodes\n",
+	     image, (long long) info.dataregion_blocks, (long long) info.total_inodes);
+    *fs = new;
+    return 0;
+}
+
+/** Start the background work on an open image
+ *
+ * That is journaling metadata changes, committed in batches by a
+ * thread of its own (journal.c), zeroing the part of the inode table
+ * mkfs.sfs left alone, and delayed allocation of file data
+ * (delalloc.c).  Without it, metadata is written in place as it
+ * changes, blocks of the table are zeroed as inodes in them are first
+ * used, and writes allocate their blocks at once.  Separate from
+ * libsfs_open so a daemon can open the image before it forks and
+ * start its threads after.
+ */
+int libsfs_start(struct libsfs *fs)
+{
+    int retstat = 0;
+
+    pthread_mutex_lock(&meta_lock);
+    if (fs == NULL || fs != the_fs) {
+      retstat = -EINVAL;
+    }
+    else {
+      retstat = journal_start(&meta_lock);
+    }
+    if (retstat == 0 && !itable_running) {
+      itable_stop = 0;
+      retstat = -pthread_create(&itable_thread, NULL, itable_worker, NULL);
+      itable_running = retstat == 0;
+    }
+    if (retstat == 0 && !flush_running) {
+      flush_stop = 0;
+      retstat = -pthread_create(&flush_thread, NULL, flush_worker, NULL);
+      flush_running = retstat == 0;
+    }
+    pthread_mutex_unlock(&meta_lock);
+
+    return retstat;
+}
+
+/** Close the image libsfs_open returned, marking it clean */
+void libsfs_close(struct libsfs *fs)
+{
+    pthread_mutex_lock(&meta_lock);
+    if (fs == NULL || fs != the_fs) {
+      pthread_mutex_unlock(&meta_lock);
+      return;
+    }
+    if (flush_running) {
+      flush_stop = 1;
+      pthread_cond_signal(&flush_cond);
+      pthread_mutex_unlock(&meta_lock);
+      pthread_join(flush_thread, NULL);
+      pthread_mutex_lock(&meta_lock);
+      flush_running = 0;
+    }
+    // write out what is still held; what finds no room is lost
+    int inodeNum;
+    while ((inodeNum = delalloc_oldest(NULL)) != -1) {
+      pthread_mutex_unlock(&meta_lock);
+      int err = flush_held(inodeNum);
+      pthread_mutex_lock(&meta_lock);
+      if (err != 0) {
+        log_error("libsfs_close: data written to inode %d lost: %s\n", inodeNum, strerror(-err));
+        drop_held(inodeNum, 0, MAX_FILE_BLOCKS);
+      }
+    }
+    if (itable_running) {
+      itable_stop = 1;
+      pthread_cond_signal(&itable_cond);
+      pthread_mutex_unlock(&meta_lock);
+      pthread_join(itable_thread, NULL);
+      pthread_mutex_lock(&meta_lock);
+      itable_running = 0;
+    }
+    journal_stop();
+    prealloc_reset();
+    icache_destroy();
+    write_superblock(1);
+    fsync(diskfile);
+    disk_close();
+    the_fs = NULL;
+    filepath = NULL;
+    pthread_mutex_unlock(&meta_lock);
+    free(fs->image);
+    free(fs);
+}
+
+/** Run the internals in params.h as one metadata operation
+ *
+ * For tools that call get_inode, set_inode, the bitmap setters and the
+ * like directly (sfs-bench): between libsfs_begin and libsfs_end they
+ * hold off every request and the background work libsfs_start runs,
+ * and what they change goes into the journal as one update.
+ */
+void libsfs_begin(struct libsfs *fs)
+{
+    pthread_mutex_lock(&meta_lock);
+    journal_begin();
+}
+
+/** End an operation libsfs_begin started */
+void libsfs_end(struct libsfs *fs)
+{
+    journal_end();
+    pthread_mutex_unlock(&meta_lock);
+}
+
+/** Grow an open image to @size bytes while it is in use
+ *
+ * The new space goes to the data region; the inode table keeps its
+ * size.  The data bitmap can't move, so the image can only grow as far
+ * as the room mkfs.sfs left in it (-EFBIG past that), and never shrinks
+ * (-EINVAL).  The image file is extended and the new bitmap bits
+ * cleared before the superblock, written last, takes in the space, so
+ * a grow cut short leaves the filesystem as it was.  Reads and writes
+ * of existing files carry on meanwhile; allocation waits.
+ */
+int libsfs_grow(struct libsfs *fs, off_t size)
+{
+    int64_t blocks, added;
+    int retstat = 0;
+
+    pthread_mutex_lock(&meta_lock);
+    if (fs == NULL || fs != the_fs || size < info.disksize) {
+      pthread_mutex_unlock(&meta_lock);
+      return -EINVAL;
+    }
+    blocks = size / BLOCK_SIZE - info.dataregion_blocks_start;
+    if (blocks > info.dataregion_bitmap_blocks * BITS_PER_BLOCK) {
+      log_error("libsfs_grow: %s can't grow past %lld bytes\n", filepath,
+                (long long) (info.dataregion_blocks_start
+                             + info.dataregion_bitmap_blocks * BITS_PER_BLOCK) * BLOCK_SIZE);
+      pthread_mutex_unlock(&meta_lock);
+      return -EFBIG;
+    }
+    added = blocks - info.dataregion_blocks;
+
+    journal_begin();
+    if (ftruncate(diskfile, size) < 0) {
+      retstat = -errno;
+    }
+    if (retstat == 0 && added > 0) {
+      retstat = clear_dataregion_bits(info.dataregion_blocks, blocks);
+    }
+    if (retstat == 0 && fsync(diskfile) < 0) {
+      retstat = -errno;
+    }
+    if (retstat == 0) {
+      info.disksize = size;
+      if (added > 0) {
+        info.dataregion_blocks = blocks;
+        free_datablocks += added;
+      }
+      write_superblock(0);
+      log_info("libsfs_grow: %s is now %lld bytes, %lld data blocks\n", filepath,
+               (long long) size, (long long) info.dataregion_blocks);
+    }
+    journal_end();
+    pthread_mutex_unlock(&meta_lock);
+    if (retstat == 0) {
+      retstat = journal_sync();
+    }
+
+    return retstat;
+}
+
+/** Get the attributes of a file or directory */
+int libsfs_getattr(struct libsfs *fs, const char *path, struct libsfs_attr *attr)
+{
+    pthread_mutex_lock(&meta_lock);
+    int inodeNum = findInode(path);
+    inode node;
+    if (inodeNum != -1) {
+      node = get_inode(inodeNum);
+    }
+    pthread_mutex_unlock(&meta_lock);
+    if (inodeNum == -1) {
+      return walk_error;
+    }
+
+    attr->ino = inodeNum;
+    attr->is_dir = (node.flags & SFS_DIR) != 0;
+    attr->size = node.size;
+    attr->mtime = node.mtime;
+
+    return 0;
+}
+
+/** Create an empty file
+ *
+ * Succeeds without changing anything if the file is already there.
+ */
+int libsfs_create(struct libsfs *fs, const char *path)
+{
+    int retstat = 0;
+
+    pthread_mutex_lock(&meta_lock);
+    journal_begin();
+    int inodeNum = findInode(path);
+    int parentNum = findParentInode(path);
+    if (inodeNum == -1 && parentNum == -1) {
+      retstat = walk_error;
+    }
+    else if (inodeNum == -1 && !(get_inode(parentNum).flags & SFS_DIR)) {
+      retstat = -ENOTDIR;
+    }
+    // file does not exist
+    else if (inodeNum == -1) {
+      int numOfDirs = get_num_dirs(path);
+      char ** fldrs = parsePath(path);
+      char * name = fldrs[numOfDirs - 1];
+      inode parent = get_inode(parentNum);
+      int i, slot;
+      int64_t datablockNum;
+      // find a free entry in the parent directory
+      slot = -1;
+      for (i = 0; i < 12; i++) {
+        if (parent.direct_ptrs[i] == 0) {
+          slot = i;
+          break;
+        }
+      }
+      if (strlen(name) > NAME_MAX) {
+        retstat = -ENAMETOOLONG;
+      }
+      else if (slot == -1) {
+        retstat = -ENOSPC;
+      }
+      else {
+        inodeNum = find_free_inode();
+        datablockNum = find_free_datablock();
+        if (inodeNum == -1 || datablockNum == -1) {
+          log_warn("libsfs_create: out of %s creating %s\n",
+                   inodeNum == -1 ? "inodes" : "data blocks", path);
+          retstat = -ENOSPC;
+        }
+      }
+      if (retstat == 0) {
+        inode node;
+        filepath_block fblock;
+        memset(&node, 0, sizeof(inode));
+        node.mtime = time(NULL);
+        set_inode_status(inodeNum, 1);
+        set_inode(inodeNum, node);
+        icache_reset(inodeNum);
+
+        memset(&fblock, 0, sizeof(filepath_block));
+        strcpy(fblock.filepath, name);
+        fblock.inode = inodeNum;
+        set_dataregion_status(datablockNum, 1);
+        journal_write(info.dataregion_blocks_start + datablockNum, &fblock);
+
+        parent.direct_ptrs[slot] = datablockNum;
+        parent.mtime = node.mtime;
+        set_inode(parentNum, parent);
+      }
+      for (i = 0; i < numOfDirs; i++) {
+        free(fldrs[i]);
+      }
+      free(fldrs);
+    }
+    journal_end();
+    pthread_mutex_unlock(&meta_lock);
+    // the last free blocks may only be waiting for a commit (libsfs_write)
+    if (retstat == -ENOSPC && journal_freeing() && journal_sync() == 0) {
+      return libsfs_create(fs, path);
+    }
+
+    return retstat;
+}
+
+/** Remove a file */
+int libsfs_unlink(struct libsfs *fs, const char *path)
+{
+    int retstat = 0;
+
+    int64_t fblockNum;
+    pthread_mutex_lock(&meta_lock);
+    int inodeNum = walkPath(path, &fblockNum);
+    int isDir = inodeNum != -1 && (get_inode(inodeNum).flags & SFS_DIR);
+    pthread_mutex_unlock(&meta_lock);
+    if (inodeNum == -1) {
+      return walk_error;
+    }
+    // the root among them; taking those apart is rmdir's job
+    if (isDir) {
+      return -EISDIR;
+    }
+    // let reads and writes still running on the file finish before
+    // its blocks go back to the free pool
+    struct range r;
+    range_lock(&r, inodeNum, 0, MAX_FILE_BLOCKS - 1, 1);
+    pthread_mutex_lock(&meta_lock);
+    journal_begin();
+    if (walkPath(path, &fblockNum) != inodeNum) {
+      journal_end();
+      pthread_mutex_unlock(&meta_lock);
+      range_unlock(&r);
+      return -ENOENT;
+    }
+    int parentNum = findParentInode(path);
+    inode node = get_inode(inodeNum);
+    inode parent = get_inode(parentNum);
+    int i;
+    free_blocks_from(&node, 0);
+    prealloc_forget(inodeNum);
+    stats_count(STATS_DELALLOC_DROPPED, drop_held(inodeNum, 0, MAX_FILE_BLOCKS));
+    for (i = 0; i < 12; i++) {
+      if (parent.direct_ptrs[i] == fblockNum) {
+        parent.direct_ptrs[i] = 0;
+      }
+    }
+    parent.mtime = time(NULL);
+    set_inode(parentNum, parent);
+    set_dataregion_status(fblockNum, 0);
+    journal_free(info.dataregion_blocks_start + fblockNum, 1);
+    set_inode_status(inodeNum, 0);
+    journal_end();
+    pthread_mutex_unlock(&meta_lock);
+    range_unlock(&r);
+    icache_modified(inodeNum);
+    
+    return retstat;
+}
+
+/** Open a file
+ *
+ * If @keep_cache isn't NULL it is set to whether the file is
+ * unchanged since it was last opened, so cached pages are still good.
+ */
+int libsfs_open_file(struct libsfs *fs, const char *path, int *keep_cache)
+{
+    pthread_mutex_lock(&meta_lock);
+    int inodeNum = findInode(path);
+    pthread_mutex_unlock(&meta_lock);
+    if (inodeNum == -1) {
+      return walk_error;
+    }
+    if (keep_cache != NULL) {
+      *keep_cache = icache_open(inodeNum);
+    }
+
+    return 0;
+}
+
+/** Release an open file
+ *
+ * Gives back the blocks set aside for appends to it (prealloc.c).
+ * Blocks written out for it later get none set aside until it is
+ * written to again.
+ */
+int libsfs_release(struct libsfs *fs, const char *path)
+{
+    pthread_mutex_lock(&meta_lock);
+    int inodeNum = findInode(path);
+    if (inodeNum != -1) {
+      prealloc_trim(inodeNum);
+    }
+    pthread_mutex_unlock(&meta_lock);
+    if (inodeNum == -1) {
+      return walk_error;
+    }
+
+    return 0;
+}
+
+/** Read from a file
+ *
+ * Returns the number of bytes read, short only at end of file.
+ */
+int libsfs_read(struct libsfs *fs, const char *path, char *buf, size_t size, off_t offset)
+{
+    int retstat = 0;
+
+    if (size == 0 || offset >= MAX_FILE_BLOCKS*BLOCK_SIZE) {
+      return 0;
+    }
+    if (offset + size > MAX_FILE_BLOCKS*BLOCK_SIZE) {
+      size = MAX_FILE_BLOCKS*BLOCK_SIZE - offset;
+    }
+    pthread_mutex_lock(&meta_lock);
+    int inodeNum = findInode(path);
+    pthread_mutex_unlock(&meta_lock);
+    if (inodeNum == -1) {
+      return walk_error;
+    }
+    // Hold the blocks we are about to read so an overlapping write or
+    // truncate cannot change them under us; reads elsewhere in the
+    // file, and other reads of these blocks, carry on in parallel.
+    // The size is only looked at once the range is ours.
+    struct range r;
+    int64_t first = offset / BLOCK_SIZE;
+    int count = (offset + size - 1) / BLOCK_SIZE - first + 1;
+    range_lock(&r, inodeNum, first, first + count - 1, 0);
+    pthread_mutex_lock(&meta_lock);
+    inode node = get_inode(inodeNum);
+    pthread_mutex_unlock(&meta_lock);
+    if (offset >= node.size) {
+      range_unlock(&r);
+      return 0;
+    }
+    if (offset + size > node.size) {
+      size = node.size - offset;
+      count = (offset + size - 1) / BLOCK_SIZE - first + 1;
+    }
+    // Map the whole request once and read it with one call per run of
+    // consecutive data blocks.  Blocks never written (holes left by a
+    // write past EOF or a truncate that grew the file) read back as
+    // zeroes.  Blocks held by delayed allocation are holes on disk;
+    // their contents come from memory.
+    int64_t * ptrs = malloc(count * sizeof(int64_t));
+    char ** held = malloc(count * sizeof(char *));
+    char * blocks = malloc(count * BLOCK_SIZE);
+    if (ptrs == NULL || held == NULL || blocks == NULL) {
+      range_unlock(&r);
+      free(ptrs);
+      free(held);
+      free(blocks);
+      return -ENOMEM;
+    }
+    int i;
+    pthread_mutex_lock(&meta_lock);
+    map_range(&node, inodeNum, first, count, ptrs, NULL, 0);
+    for (i = 0; i < count; i++) {
+      held[i] = ptrs[i] == 0 ? delalloc_find(inodeNum, first + i) : NULL;
+    }
+    pthread_mutex_unlock(&meta_lock);
+    read_runs(ptrs, count, blocks);
+    for (i = 0; i < count; i++) {
+      if (held[i] != NULL) {
+        memcpy(blocks + i*BLOCK_SIZE, held[i], BLOCK_SIZE);
+      }
+    }
+    range_unlock(&r);
+    memcpy(buf, blocks + offset % BLOCK_SIZE, size);
+    free(ptrs);
+    free(held);
+    free(blocks);
+    retstat = size;
+
+   
+    return retstat;
+}
+
+/** Write to a file
+ *
+ * Returns the number of bytes written, short only if the disk fills.
+ */
+int libsfs_write(struct libsfs *fs, const char *path, const char *buf, size_t size, off_t offset)
+{
+    int retstat = 0;
+
+    if (size == 0) {
+      return 0;
+    }
+    if (offset >= MAX_FILE_BLOCKS*BLOCK_SIZE) {
+      return -EFBIG;
+    }
+    if (offset + size > MAX_FILE_BLOCKS*BLOCK_SIZE) {
+      size = MAX_FILE_BLOCKS*BLOCK_SIZE - offset;
+    }
+    size_t wanted = size;
+    int64_t first = offset / BLOCK_SIZE;
+    int count = (offset + size - 1) / BLOCK_SIZE - first + 1;
+    int64_t lo, hi;
+    pthread_mutex_lock(&meta_lock);
+    int inodeNum = findInode(path);
+    int crowded = inodeNum != -1 && delalloc_total() + count > held_limit()
+                  && delalloc_held(inodeNum, &lo, &hi) > 0;
+    pthread_mutex_unlock(&meta_lock);
+    if (inodeNum == -1) {
+      return walk_error;
+    }
+    // held data has filled the memory it may take: write out what
+    // this file holds first, so the rest of it is held in turn rather
+    // than allocated piecemeal
+    if (crowded) {
+      flush_held(inodeNum);
+    }
+    // Map the whole request in one pass under the metadata lock, then
+    // write it outside the lock with one call per run of consecutive
+    // data blocks.  Blocks with no data block yet are held in memory
+    // by delayed allocation (delalloc.c) if there is room, and given
+    // one later; otherwise they are allocated here.  The blocks stay
+    // locked against overlapping reads, writes and truncates
+    // throughout, which also keeps the read-modify-write of a partial
+    // first or last block from racing another write into the same
+    // block.
+    struct range r;
+    int64_t * ptrs = malloc(count * sizeof(int64_t));
+    char * fresh = malloc(count);
+    char ** held = malloc(count * sizeof(char *));
+    int64_t * heldBlocks = malloc(count * sizeof(int64_t));
+    char * blocks = malloc(count * BLOCK_SIZE);
+    if (ptrs == NULL || fresh == NULL || held == NULL || heldBlocks == NULL || blocks == NULL) {
+      free(ptrs);
+      free(fresh);
+      free(held);
+      free(heldBlocks);
+      free(blocks);
+      return -ENOMEM;
+    }
+    int headOffset = offset % BLOCK_SIZE;
+    int tailEnd = (offset + size) % BLOCK_SIZE;
+    int headHeld = 0, tailHeld = 0;
+    int i;
+    range_lock(&r, inodeNum, first, first + count - 1, 1);
+    pthread_mutex_lock(&meta_lock);
+    // the file may have gone while we waited for the range; unlink
+    // needs all of it, so it can't go once the range is ours
+    if (findInode(path) != inodeNum) {
+      pthread_mutex_unlock(&meta_lock);
+      range_unlock(&r);
+      free(ptrs);
+      free(fresh);
+      free(held);
+      free(heldBlocks);
+      free(blocks);
+      return -ENOENT;
+    }
+    prealloc_written(inodeNum);
+    journal_begin();
+    inode node = get_inode(inodeNum);
+    int mapped = map_range(&node, inodeNum, first, count, ptrs, fresh, 0);
+    // a partial first or last block already held starts out as what
+    // it holds
+    char * h;
+    if (headOffset != 0 && (h = delalloc_find(inodeNum, first)) != NULL) {
+      memcpy(blocks, h, BLOCK_SIZE);
+      headHeld = 1;
+    }
+    if (tailEnd != 0 && (count > 1 || headOffset == 0)
+        && (h = delalloc_find(inodeNum, first + count - 1)) != NULL) {
+      memcpy(blocks + (count - 1)*BLOCK_SIZE, h, BLOCK_SIZE);
+      tailHeld = 1;
+    }
+    if (!hold_blocks(inodeNum, first, count, ptrs, held)) {
+      // allocate them now, held ones too, out of the space those had
+      // reserved; any the disk has no room for stay held
+      int taken = take_held(inodeNum, first, first + count - 1, heldBlocks, held, count);
+      mapped = map_range(&node, inodeNum, first, count, ptrs, fresh, 1);
+      set_inode(inodeNum, node);
+      for (i = 0; i < taken && heldBlocks[i] < first + mapped; i++) {
+        free(held[i]);
+      }
+      rehold(inodeNum, heldBlocks + i, held + i, taken - i);
+      memset(held, 0, count * sizeof(char *));
+    }
+    pthread_mutex_unlock(&meta_lock);
+    if (mapped < count) {
+      // the disk filled up part way: write what fits
+      count = mapped;
+      off_t fits = (off_t) (first + count)*BLOCK_SIZE - offset;
+      if (fits < (off_t) size) {
+        size = fits > 0 ? fits : 0;
+      }
+    }
+    if (size > 0) {
+      tailEnd = (offset + size) % BLOCK_SIZE;
+      // partial first and last blocks keep whatever they held before;
+      // newly allocated or held ones start out as zeroes
+      if (headOffset != 0 && !headHeld) {
+        if (fresh[0] || ptrs[0] == 0)
+          memset(blocks, 0, BLOCK_SIZE);
+        else
+          block_read(info.dataregion_blocks_start + ptrs[0], blocks);
+      }
+      if (tailEnd != 0 && (count > 1 || headOffset == 0) && !tailHeld) {
+        if (fresh[count - 1] || ptrs[count - 1] == 0)
+          memset(blocks + (count - 1)*BLOCK_SIZE, 0, BLOCK_SIZE);
+        else
+          block_read(info.dataregion_blocks_start + ptrs[count - 1], blocks + (count - 1)*BLOCK_SIZE);
+      }
+      memcpy(blocks + headOffset, buf, size);
+      write_runs(ptrs, count, blocks);
+      for (i = 0; i < count; i++) {
+        if (held[i] != NULL) {
+          memcpy(held[i], blocks + i*BLOCK_SIZE, BLOCK_SIZE);
+        }
+      }
+    }
+    free(ptrs);
+    free(fresh);
+    free(held);
+    free(heldBlocks);
+    free(blocks);
+    if (size == 0) {
+      pthread_mutex_lock(&meta_lock);
+      journal_end();
+      pthread_mutex_unlock(&meta_lock);
+      range_unlock(&r);
+      // blocks freed since the last commit can't be had until it is
+      // on disk; with nothing else left, wait for it and try again
+      if (journal_freeing() && journal_sync() == 0) {
+        return libsfs_write(fs, path, buf, wanted, offset);
+      }
+      log_warn("libsfs_write: out of data blocks writing %s\n", path);
+      return -ENOSPC;
+    }
+    // Writes can land past EOF, so the size only ever grows here;
+    // shrinking is truncate's job.  Writers to other ranges may have
+    // grown the file meanwhile, so the size is re-read and raised in a
+    // single step under the metadata lock, never written back stale.
+    pthread_mutex_lock(&meta_lock);
+    node = get_inode(inodeNum);
+    if (offset + size > node.size) {
+      node.size = offset + size;
+    }
+    node.mtime = time(NULL);
+    set_inode(inodeNum, node);
+    journal_end();
+    pthread_mutex_unlock(&meta_lock);
+    range_unlock(&r);
+    icache_modified(inodeNum);
+    retstat = size;
+    
+    return retstat;
+}
+
+/** Change the size of a file */
+int libsfs_truncate(struct libsfs *fs, const char *path, off_t newsize)
+{
+    int retstat = 0;
+
+    if (newsize > MAX_FILE_BLOCKS*BLOCK_SIZE) {
+      return -EFBIG;
+    }
+    pthread_mutex_lock(&meta_lock);
+    int inodeNum = findInode(path);
+    pthread_mutex_unlock(&meta_lock);
+    if (inodeNum == -1) {
+      return walk_error;
+    }
+    // everything from the new last block on changes, so wait for
+    // reads and writes there to finish and keep new ones out
+    struct range r;
+    range_lock(&r, inodeNum, newsize / BLOCK_SIZE, MAX_FILE_BLOCKS - 1, 1);
+    pthread_mutex_lock(&meta_lock);
+    if (findInode(path) != inodeNum) {
+      pthread_mutex_unlock(&meta_lock);
+      range_unlock(&r);
+      return -ENOENT;
+    }
+    journal_begin();
+    inode node = get_inode(inodeNum);
+    // free every block wholly past the new end of file
+    free_blocks_from(&node, (newsize + BLOCK_SIZE - 1)/BLOCK_SIZE);
+    prealloc_forget(inodeNum);
+    stats_count(STATS_DELALLOC_DROPPED, drop_held(inodeNum, (newsize + BLOCK_SIZE - 1)/BLOCK_SIZE, MAX_FILE_BLOCKS));
+    // zero the tail of the last block so growing the file again
+    // reads zeroes rather than the old contents
+    int64_t lastBlock;
+    char * lastHeld = NULL;
+    if (newsize % BLOCK_SIZE != 0) {
+      map_range(&node, inodeNum, newsize / BLOCK_SIZE, 1, &lastBlock, NULL, 0);
+      lastHeld = delalloc_find(inodeNum, newsize / BLOCK_SIZE);
+    }
+    if (lastHeld != NULL) {
+      memset(lastHeld + newsize % BLOCK_SIZE, 0, BLOCK_SIZE - newsize % BLOCK_SIZE);
+    }
+    if (newsize % BLOCK_SIZE != 0 && lastBlock != 0) {
+      char buffer[BLOCK_SIZE];
+      block_read(info.dataregion_blocks_start + lastBlock, buffer);
+      memset(buffer + newsize % BLOCK_SIZE, 0, BLOCK_SIZE - newsize % BLOCK_SIZE);
+      block_write(info.dataregion_blocks_start + lastBlock, buffer);
+    }
+    node.size = newsize;
+    node.mtime = time(NULL);
+    set_inode(inodeNum, node);
+    journal_end();
+    pthread_mutex_unlock(&meta_lock);
+    range_unlock(&r);
+    icache_modified(inodeNum);
+
+    return retstat;
+}
+
+/** Set the modification time of a file */
+int libsfs_utimens(struct libsfs *fs, const char *path, time_t mtime)
+{
+    pthread_mutex_lock(&meta_lock);
+    journal_begin();
+    int inodeNum = findInode(path);
+    if (inodeNum != -1) {
+      inode node = get_inode(inodeNum);
+      node.mtime = mtime;
+      set_inode(inodeNum, node);
+    }
+    journal_end();
+    pthread_mutex_unlock(&meta_lock);
+    if (inodeNum == -1) {
+      return walk_error;
+    }
+
+    return 0;
+}
+
+/** Make a file or directory durable
+ *
+ * Writes out data of the file held by delayed allocation, then waits
+ * for the commit holding the last change to its inode, which holds
+ * its allocations, its size and, for a new file, its entry in the
+ * directory too, and for a sync of the file data written before that.
+ * Calls that come in together share the commit and the sync.
+ * The size lives in the inode with the times, so @datasync can't skip
+ * anything.
+ */
+int libsfs_fsync(struct libsfs *fs, const char *path, int datasync)
+{
+    pthread_mutex_lock(&meta_lock);
+    int inodeNum = findInode(path);
+    pthread_mutex_unlock(&meta_lock);
+    if (inodeNum == -1) {
+      return walk_error;
+    }
+    int err = flush_held(inodeNum);
+    if (err != 0) {
+      return err;
+    }
+
+    return journal_sync_block(info.inode_blocks_start + inodeNum / INODES_PER_BLOCK);
+}
+
+/** List a directory
+ *
+ * @filler is called for ".", ".." and then each entry, until it
+ * returns nonzero.
+ */
+int libsfs_readdir(struct libsfs *fs, const char *path, libsfs_filler filler, void *ctx)
+{
+    pthread_mutex_lock(&meta_lock);
+    int pathInodeNum = findInode(path);
+    inode pathInode;
+    if (pathInodeNum == -1) {
+      pthread_mutex_unlock(&meta_lock);
+      return walk_error;
+    }
+    pathInode = get_inode(pathInodeNum);
+    if (!(pathInode.flags & SFS_DIR)) {
+      pthread_mutex_unlock(&meta_lock);
+      return -ENOTDIR;
+    }
+    int i;
+    filepath_block fblock;
+    if (filler(ctx, ".") == 0 && filler(ctx, "..") == 0) {
+      for (i = 0; i < 12; i++) {
+        if (pathInode.direct_ptrs[i] == 0) {
+          continue;
+        }
+        journal_read(info.dataregion_blocks_start + pathInode.direct_ptrs[i], &fblock);
+        if (filler(ctx, fblock.filepath) != 0) {
+          break;
+        }
+      }
+    }
+    pthread_mutex_unlock(&meta_lock);
+
+    return 0;
+}
+
+/** Report the size of the filesystem and how much of it is free */
+int libsfs_statfs(struct libsfs *fs, struct libsfs_statfs *st)
+{
+    pthread_mutex_lock(&meta_lock);
+    st->block_size = BLOCK_SIZE;
+    st->image_size = info.disksize;
+    st->data_blocks = info.dataregion_blocks;
+    st->free_data_blocks = free_datablocks > reserved_datablocks ? free_datablocks - reserved_datablocks : 0;
+    st->inodes = info.total_inodes;
+    st->free_inodes = free_inodes;
+    pthread_mutex_unlock(&meta_lock);
+    icache_occupancy(&st->icache_used, &st->icache_size);
+
+    return 0;
+}
+
+/** Which inode the calling thread's last path lookup found
+ *
+ * Covers every lookup since the previous call; -1 if none found one.
+ * For tracing: a call made right after an operation names the inode
+ * that operation was about.
+ */
+int libsfs_last_inode()
+{
+    int inodeNum = req_inode;
+    req_inode = -1;
+    return inodeNum;
+}
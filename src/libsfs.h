@@ -0,0 +1,79 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  libsfs: the filesystem itself, with no FUSE in it.  sfs.c is a thin
+  FUSE adapter on top of this; benchmarks and tools link it directly
+  and drive an image in-process.
+
+  Every call takes the handle libsfs_open returned and paths as FUSE
+  would pass them ("/name").  Errors come back as -errno.  Calls may be
+  made from any number of threads at once.
+*/
+
+#ifndef _LIBSFS_H_
+#define _LIBSFS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+struct libsfs;
+
+#define LIBSFS_FORMAT 0x0001	// lay out an empty filesystem, losing what was there
+
+// Parameters of a new filesystem; zero for the defaults
+struct libsfs_format {
+    off_t size;			// bytes to make the image, 0 to keep its size
+    int data_percent;		// share of the image for file data
+    off_t max_size;		// most libsfs_grow can take it to, 0 for SFS_GROW_FACTOR times its size
+    off_t journal_size;		// bytes for the metadata journal, -1 for none
+};
+
+struct libsfs_attr {
+    int ino;
+    int is_dir;
+    off_t size;
+    time_t mtime;
+};
+
+struct libsfs_statfs {
+    int block_size;
+    off_t image_size;		// bytes, as libsfs_grow last left it
+    int64_t data_blocks;
+    int64_t free_data_blocks;
+    int64_t inodes;
+    int64_t free_inodes;
+    int icache_used;		// in-core inode entries in use
+    int icache_size;
+};
+
+// Called for each directory entry; return nonzero to stop early
+typedef int (*libsfs_filler)(void *ctx, const char *name);
+
+int libsfs_format(const char *image, const struct libsfs_format *params);
+int libsfs_open(const char *image, int flags, struct libsfs **fs);
+int libsfs_start(struct libsfs *fs);
+void libsfs_close(struct libsfs *fs);
+void libsfs_begin(struct libsfs *fs);
+void libsfs_end(struct libsfs *fs);
+int libsfs_grow(struct libsfs *fs, off_t size);
+
+int libsfs_getattr(struct libsfs *fs, const char *path, struct libsfs_attr *attr);
+int libsfs_create(struct libsfs *fs, const char *path);
+int libsfs_unlink(struct libsfs *fs, const char *path);
+int libsfs_open_file(struct libsfs *fs, const char *path, int *keep_cache);
+int libsfs_release(struct libsfs *fs, const char *path);
+int libsfs_read(struct libsfs *fs, const char *path, char *buf, size_t size, off_t offset);
+int libsfs_write(struct libsfs *fs, const char *path, const char *buf, size_t size, off_t offset);
+int libsfs_truncate(struct libsfs *fs, const char *path, off_t size);
+int libsfs_utimens(struct libsfs *fs, const char *path, time_t mtime);
+int libsfs_fsync(struct libsfs *fs, const char *path, int datasync);
+int libsfs_readdir(struct libsfs *fs, const char *path, libsfs_filler filler, void *ctx);
+int libsfs_statfs(struct libsfs *fs, struct libsfs_statfs *st);
+int libsfs_last_inode(void);
+
+#endif
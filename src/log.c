@@ -12,21 +12,353 @@
 
 #include "params.h"
 
-#include <fuse.h>
+#include <ctype.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <utime.h>
 
 #include "log.h"
 
+/*
+  Logging goes through a ring buffer per thread.  log_msg only copies
+  the format pointer and the raw arguments into the next free slot of
+  the calling thread's ring -- no formatting, no locks, no I/O.  A
+  background thread drains the rings, formats each record and writes
+  it to sfs.log.  When a ring is full the message is dropped and
+  counted rather than making the caller wait, so logging never uses
+  more than LOG_RING_SLOTS records per thread.
+*/
+
+#define LOG_RING_SLOTS 256		// records per thread, a power of 2
+#define LOG_MAX_ARGS 8
+#define LOG_RECORD_SIZE 512
+
+union log_arg {
+    long long i;
+    double d;
+    const void *p;
+};
+
+struct log_record {
+    unsigned long seq;		// global order the messages were logged in
+    const char *format;
+    int nargs;
+    union log_arg args[LOG_MAX_ARGS];
+    char strings[LOG_RECORD_SIZE - sizeof(unsigned long) - sizeof(const char *)
+		 - sizeof(int) - LOG_MAX_ARGS * sizeof(union log_arg)];
+};
+
+struct log_ring {
+    struct log_record slots[LOG_RING_SLOTS];
+    unsigned long head;		// next slot to fill, owned by the thread
+    unsigned long tail;		// next slot to drain, owned by the writer
+    unsigned long dropped;	// messages lost to a full ring
+    unsigned long reported;	// drops already written to the log
+    int dead;			// owning thread has exited
+    struct log_ring *next;
+};
+
+// runtime threshold, set from -o log_level= at mount time
+int log_level = LOG_INFO;
+// how long the writer sleeps when there is nothing to write
+int log_flush_ms = 10;
+
+static const char *log_level_names[] = {
+    "error", "warn", "info", "debug", "trace"
+};
+
+static FILE *logfile = NULL;
+static unsigned long log_seq = 0;
+static struct log_ring *rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t writer;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static int writer_running = 0;
+static unsigned long flush_requested = 0;
+static unsigned long flush_done = 0;
+
+static void ring_release(void *data)
+{
+    struct log_ring *ring = data;
+    __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void ring_key_init(void)
+{
+    pthread_key_create(&ring_key, ring_release);
+}
+
+static struct log_ring *my_ring(void)
+{
+    struct log_ring *ring;
+
+    pthread_once(&ring_key_once, ring_key_init);
+    ring = pthread_getspecific(ring_key);
+    if (ring != NULL)
+	return ring;
+
+    ring = calloc(1, sizeof(struct log_ring));
+    if (ring == NULL)
+	return NULL;
+    pthread_setspecific(ring_key, ring);
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+
+    return ring;
+}
+
+// Steps over one conversion spec starting just past the '%'.  Returns
+// the conversion character and sets *end past it; length modifiers
+// set *longs to 1 (l, z, t) or 2 (ll, j, L).
+static char parse_spec(const char *spec, const char **end, int *longs, int *stars)
+{
+    const char *p = spec;
+
+    *longs = 0;
+    *stars = 0;
+    while (*p && strchr("-+ #0", *p))
+	p++;
+    for (; *p && (isdigit((unsigned char) *p) || *p == '.' || *p == '*'); p++)
+	if (*p == '*')
+	    (*stars)++;
+    for (; *p && strchr("hlqjztL", *p); p++) {
+	if (*p == 'l' || *p == 'z' || *p == 't')
+	    (*longs)++;
+	else if (*p == 'q' || *p == 'j' || *p == 'L')
+	    *longs = 2;
+    }
+    *end = *p ? p + 1 : p;
+
+    return *p;
+}
+
+// Copies the arguments of one message into a record.  Strings are the
+// only arguments that have to be copied by value; they are packed
+// into the record and truncated if they do not fit.
+static void record_args(struct log_record *rec, const char *format, va_list ap)
+{
+    size_t used = 0;
+    const char *p = format;
+    int longs, stars;
+    char conv;
+
+    rec->format = format;
+    rec->nargs = 0;
+    while ((p = strchr(p, '%')) != NULL && rec->nargs < LOG_MAX_ARGS) {
+	conv = parse_spec(p + 1, &p, &longs, &stars);
+	for (; stars > 0 && rec->nargs < LOG_MAX_ARGS; stars--)
+	    rec->args[rec->nargs++].i = va_arg(ap, int);
+	if (rec->nargs == LOG_MAX_ARGS)
+	    break;
+	switch (conv) {
+	case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+	    if (longs >= 2)
+		rec->args[rec->nargs++].i = va_arg(ap, long long);
+	    else if (longs == 1)
+		rec->args[rec->nargs++].i = va_arg(ap, long);
+	    else
+		rec->args[rec->nargs++].i = va_arg(ap, int);
+	    break;
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+	    rec->args[rec->nargs++].d = va_arg(ap, double);
+	    break;
+	case 'p':
+	    rec->args[rec->nargs++].p = va_arg(ap, void *);
+	    break;
+	case 's': {
+	    const char *str = va_arg(ap, const char *);
+	    size_t len = str ? strlen(str) : 6;
+	    if (used + len + 1 > sizeof(rec->strings))
+		len = used + 1 < sizeof(rec->strings) ? sizeof(rec->strings) - used - 1 : 0;
+	    memcpy(rec->strings + used, str ? str : "(null)", len);
+	    rec->strings[used + len] = '\0';
+	    rec->args[rec->nargs++].i = used;
+	    used += len + 1;
+	    if (used > sizeof(rec->strings))
+		used = sizeof(rec->strings);
+	    break;
+	}
+	default:		// "%%" and anything we do not know take no argument
+	    break;
+	}
+    }
+}
+
+// Formats a record on the writer thread, one conversion at a time
+static void record_write(FILE *out, const struct log_record *rec)
+{
+    const char *p = rec->format;
+    const char *pct, *end;
+    char spec[32];
+    int arg = 0;
+    int longs, stars, star[2];
+    char conv;
+
+    while ((pct = strchr(p, '%')) != NULL) {
+	fwrite(p, 1, pct - p, out);
+	conv = parse_spec(pct + 1, &end, &longs, &stars);
+	p = end;
+	if (conv == '%') {
+	    fputc('%', out);
+	    continue;
+	}
+	// a spec too long to copy, or one whose arguments did not fit
+	// in the record, is written out as it stands
+	if (end - pct >= (int) sizeof(spec) || arg + stars + (conv && strchr("diouxXceEfFgGaAps", conv)) > rec->nargs) {
+	    fwrite(pct, 1, end - pct, out);
+	    arg = rec->nargs;
+	    continue;
+	}
+	memcpy(spec, pct, end - pct);
+	spec[end - pct] = '\0';
+	star[0] = stars > 0 ? (int) rec->args[arg++].i : 0;
+	star[1] = stars > 1 ? (int) rec->args[arg++].i : 0;
+	// The star arguments and the value are handed over with the
+	// types the spec asks for
+#define LOG_PRINT(value)						\
+	do {								\
+	    if (stars == 0)						\
+		fprintf(out, spec, value);				\
+	    else if (stars == 1)					\
+		fprintf(out, spec, star[0], value);			\
+	    else							\
+		fprintf(out, spec, star[0], star[1], value);		\
+	} while (0)
+	switch (conv) {
+	case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+	    if (longs >= 2)
+		LOG_PRINT((long long) rec->args[arg].i);
+	    else if (longs == 1)
+		LOG_PRINT((long) rec->args[arg].i);
+	    else
+		LOG_PRINT((int) rec->args[arg].i);
+	    arg++;
+	    break;
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+	    LOG_PRINT(rec->args[arg].d);
+	    arg++;
+	    break;
+	case 'p':
+	    LOG_PRINT(rec->args[arg].p);
+	    arg++;
+	    break;
+	case 's':
+	    LOG_PRINT(rec->strings + rec->args[arg].i);
+	    arg++;
+	    break;
+	default:
+	    break;
+	}
+#undef LOG_PRINT
+    }
+    fputs(p, out);
+}
+
+// Writes out everything queued so far, merging the rings back into
+// the order the messages were logged in.  Returns how many records
+// that was.
+static int drain(void)
+{
+    struct log_ring *ring, *oldest, **link;
+    unsigned long dropped;
+    int count = 0;
+
+    pthread_mutex_lock(&rings_lock);
+    for (;;) {
+	oldest = NULL;
+	for (ring = rings; ring != NULL; ring = ring->next) {
+	    if (ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+		continue;
+	    if (oldest == NULL
+		|| ring->slots[ring->tail % LOG_RING_SLOTS].seq
+		   < oldest->slots[oldest->tail % LOG_RING_SLOTS].seq)
+		oldest = ring;
+	}
+	if (oldest == NULL)
+	    break;
+	record_write(logfile, &oldest->slots[oldest->tail % LOG_RING_SLOTS]);
+	__atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+	count++;
+    }
+
+    link = &rings;
+    while ((ring = *link) != NULL) {
+	int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+	dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if (dropped != ring->reported) {
+	    fprintf(logfile, "\n[log: %lu messages dropped]\n", dropped - ring->reported);
+	    ring->reported = dropped;
+	    count++;
+	}
+	// a dead thread logs nothing more, so once its ring is empty
+	// it can go
+	if (dead && ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+	    *link = ring->next;
+	    free(ring);
+	} else {
+	    link = &ring->next;
+	}
+    }
+    pthread_mutex_unlock(&rings_lock);
+    if (count > 0)
+	fflush(logfile);
+
+    return count;
+}
+
+static void *writer_main(void *data)
+{
+    struct timespec wake;
+    unsigned long flush_seen;
+    int running = 1;
+
+    while (running) {
+	pthread_mutex_lock(&writer_lock);
+	flush_seen = flush_requested;
+	running = writer_running;
+	pthread_mutex_unlock(&writer_lock);
+
+	if (drain() > 0)
+	    continue;
+
+	pthread_mutex_lock(&writer_lock);
+	flush_done = flush_seen;
+	pthread_cond_broadcast(&writer_cond);
+	if (writer_running && flush_requested == flush_seen) {
+	    int ms = __atomic_load_n(&log_flush_ms, __ATOMIC_RELAXED);
+	    clock_gettime(CLOCK_REALTIME, &wake);
+	    wake.tv_sec += ms / 1000;
+	    wake.tv_nsec += (ms % 1000) * 1000000L;
+	    if (wake.tv_nsec >= 1000000000) {
+		wake.tv_sec++;
+		wake.tv_nsec -= 1000000000;
+	    }
+	    pthread_cond_timedwait(&writer_cond, &writer_lock, &wake);
+	}
+	pthread_mutex_unlock(&writer_lock);
+    }
+
+    return NULL;
+}
+
 FILE *log_open()
 {
-    FILE *logfile;
-    
     // very first thing, open up the logfile and mark that we got in
     // here.  If we can't open the logfile, we're dead.
     logfile = fopen("sfs.log", "w");
@@ -35,140 +367,122 @@ FILE *log_open()
 	exit(EXIT_FAILURE);
     }
     
-    // set logfile to line buffering
-    setvbuf(logfile, NULL, _IOLBF, 0);
+    // the writer flushes after every batch, so full buffering is fine
+    setvbuf(logfile, NULL, _IOFBF, 0);
 
     return logfile;
 }
 
-void log_msg(const char *format, ...)
+/** Start the thread that writes the log
+ *
+ * Called from sfs_init rather than log_open: fuse_main forks into the
+ * background in between, and threads do not survive a fork.  Messages
+ * logged before this wait in their rings.
+ */
+void log_start()
 {
-    va_list ap;
-    va_start(ap, format);
+    pthread_mutex_lock(&writer_lock);
+    if (writer_running) {
+	pthread_mutex_unlock(&writer_lock);
+	return;
+    }
+    writer_running = 1;
+    pthread_mutex_unlock(&writer_lock);
 
-    vfprintf(SFS_DATA->logfile, format, ap);
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+	perror("log_start");
+	writer_running = 0;
+    }
 }
 
-// fuse context
-void log_fuse_context(struct fuse_context *context)
+/** Wait until everything logged so far is in the log file */
+void log_flush()
 {
-    log_msg("    context:\n");
-    
-    /** Pointer to the fuse object */
-    //	struct fuse *fuse;
-    log_struct(context, fuse, %08x, );
-
-    /** User ID of the calling process */
-    //	uid_t uid;
-    log_struct(context, uid, %d, );
-
-    /** Group ID of the calling process */
-    //	gid_t gid;
-    log_struct(context, gid, %d, );
-
-    /** Thread ID of the calling process */
-    //	pid_t pid;
-    log_struct(context, pid, %d, );
-
-    /** Private filesystem data */
-    //	void *private_data;
-    log_struct(context, private_data, %08x, );
-    log_struct(((struct sfs_state *)context->private_data), logfile, %08x, );
-    log_struct(((struct sfs_state *)context->private_data), diskfile, %s, );
-	
-    /** Umask of the calling process (introduced in version 2.8) */
-    //	mode_t umask;
-    log_struct(context, umask, %05o, );
+    unsigned long seq;
+
+    pthread_mutex_lock(&writer_lock);
+    if (!writer_running) {
+	pthread_mutex_unlock(&writer_lock);
+	drain();
+	return;
+    }
+    seq = ++flush_requested;
+    pthread_cond_broadcast(&writer_cond);
+    while (flush_done < seq && writer_running)
+	pthread_cond_wait(&writer_cond, &writer_lock);
+    pthread_mutex_unlock(&writer_lock);
 }
 
-// struct fuse_conn_info contains information about the socket
-// connection being used.  I don't actually use any of this
-// information in sfs
-void log_conn(struct fuse_conn_info *conn)
+/** Flush the log and stop the writer thread */
+void log_close()
 {
-    log_msg("    conn:\n");
-    
-    /** Major version of the protocol (read-only) */
-    // unsigned proto_major;
-    log_struct(conn, proto_major, %d, );
+    pthread_mutex_lock(&writer_lock);
+    if (writer_running) {
+	writer_running = 0;
+	pthread_cond_broadcast(&writer_cond);
+	pthread_mutex_unlock(&writer_lock);
+	pthread_join(writer, NULL);
+    } else {
+	pthread_mutex_unlock(&writer_lock);
+    }
+    drain();
+}
 
-    /** Minor version of the protocol (read-only) */
-    // unsigned proto_minor;
-    log_struct(conn, proto_minor, %d, );
+/* Map a level name ("error" ... "trace") or number to its level
+ * INPUT: the name given to -o log_level=
+ * OUTPUT: the level, or -1 if the name isn't one
+ */
+int log_level_parse(const char *name)
+{
+    char *end;
+    long n;
+    int i;
 
-    /** Is asynchronous read supported (read-write) */
-    // unsigned async_read;
-    log_struct(conn, async_read, %d, );
+    for (i = 0; i <= LOG_TRACE; i++)
+	if (strcasecmp(name, log_level_names[i]) == 0)
+	    return i;
 
-    /** Maximum size of the write buffer */
-    // unsigned max_write;
-    log_struct(conn, max_write, %d, );
-    
-    /** Maximum readahead */
-    // unsigned max_readahead;
-    log_struct(conn, max_readahead, %d, );
-    
-    /** Capability flags, that the kernel supports */
-    // unsigned capable;
-    log_struct(conn, capable, %08x, );
-    
-    /** Capability flags, that the filesystem wants to enable */
-    // unsigned want;
-    log_struct(conn, want, %08x, );
-    
-    /** For future use. */
-    // unsigned reserved[23];
+    n = strtol(name, &end, 10);
+    if (*name == '\0' || *end != '\0' || n < LOG_ERROR || n > LOG_TRACE)
+	return -1;
+    return n;
 }
-    
-// struct fuse_file_info keeps information about files (surprise!).
-// This dumps all the information in a struct fuse_file_info.  The struct
-// definition, and comments, come from /usr/include/fuse/fuse_common.h
-// Duplicated here for convenience.
-void log_fi (struct fuse_file_info *fi)
+
+/** Log a message
+ *
+ * @format must be a string literal (or otherwise outlive the message):
+ * only the pointer is kept until the writer thread gets to it.
+ */
+void log_msg(const char *format, ...)
 {
-    log_msg("    fi:\n");
-    
-    /** Open flags.  Available in open() and release() */
-    //	int flags;
-	log_struct(fi, flags, 0x%08x, );
-	
-    /** Old file handle, don't use */
-    //	unsigned long fh_old;	
-	log_struct(fi, fh_old, 0x%08lx,  );
-
-    /** In case of a write operation indicates if this was caused by a
-        writepage */
-    //	int writepage;
-	log_struct(fi, writepage, %d, );
-
-    /** Can be filled in by open, to use direct I/O on this file.
-        Introduced in version 2.4 */
-    //	unsigned int keep_cache : 1;
-	log_struct(fi, direct_io, %d, );
-
-    /** Can be filled in by open, to indicate, that cached file data
-        need not be invalidated.  Introduced in version 2.4 */
-    //	unsigned int flush : 1;
-	log_struct(fi, keep_cache, %d, );
-
-    /** Padding.  Do not use*/
-    //	unsigned int padding : 29;
-
-    /** File handle.  May be filled in by filesystem in open().
-        Available in all other file operations */
-    //	uint64_t fh;
-	log_struct(fi, fh, 0x%016llx,  );
-	
-    /** Lock owner id.  Available in locking operations and flush */
-    //  uint64_t lock_owner;
-	log_struct(fi, lock_owner, 0x%016llx, );
-};
+    struct log_ring *ring;
+    unsigned long head;
+    va_list ap;
+
+    // programs linking libsfs without calling log_open get no log
+    if (logfile == NULL)
+	return;
+    ring = my_ring();
+    if (ring == NULL)
+	return;
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+	__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+	return;
+    }
+
+    ring->slots[head % LOG_RING_SLOTS].seq = __atomic_fetch_add(&log_seq, 1, __ATOMIC_RELAXED);
+    va_start(ap, format);
+    record_args(&ring->slots[head % LOG_RING_SLOTS], format, ap);
+    va_end(ap);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
 
 // This dumps the info from a struct stat.  The struct is defined in
 // <bits/stat.h>; this is indirectly included from <fcntl.h>
 void log_stat(struct stat *si)
 {
-    log_msg("    si:\n");
+    log_debug("    si:\n");
     
     //  dev_t     st_dev;     /* ID of device containing file */
 	log_struct(si, st_dev, %lld, );
@@ -213,7 +527,7 @@ void log_stat(struct stat *si)
 
 void log_statvfs(struct statvfs *sv)
 {
-    log_msg("    sv:\n");
+    log_debug("    sv:\n");
     
     //  unsigned long  f_bsize;    /* file system block size */
 	log_struct(sv, f_bsize, %ld, );
@@ -252,7 +566,7 @@ void log_statvfs(struct statvfs *sv)
 
 void log_utime(struct utimbuf *buf)
 {
-    log_msg("    buf:\n");
+    log_debug("    buf:\n");
     
     //    time_t actime;
     log_struct(buf, actime, 0x%08lx, );
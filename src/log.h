@@ -9,16 +9,61 @@
 #define _LOG_H_
 #include <stdio.h>
 
+// Log levels, most to least severe.  A message is kept if its level is
+// at or below both SFS_LOG_LEVEL (fixed when the code is compiled, see
+// configure --with-log-level) and log_level (picked at mount time with
+// -o log_level=).  Messages above SFS_LOG_LEVEL are compiled out; the
+// arguments of messages above log_level are never evaluated.
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#define LOG_TRACE 4
+
+#ifndef SFS_LOG_LEVEL
+#define SFS_LOG_LEVEL LOG_TRACE
+#endif
+
+extern int log_level;
+extern int log_flush_ms;
+
+#define log_enabled(level) \
+  ((level) <= SFS_LOG_LEVEL && (level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+
+#define log_at(level, ...) \
+  do { if (log_enabled(level)) log_msg(__VA_ARGS__); } while (0)
+
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
+
 //  macro to log fields in structs.
 #define log_struct(st, field, format, typecast) \
-  log_msg("    " #field " = " #format "\n", typecast st->field)
+  log_debug("    " #field " = " #format "\n", typecast st->field)
+
+// only pointers to these are passed around here
+struct fuse_conn_info;
+struct fuse_context;
+struct fuse_file_info;
+struct stat;
+struct statvfs;
+struct utimbuf;
 
 FILE *log_open(void);
+void log_start(void);
+void log_flush(void);
+void log_close(void);
+// logfuse.c, in the FUSE frontend only
 void log_conn (struct fuse_conn_info *conn);
+void log_fuse_context(struct fuse_context *context);
 void log_fi (struct fuse_file_info *fi);
+
 void log_stat(struct stat *si);
 void log_statvfs(struct statvfs *sv);
 void log_utime(struct utimbuf *buf);
 
+int log_level_parse(const char *name);
 void log_msg(const char *format, ...);
 #endif
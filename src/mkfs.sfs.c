@@ -0,0 +1,127 @@
+/*
+  Formats a disk image for sfs.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  usage:  mkfs.sfs [-q] [-s size] [-d data_percent] [-g max_size] [-J journal_size] image
+
+  Lays out an empty filesystem on the image, creating it if needed.
+  -s makes the image that big first (a number of bytes, or with a K,
+  M or G suffix); otherwise the image keeps its size.  -d sets the
+  share of the image given to file data, the rest holding the bitmaps
+  and the inode table.  -g sets the most the image can later be grown
+  to while mounted (setfattr -n user.sfs.size), SFS_GROW_FACTOR times
+  its size by default; the data bitmap is sized for that.  -J sets the
+  size of the metadata journal (journal.c), 0 for none; by default it
+  is a 64th of the image, from SFS_JOURNAL_MIN to SFS_JOURNAL_MAX
+  blocks.  sfs mounts what this leaves as it is.
+
+  The image is kept sparse: growing it leaves a hole, and the old
+  contents of one being reformatted are punched out rather than
+  overwritten, so it takes host space only for what is written to it
+  later.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libsfs.h"
+
+static void usage()
+{
+    fprintf(stderr, "usage:  mkfs.sfs [-q] [-s size[K|M|G]] [-d data_percent] [-g max_size[K|M|G]] [-J journal_size[K|M|G]] image\n");
+    exit(EXIT_FAILURE);
+}
+
+/* A size with an optional K, M or G suffix, -1 if it isn't one */
+static off_t parse_size(const char *arg)
+{
+    char *end;
+    long long n = strtoll(arg, &end, 10);
+
+    if (end == arg || n < 0)
+	return -1;
+    switch (*end) {
+    case 'G': case 'g':
+	n *= 1024;
+	// fall through
+    case 'M': case 'm':
+	n *= 1024;
+	// fall through
+    case 'K': case 'k':
+	n *= 1024;
+	end++;
+    }
+    return *end == '\0' ? n : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct libsfs_format params;
+    struct libsfs_statfs st;
+    struct stat sb;
+    struct libsfs *fs;
+    int quiet = 0;
+    int c, err;
+
+    memset(&params, 0, sizeof(params));
+    while ((c = getopt(argc, argv, "qs:d:g:J:")) != -1) {
+	switch (c) {
+	case 'q':
+	    quiet = 1;
+	    break;
+	case 's':
+	    params.size = parse_size(optarg);
+	    if (params.size <= 0)
+		usage();
+	    break;
+	case 'd':
+	    params.data_percent = atoi(optarg);
+	    if (params.data_percent <= 0 || params.data_percent >= 100)
+		usage();
+	    break;
+	case 'g':
+	    params.max_size = parse_size(optarg);
+	    if (params.max_size <= 0)
+		usage();
+	    break;
+	case 'J':
+	    params.journal_size = parse_size(optarg);
+	    if (params.journal_size < 0
+		|| (params.journal_size > 0 && params.journal_size < 2 * BLOCK_SIZE))
+		usage();
+	    if (params.journal_size == 0)
+		params.journal_size = -1;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind != argc - 1)
+	usage();
+
+    err = libsfs_format(argv[optind], &params);
+    if (err == 0)
+	err = libsfs_open(argv[optind], 0, &fs);
+    if (err != 0) {
+	fprintf(stderr, "%s: %s\n", argv[optind],
+		err == -EINVAL ? "too small for a filesystem" : strerror(-err));
+	return EXIT_FAILURE;
+    }
+    libsfs_statfs(fs, &st);
+    libsfs_close(fs);
+
+    if (!quiet && stat(argv[optind], &sb) == 0)
+	printf("%s: %d byte blocks, %lld data blocks, %lld inodes, %lld KB used of %lld KB\n",
+	       argv[optind], st.block_size, (long long) st.data_blocks, (long long) st.inodes,
+	       (long long) sb.st_blocks / 2, (long long) sb.st_size / 1024);
+
+    return 0;
+}
@@ -20,6 +20,10 @@
 // setlinebuf() later in consequence.
 #define _XOPEN_SOURCE 500
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 // maintain bbfs state in here
 #include <math.h>
 #include <limits.h>
@@ -31,36 +35,71 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <stdint.h>
 #include <time.h>
-#include <fuse.h>
 
 
 #define BLOCK_SIZE 512
 #define BITS_PER_BLOCK 4096
 #define BITS_PER_BYTE 8
-#define INODES_PER_BLOCK 8
+#define INODES_PER_BLOCK 4	//128-byte inodes
 #define ZERO_INDEX_BITS 7
-#define VALUE 513
 #ifdef NAME_MAX
 #undef NAME_MAX
 #endif
 #define NAME_MAX 252
 
+#define SFS_DIR 0x0001	//inode flags: the inode is a directory
+
+// mkfs.sfs leaves the inode table as it finds it; the table is split
+// into this many groups, each zeroed from its start as inodes in it
+// are first used or by a background thread (libsfs.c)
+#define SFS_INODE_GROUPS 16
+
+// mkfs.sfs gives no more of the image than this to inodes; the
+// in-core inode table (icache.c) has an entry for every one
+#define SFS_MAX_INODES (1 << 22)
+
+#define PTRS_PER_BLOCK ((int) (BLOCK_SIZE / sizeof(int64_t)))	//pointers held by an indirect block
+
+// Past the direct pointers and the indirect block, a file's blocks are
+// mapped by a tree of pointer blocks, one more level added on top each
+// time the file outgrows it, up to SFS_MAX_HEIGHT levels: 64^6 blocks,
+// 32 TiB.  A small file needs no more levels than it uses.  (With
+// mkdir not implemented every file is in the root, whose 12 direct
+// pointers are its entries, so an image holds 12 files at most.)
+#define SFS_TREE_FIRST (12 + PTRS_PER_BLOCK)	//the first file block the tree maps
+#define SFS_MAX_HEIGHT 6
+#define MAX_FILE_BLOCKS ((int64_t) SFS_TREE_FIRST + (int64_t) PTRS_PER_BLOCK * PTRS_PER_BLOCK * PTRS_PER_BLOCK \
+			 * PTRS_PER_BLOCK * PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+
+// Largest single read/write we ask FUSE for, and what we get: libfuse
+// 2.9 caps max_write at 32 pages (its FUSE_MAX_MAX_PAGES), 128 KiB,
+// and the kernel reads ahead no further than that for a FUSE mount
+#define SFS_MAX_WRITE (128 * 1024)
+
+// How long (seconds) the kernel may cache entries and attributes.
+// sfs is the only writer of its disk image, so this can be long.
+#define SFS_CACHE_TIMEOUT 3600
+
+// Block numbers are 64 bits throughout; the ones in inodes and
+// indirect blocks count from the start of the data region, 0 for none
 typedef struct{
 
-	int size;
-	int direct_ptrs[12];
-	int indirect_ptr;
-	int test;
+	int64_t size;
+	int64_t direct_ptrs[12];
+	int64_t indirect_ptr;
+	int64_t tree_ptr;	//the top pointer block of the tree, tree_height levels above the data
+	uint32_t mtime;	//last modification time, seconds since the epoch
 	short flags;
-	
+	short tree_height;	//0 with no tree
 
 }inode;
 
 
 typedef struct{
 
-	inode list[8];
+	inode list[INODES_PER_BLOCK];
 	
 
 }inode_block;
@@ -68,25 +107,41 @@ typedef struct{
 
 typedef struct{
 	
-	int dataregion_bitmap_blocks; //How many block needed for dataregion bitmap
-	int dataregion_bitmap_start; // Which block does the dataregion bitmap start
-	int inode_bitmap_blocks;	//How many blocks needed for inode bitmap
-	int inode_bitmap_start;	//which block does the inode bitmap start
-	int inode_blocks;	//How many blocks needed for inodes
-	int inode_blocks_start;	//which block does the inodes start
-	int total_inodes;
-	int dataregion_blocks;	//How many data region blocks are needed
-	int dataregion_blocks_start; //what block does the data region start
-	int disksize;
-	int random[6];
+	int32_t magic;	//SFS_MAGIC once formatted by mkfs.sfs
+	int32_t version;	//SFS_VERSION of the layout
+	int32_t clean;	//unmounted cleanly, so the free counts below can be trusted
+	int32_t unused;
+	int64_t dataregion_bitmap_blocks; //How many block needed for dataregion bitmap
+	int64_t dataregion_bitmap_start; // Which block does the dataregion bitmap start
+	int64_t inode_bitmap_blocks;	//How many blocks needed for inode bitmap
+	int64_t inode_bitmap_start;	//which block does the inode bitmap start
+	int64_t inode_blocks;	//How many blocks needed for inodes
+	int64_t inode_blocks_start;	//which block does the inodes start
+	int64_t total_inodes;
+	int64_t dataregion_blocks;	//How many data region blocks are needed
+	int64_t dataregion_blocks_start; //what block does the data region start
+	int64_t disksize;
+	int64_t free_datablocks;
+	int64_t free_inodes;
+	int64_t inode_table_init[SFS_INODE_GROUPS];	//blocks at the start of each inode group zeroed so far
+	int64_t journal_blocks;	//How many blocks the metadata journal takes, 0 for none
+	int64_t journal_start;	//which block does the journal start (journal.c)
 
 }metadata_info;
 
+#define SFS_MAGIC 0x31534653	//"SFS1" on disk
+#define SFS_VERSION 5	//3: 64-bit sizes and block numbers, 4: metadata journal, 5: pointer tree
+#define SFS_DATA_PERCENT 75	//share of the image mkfs.sfs gives to file data
+#define SFS_GROW_FACTOR 16	//mkfs.sfs leaves data bitmap room for the image to grow this many times over
+#define SFS_JOURNAL_MIN 64	//smallest journal mkfs.sfs makes by default, an image with no room for it gets none
+#define SFS_JOURNAL_MAX 65536	//largest journal it makes by default, 32 MB
+
 
 
 typedef struct{
 	
-	metadata_info list[8];
+	metadata_info list[1];
+	char pad[BLOCK_SIZE - sizeof(metadata_info)];
 
 }super_block;
 
@@ -103,20 +158,43 @@ typedef struct{
 
 }directory_block;
 
-int get_metadata_info(int total_size, metadata_info * info);
+int get_metadata_info(int64_t total_size, int64_t max_size, int data_percent, int64_t journal_blocks, metadata_info * info);
+const char * check_metadata_info(int64_t image_size);
 int check_inode_status(int inode_number);
 int set_inode_status(int inode_number, int status);
-int check_dataregion_status(int datablock_number);
-int set_dataregion_status(int datablock_number, int status);
+int check_dataregion_status(int64_t datablock_number);
+int set_dataregion_status(int64_t datablock_number, int status);
+int set_dataregion_run(int64_t datablock_number, int count, int status);
+int64_t find_free_run(int want, int * got);
 inode get_inode(int inode_number);
 void set_inode(int inode_number, inode node);
+int64_t find_free_datablock();
+int find_free_inode();
+int get_num_dirs(const char * filepath);
+char ** parsePath(const char * filepath);
+int findInode(const char *path);
+int64_t findFilepathBlock(const char *path);
+int findParentInode(const char *path);
+
+// Layout of the open image, read from its superblock by libsfs_open
+extern metadata_info info;
+
 
 
 
+// Hidden read-only files with live statistics (stats.c)
+#define SFS_STATS_PATH "/.sfs_stats"
+#define SFS_STATS_JSON_PATH "/.sfs_stats.json"
 
 struct sfs_state {
     FILE *logfile;
     char *diskfile;
+    int cache_timeout;	// entry/attr/negative timeout handed to the kernel
+    int keep_cache;	// let the kernel keep pages of unmodified files
+    int workers;	// size of the worker pool, 0 to let FUSE run requests itself
+    char *log_level;	// name of the level to log at, from -o log_level=
+    int trace;		// write the binary trace (trace.c)
+    int trace_records;	// size of the trace ring
 };
 #define SFS_DATA ((struct sfs_state *) fuse_get_context()->private_data)
 
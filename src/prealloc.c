@@ -0,0 +1,190 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Speculative preallocation.  A file that keeps allocating the blocks
+  right after the ones it allocated last, as a log being appended to
+  does, gets a window of free data blocks set aside right after them,
+  and its next blocks come from there, so however the appends are
+  spread out in time, and whatever else is written meanwhile, the file
+  stays in one piece.  Each time a file uses up its window the next
+  one is twice as big, up to prealloc_kb.
+
+  A window lives only here, in memory: its blocks stay free in the
+  bitmap, find_free_run just passes them over, so a crash or an
+  unmount leaves nothing to clean up.  A window is given back
+  (trimmed) when the file is released, truncated or removed, and all
+  of them are when the data region has nothing else left.  What is
+  known of how the file allocates outlives the window, so a log that is
+  opened, appended to and closed over and over gets a new one at once.
+
+  At most PREALLOC_FILES files are followed; past that the one looked
+  at least recently is forgotten.  Nothing here has a lock of its own:
+  libsfs calls in with meta_lock held.
+*/
+
+#include "params.h"
+
+#include "prealloc.h"
+#include "stats.h"
+
+#define PREALLOC_FILES 64
+
+int prealloc_kb = 1024;
+
+static struct prealloc files[PREALLOC_FILES];
+static int files_init = 0;
+static unsigned long clock_hand = 0;
+
+static void init(void)
+{
+    int i;
+
+    if (files_init)
+	return;
+    for (i = 0; i < PREALLOC_FILES; i++)
+	files[i].inode_number = -1;
+    files_init = 1;
+}
+
+static void trim(struct prealloc *p)
+{
+    stats_count(STATS_PREALLOC_TRIMMED, p->count);
+    p->count = 0;
+}
+
+/** What is known of how a file allocates
+ *
+ * A file not followed yet starts being followed, with nothing known
+ * and no window, in place of the one looked at least recently.
+ */
+struct prealloc *prealloc_get(int inode_number)
+{
+    struct prealloc *p, *oldest = NULL;
+    int i;
+
+    init();
+    for (i = 0; i < PREALLOC_FILES; i++) {
+	p = &files[i];
+	if (p->inode_number == inode_number) {
+	    p->used = ++clock_hand;
+	    return p;
+	}
+	if (oldest == NULL || p->inode_number == -1
+	    || (oldest->inode_number != -1 && p->used < oldest->used))
+	    oldest = p;
+    }
+    trim(oldest);
+    oldest->inode_number = inode_number;
+    oldest->next = -1;
+    oldest->start = 0;
+    oldest->size = 0;
+    oldest->released = 0;
+    oldest->used = ++clock_hand;
+    return oldest;
+}
+
+/** How many of the data blocks from @block on are in no window
+ *
+ * Up to @want.  If @block is in a window, returns minus the number of
+ * blocks from it to the end of the window instead.
+ */
+int64_t prealloc_clear(int64_t block, int64_t want)
+{
+    struct prealloc *p;
+    int i;
+
+    init();
+    for (i = 0; i < PREALLOC_FILES; i++) {
+	p = &files[i];
+	if (p->inode_number == -1 || p->count == 0)
+	    continue;
+	if (block >= p->start && block < p->start + p->count)
+	    return -(p->start + p->count - block);
+	if (p->start > block && p->start - block < want)
+	    want = p->start - block;
+    }
+    return want;
+}
+
+/** Record a write to a file, which may get windows again */
+void prealloc_written(int inode_number)
+{
+    int i;
+
+    init();
+    for (i = 0; i < PREALLOC_FILES; i++) {
+	if (files[i].inode_number == inode_number)
+	    files[i].released = 0;
+    }
+}
+
+/** Give back the window of a file that was released
+ *
+ * Its blocks written out after this get no new window until it is
+ * written again.  Returns how many blocks the window had.
+ */
+int64_t prealloc_trim(int inode_number)
+{
+    int64_t count;
+    int i;
+
+    init();
+    for (i = 0; i < PREALLOC_FILES; i++) {
+	if (files[i].inode_number == inode_number) {
+	    count = files[i].count;
+	    trim(&files[i]);
+	    files[i].released = 1;
+	    return count;
+	}
+    }
+    return 0;
+}
+
+/** Give back every window
+ *
+ * Returns how many blocks they had.
+ */
+int64_t prealloc_trim_all(void)
+{
+    int64_t count = 0;
+    int i;
+
+    init();
+    for (i = 0; i < PREALLOC_FILES; i++) {
+	count += files[i].count;
+	trim(&files[i]);
+    }
+    return count;
+}
+
+/** Give back the window of a file and forget it
+ *
+ * For a file whose blocks are freed, or whose inode is.
+ */
+void prealloc_forget(int inode_number)
+{
+    int i;
+
+    init();
+    for (i = 0; i < PREALLOC_FILES; i++) {
+	if (files[i].inode_number == inode_number) {
+	    trim(&files[i]);
+	    files[i].inode_number = -1;
+	}
+    }
+}
+
+/** Give back every window and forget every file */
+void prealloc_reset(void)
+{
+    int i;
+
+    init();
+    for (i = 0; i < PREALLOC_FILES; i++) {
+	trim(&files[i]);
+	files[i].inode_number = -1;
+    }
+}
@@ -0,0 +1,38 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _PREALLOC_H_
+#define _PREALLOC_H_
+
+#include <stdint.h>
+
+extern int prealloc_kb;
+
+#define PREALLOC_MIN 16		// blocks in the first window of a file
+#define PREALLOC_SHARE 16	// a window takes at most this fraction of the free blocks
+
+// What is known of how a file allocates, and the window of free data
+// blocks set aside for it if it is being appended to
+struct prealloc {
+    int inode_number;		// -1 for a free slot
+    int64_t next;		// the file block after the last one it allocated
+    int64_t start;		// first data block of the window, or with none where the last run ended
+    int64_t count;		// blocks left in it, 0 for none
+    int64_t size;		// blocks the window had when last set aside
+    int released;		// released since it was last written, so it gets no new window
+    unsigned long used;		// when it was last looked at, to pick one to throw out
+};
+
+struct prealloc *prealloc_get(int inode_number);
+int64_t prealloc_clear(int64_t block, int64_t want);
+void prealloc_written(int inode_number);
+int64_t prealloc_trim(int inode_number);
+int64_t prealloc_trim_all(void);
+void prealloc_forget(int inode_number);
+void prealloc_reset(void);
+
+#endif
@@ -0,0 +1,102 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Block-range locks within a file.  Reads and writes to parts of a
+  file that do not overlap go ahead in parallel; overlapping ones
+  where at least one side writes are run in the order they arrived.
+
+  Rather than a lock per inode, inodes hash onto a fixed set of
+  stripes, each holding the list of ranges taken or wanted in its
+  inodes, so memory use does not grow with the size of the inode
+  table.
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "rangelock.h"
+
+#define RANGE_STRIPES 64
+
+struct stripe {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct range *ranges;	// in order of arrival, held or waiting
+};
+
+static struct stripe stripes[RANGE_STRIPES];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+
+static void stripes_init(void)
+{
+    int i;
+
+    for (i = 0; i < RANGE_STRIPES; i++) {
+	pthread_mutex_init(&stripes[i].lock, NULL);
+	pthread_cond_init(&stripes[i].cond, NULL);
+	stripes[i].ranges = NULL;
+    }
+}
+
+static struct stripe *stripe_of(int inode_number)
+{
+    pthread_once(&stripes_once, stripes_init);
+    return &stripes[(unsigned) inode_number % RANGE_STRIPES];
+}
+
+static int conflicts(const struct range *a, const struct range *b)
+{
+    return a->inode_number == b->inode_number
+	&& (a->write || b->write)
+	&& a->first <= b->last && b->first <= a->last;
+}
+
+// A range may go ahead once nothing that arrived before it conflicts
+static int blocked(struct stripe *s, const struct range *r)
+{
+    struct range *p;
+
+    for (p = s->ranges; p != r; p = p->next)
+	if (conflicts(p, r))
+	    return 1;
+
+    return 0;
+}
+
+/** Lock blocks @first..@last of an inode, waiting for conflicting
+ * ranges that were asked for earlier */
+void range_lock(struct range *r, int inode_number, int64_t first, int64_t last, int write)
+{
+    struct stripe *s = stripe_of(inode_number);
+    struct range **tail;
+
+    r->inode_number = inode_number;
+    r->first = first;
+    r->last = last;
+    r->write = write;
+    r->next = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    for (tail = &s->ranges; *tail != NULL; tail = &(*tail)->next)
+	;
+    *tail = r;
+    while (blocked(s, r))
+	pthread_cond_wait(&s->cond, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void range_unlock(struct range *r)
+{
+    struct stripe *s = stripe_of(r->inode_number);
+    struct range **p;
+
+    pthread_mutex_lock(&s->lock);
+    for (p = &s->ranges; *p != r; p = &(*p)->next)
+	;
+    *p = r->next;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,26 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _RANGELOCK_H_
+#define _RANGELOCK_H_
+
+#include <stdint.h>
+
+// A lock on the file blocks first..last of one inode.  The caller
+// owns the storage (usually on its stack) for as long as it is held.
+struct range {
+    int inode_number;
+    int64_t first;
+    int64_t last;
+    int write;			// exclusive if set, shared otherwise
+    struct range *next;
+};
+
+void range_lock(struct range *r, int inode_number, int64_t first, int64_t last, int write);
+void range_unlock(struct range *r);
+
+#endif
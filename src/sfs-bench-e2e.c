@@ -0,0 +1,432 @@
+/*
+  End-to-end workloads against a mounted sfs.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  usage:  sfs-bench-e2e [-t threads] [-n ops] [-s file_size] [-b io_size]
+			[-e entries] mountdir
+
+  Runs the workloads applications put on sfs through the kernel, with
+  plain system calls from several threads at once: sequential writes
+  and reads, random 4 KiB writes and reads, create/stat/unlink storms
+  of small files, and readdir of a full directory.  Nothing here knows
+  about sfs itself, so it can be pointed at any directory to compare.
+
+  Prints one JSON object per line: the configuration first, then one
+  per measured operation with its count, errors, bytes, elapsed time,
+  rates and latency percentiles, so runs of different builds can be
+  diffed or loaded into anything that reads JSON.
+*/
+
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define RANDOM_IO_SIZE 4096
+#define MAX_SERIES 3			// operations timed separately in one scenario
+
+// what one thread measured of one operation
+struct series {
+    uint64_t *lat;			// ns, one per operation
+    int n;
+    uint64_t errors;
+    uint64_t bytes;
+};
+
+struct worker {
+    int id;
+    pthread_t thread;
+    uint64_t seed;
+    char *buf;
+    struct series s[MAX_SERIES];
+};
+
+struct scenario {
+    const char *names[MAX_SERIES];	// NULL past the last series
+    void (*run)(struct worker *w);
+};
+
+static const char *mountdir;
+static int nthreads = 4;
+static int nops = 1000;			// per thread and operation
+static off_t file_size = 64 * 1024;
+static size_t io_size = 16 * 1024;
+static int max_entries = 1000;
+static int entries;			// how many the readdir directory got
+static struct worker *workers;
+
+static void usage()
+{
+    fprintf(stderr, "usage:  sfs-bench-e2e [-t threads] [-n ops] [-s file_size] [-b io_size]\n"
+		    "                      [-e entries] mountdir\n");
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift, so every run does the same random I/O
+static uint64_t next_random(struct worker *w)
+{
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 7;
+    w->seed ^= w->seed << 17;
+    return w->seed;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void worker_path(char *path, const char *what, int id)
+{
+    snprintf(path, PATH_MAX, "%s/%s.%d", mountdir, what, id);
+}
+
+/* Record one operation
+ * INPUT: the series it belongs to, when it started, what it returned
+ *        (negative for an error), and whether that was a byte count
+ * OUTPUT: none
+ */
+static void record(struct series *s, uint64_t start, ssize_t result, int bytes)
+{
+    if (s->n < nops)
+	s->lat[s->n++] = now() - start;
+    if (result < 0)
+	s->errors++;
+    else if (bytes)
+	s->bytes += result;
+}
+
+static void run_seq_write(struct worker *w)
+{
+    char path[PATH_MAX];
+    off_t off = 0;
+    uint64_t t;
+    int fd, i;
+
+    worker_path(path, "bench", w->id);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+	w->s[0].errors += nops;
+	return;
+    }
+    for (i = 0; i < nops; i++) {
+	// start the file over once it is written
+	if (off >= file_size) {
+	    ftruncate(fd, 0);
+	    off = 0;
+	}
+	t = now();
+	ssize_t ret = pwrite(fd, w->buf, io_size, off);
+	record(&w->s[0], t, ret, 1);
+	off += io_size;
+    }
+    close(fd);
+}
+
+static void run_seq_read(struct worker *w)
+{
+    char path[PATH_MAX];
+    off_t off = 0;
+    uint64_t t;
+    int fd, i;
+
+    worker_path(path, "bench", w->id);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+	w->s[0].errors += nops;
+	return;
+    }
+    for (i = 0; i < nops; i++) {
+	t = now();
+	ssize_t ret = pread(fd, w->buf, io_size, off);
+	record(&w->s[0], t, ret, 1);
+	off = ret > 0 ? off + ret : 0;
+    }
+    close(fd);
+}
+
+static void run_random(struct worker *w, int write)
+{
+    char path[PATH_MAX];
+    off_t off;
+    uint64_t t;
+    int fd, i;
+
+    worker_path(path, "bench", w->id);
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+	w->s[0].errors += nops;
+	return;
+    }
+    // the sequential pass may have left it short
+    if (ftruncate(fd, file_size) < 0)
+	w->s[0].errors++;
+    for (i = 0; i < nops; i++) {
+	off = next_random(w) % (file_size / RANDOM_IO_SIZE) * RANDOM_IO_SIZE;
+	t = now();
+	ssize_t ret = write ? pwrite(fd, w->buf, RANDOM_IO_SIZE, off)
+			    : pread(fd, w->buf, RANDOM_IO_SIZE, off);
+	record(&w->s[0], t, ret, 1);
+    }
+    close(fd);
+}
+
+static void run_rand_write(struct worker *w)
+{
+    run_random(w, 1);
+}
+
+static void run_rand_read(struct worker *w)
+{
+    run_random(w, 0);
+}
+
+/* Small files: create one with a block of data, stat it, unlink it */
+static void run_storm(struct worker *w)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    uint64_t t;
+    int fd, i, ret;
+
+    for (i = 0; i < nops; i++) {
+	snprintf(path, sizeof(path), "%s/small.%d.%d", mountdir, w->id, i);
+	t = now();
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	ret = fd;
+	if (fd >= 0) {
+	    if (write(fd, w->buf, 512) < 0)
+		ret = -1;
+	    close(fd);
+	}
+	record(&w->s[0], t, ret, 0);
+	t = now();
+	record(&w->s[1], t, stat(path, &st), 0);
+	t = now();
+	record(&w->s[2], t, unlink(path), 0);
+    }
+}
+
+static void run_readdir(struct worker *w)
+{
+    struct dirent *de;
+    uint64_t t;
+    DIR *dir;
+    int i, n;
+
+    for (i = 0; i < nops; i++) {
+	t = now();
+	dir = opendir(mountdir);
+	n = -1;
+	if (dir != NULL) {
+	    for (n = 0; (de = readdir(dir)) != NULL; n++)
+		;
+	    closedir(dir);
+	}
+	record(&w->s[0], t, n, 0);
+    }
+}
+
+/* Fill the mount's root with empty files for the readdir scenario,
+ * up to max_entries or as many as it will hold */
+static void make_entries()
+{
+    char path[PATH_MAX];
+    int fd;
+
+    for (entries = 0; entries < max_entries; entries++) {
+	snprintf(path, sizeof(path), "%s/entry.%d", mountdir, entries);
+	fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0)
+	    break;
+	close(fd);
+    }
+}
+
+static void remove_files()
+{
+    char path[PATH_MAX];
+    int i;
+
+    for (i = 0; i < entries; i++) {
+	snprintf(path, sizeof(path), "%s/entry.%d", mountdir, i);
+	unlink(path);
+    }
+    for (i = 0; i < nthreads; i++) {
+	worker_path(path, "bench", i);
+	unlink(path);
+    }
+}
+
+static const struct scenario *current;
+
+static void *worker_run(void *arg)
+{
+    struct worker *w = arg;
+
+    current->run(w);
+    return NULL;
+}
+
+/* Print one series of a scenario, merged over the threads
+ * INPUT: its name, which series of the workers, the wall time in ns
+ * OUTPUT: none
+ */
+static void report(const char *name, int k, uint64_t elapsed)
+{
+    uint64_t *all, ops = 0, errors = 0, bytes = 0;
+    double seconds = elapsed / 1e9;
+    int i, n = 0;
+
+    all = malloc((size_t) nthreads * nops * sizeof(uint64_t));
+    if (all == NULL) {
+	perror("malloc");
+	exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nthreads; i++) {
+	struct series *s = &workers[i].s[k];
+	memcpy(all + n, s->lat, s->n * sizeof(uint64_t));
+	n += s->n;
+	errors += s->errors;
+	bytes += s->bytes;
+    }
+    ops = n;
+    qsort(all, n, sizeof(uint64_t), compare_u64);
+    printf("{\"scenario\":\"%s\",\"threads\":%d,\"ops\":%" PRIu64 ",\"errors\":%" PRIu64
+	   ",\"bytes\":%" PRIu64 ",\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.3f",
+	   name, nthreads, ops, errors, bytes, seconds,
+	   seconds > 0 ? ops / seconds : 0, seconds > 0 ? bytes / seconds / 1e6 : 0);
+    if (strcmp(name, "readdir") == 0)
+	printf(",\"entries\":%d", entries);
+    if (n > 0)
+	printf(",\"p50_ns\":%" PRIu64 ",\"p90_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64
+	       ",\"max_ns\":%" PRIu64, all[n / 2], all[(uint64_t) n * 90 / 100],
+	       all[(uint64_t) n * 99 / 100], all[n - 1]);
+    printf("}\n");
+    fflush(stdout);
+    free(all);
+}
+
+/* Run a scenario on every thread at once and report it */
+static void run(const struct scenario *sc)
+{
+    uint64_t start, elapsed;
+    int i, k;
+
+    current = sc;
+    for (i = 0; i < nthreads; i++)
+	for (k = 0; k < MAX_SERIES; k++) {
+	    workers[i].s[k].n = 0;
+	    workers[i].s[k].errors = 0;
+	    workers[i].s[k].bytes = 0;
+	}
+    start = now();
+    for (i = 0; i < nthreads; i++)
+	if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+	    perror("pthread_create");
+	    exit(EXIT_FAILURE);
+	}
+    for (i = 0; i < nthreads; i++)
+	pthread_join(workers[i].thread, NULL);
+    elapsed = now() - start;
+    for (k = 0; k < MAX_SERIES && sc->names[k] != NULL; k++)
+	report(sc->names[k], k, elapsed);
+}
+
+static const struct scenario scenarios[] = {
+    { { "seq_write" }, run_seq_write },
+    { { "seq_read" }, run_seq_read },
+    { { "rand_write_4k" }, run_rand_write },
+    { { "rand_read_4k" }, run_rand_read },
+    { { "small_create", "small_stat", "small_unlink" }, run_storm },
+};
+
+static const struct scenario readdir_scenario = { { "readdir" }, run_readdir };
+
+int main(int argc, char *argv[])
+{
+    unsigned i;
+    int c, k;
+
+    while ((c = getopt(argc, argv, "t:n:s:b:e:")) != -1) {
+	switch (c) {
+	case 't':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'n':
+	    nops = atoi(optarg);
+	    break;
+	case 's':
+	    file_size = atoll(optarg);
+	    break;
+	case 'b':
+	    io_size = atol(optarg);
+	    break;
+	case 'e':
+	    max_entries = atoi(optarg);
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind != argc - 1 || nthreads <= 0 || nops <= 0
+	|| file_size < RANDOM_IO_SIZE || io_size == 0 || max_entries < 0)
+	usage();
+    mountdir = argv[optind];
+
+    workers = calloc(nthreads, sizeof(struct worker));
+    if (workers == NULL) {
+	perror("calloc");
+	return EXIT_FAILURE;
+    }
+    for (i = 0; i < (unsigned) nthreads; i++) {
+	workers[i].id = i;
+	workers[i].seed = 88172645463325252ULL + i;
+	workers[i].buf = malloc(io_size > RANDOM_IO_SIZE ? io_size : RANDOM_IO_SIZE);
+	if (workers[i].buf == NULL) {
+	    perror("malloc");
+	    return EXIT_FAILURE;
+	}
+	memset(workers[i].buf, 'a' + i % 26, io_size > RANDOM_IO_SIZE ? io_size : RANDOM_IO_SIZE);
+	for (k = 0; k < MAX_SERIES; k++) {
+	    workers[i].s[k].lat = malloc(nops * sizeof(uint64_t));
+	    if (workers[i].s[k].lat == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	    }
+	}
+    }
+
+    printf("{\"config\":{\"mountdir\":\"%s\",\"threads\":%d,\"ops\":%d,\"file_size\":%lld"
+	   ",\"io_size\":%zu,\"time\":%lld}}\n",
+	   mountdir, nthreads, nops, (long long) file_size, io_size, (long long) time(NULL));
+    for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+	run(&scenarios[i]);
+    make_entries();
+    run(&readdir_scenario);
+    remove_files();
+
+    return 0;
+}
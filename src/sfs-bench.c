@@ -0,0 +1,386 @@
+/*
+  Microbenchmarks for the block and metadata layers.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  usage:  sfs-bench [-p] [-n ops] [-m image_mb] [-d dir] [case ...]
+
+  Formats a scratch image and drives libsfs's internals on it directly,
+  with no FUSE and no kernel in the way: block_read/block_write, the
+  bitmap allocators, get_inode/set_inode and findInode.  Every
+  operation is timed on its own; each case prints its rate and latency
+  percentiles.  Naming cases on the command line runs only the ones
+  whose names start with one of them.
+
+  The image runs the way a mount runs it, with the background work
+  libsfs_start starts: metadata changes go through the journal.  -p
+  leaves that off, so they are written in place as they are made.
+*/
+
+#include "params.h"
+#include "block.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libsfs.h"
+#include "trace.h"
+
+#define DEFAULT_OPS 20000
+#define DEFAULT_IMAGE_MB 32
+#define MAX_DEPTH 8
+
+static struct libsfs *fs;
+static char image[PATH_MAX];
+static int nops = DEFAULT_OPS;
+static uint64_t *lat;			// one latency per operation, ns
+static char **only;			// cases asked for, NULL for all
+static int nonly;
+static uint64_t seed = 88172645463325252ULL;
+static int in_place;			// -p: no background work, no journal
+
+static void usage()
+{
+    fprintf(stderr, "usage:  sfs-bench [-p] [-n ops] [-m image_mb] [-d dir] [case ...]\n");
+    exit(EXIT_FAILURE);
+}
+
+// xorshift, so every run does the same random I/O
+static uint64_t next_random()
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Whether a case was asked for on the command line
+ * INPUT: the case, or for the lookups the group of cases it runs
+ * OUTPUT: 1 if either name starts with the other, else 0
+ */
+static int wanted(const char *name)
+{
+    size_t len;
+    int i;
+
+    if (only == NULL)
+	return 1;
+    for (i = 0; i < nonly; i++) {
+	len = strlen(only[i]) < strlen(name) ? strlen(only[i]) : strlen(name);
+	if (strncmp(name, only[i], len) == 0)
+	    return 1;
+    }
+    return 0;
+}
+
+/* Print one case
+ * INPUT: its name, how many operations were timed into lat[] and the
+ *        wall time they took in all
+ * OUTPUT: none
+ */
+static void report(const char *name, int n, uint64_t elapsed)
+{
+    if (n == 0) {
+	printf("%-28s %8d\n", name, 0);
+	return;
+    }
+    qsort(lat, n, sizeof(uint64_t), compare_u64);
+    printf("%-28s %8d %12.0f %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %10" PRIu64 "\n",
+	   name, n, n * 1e9 / (elapsed ? elapsed : 1),
+	   lat[n / 2], lat[(uint64_t) n * 90 / 100], lat[(uint64_t) n * 99 / 100], lat[n - 1]);
+}
+
+/* Start over on an empty filesystem */
+static void reformat()
+{
+    int err;
+
+    if (fs != NULL)
+	libsfs_close(fs);
+    err = libsfs_open(image, LIBSFS_FORMAT, &fs);
+    if (err != 0) {
+	fprintf(stderr, "%s: %s\n", image, strerror(-err));
+	exit(EXIT_FAILURE);
+    }
+    if (!in_place && (err = libsfs_start(fs)) != 0) {
+	fprintf(stderr, "%s: can't start background work: %s\n", image, strerror(-err));
+	exit(EXIT_FAILURE);
+    }
+}
+
+/*
+  Block I/O: one block at a time through block_read and block_write,
+  walking the data region in order or jumping around it at random.
+*/
+static void bench_blocks(const char *name, int write, int random)
+{
+    char buf[BLOCK_SIZE];
+    uint64_t start, t;
+    int64_t block;
+    int i;
+
+    if (!wanted(name))
+	return;
+    memset(buf, 0x5a, sizeof(buf));
+    start = trace_now();
+    for (i = 0; i < nops; i++) {
+	block = random ? next_random() % info.dataregion_blocks : i % info.dataregion_blocks;
+	block += info.dataregion_blocks_start;
+	t = trace_now();
+	if (write)
+	    block_write(block, buf);
+	else
+	    block_read(block, buf);
+	lat[i] = trace_now() - t;
+    }
+    report(name, nops, trace_now() - start);
+}
+
+/*
+  Marks every bit of a bitmap used, for the nearly-full cases; the
+  caller frees the ones it wants free again.
+*/
+static void fill_bitmap(int64_t start, int64_t blocks)
+{
+    char buf[BLOCK_SIZE];
+    int64_t i;
+
+    memset(buf, 0xff, sizeof(buf));
+    for (i = 0; i < blocks; i++)
+	block_write(start + i, buf);
+}
+
+/*
+  Data block allocation: find_free_datablock and marking the block
+  used, the way create and write take one.  On a nearly-full image
+  only one block in 'spread' is free, scattered over the bitmap, so
+  every search has to skip over used ones.
+*/
+static void bench_alloc_data(const char *name, int spread)
+{
+    uint64_t start, t;
+    int64_t block;
+    int i, n;
+
+    if (!wanted(name))
+	return;
+    reformat();
+    n = nops < info.dataregion_blocks - 1 ? nops : info.dataregion_blocks - 1;
+    if (spread > 1) {
+	libsfs_begin(fs);
+	fill_bitmap(info.dataregion_bitmap_start, info.dataregion_bitmap_blocks);
+	for (i = 1; i < info.dataregion_blocks; i += spread)
+	    set_dataregion_status(i, 0);
+	libsfs_end(fs);
+	n = (info.dataregion_blocks - 1) / spread;
+	n = n < nops ? n : nops;
+    }
+    start = trace_now();
+    for (i = 0; i < n; i++) {
+	t = trace_now();
+	libsfs_begin(fs);
+	block = find_free_datablock();
+	if (block != -1)
+	    set_dataregion_status(block, 1);
+	libsfs_end(fs);
+	lat[i] = trace_now() - t;
+	if (block == -1)
+	    break;
+    }
+    report(name, i, trace_now() - start);
+}
+
+/* Inode allocation, as above: find_free_inode and set_inode_status */
+static void bench_alloc_inode(const char *name, int spread)
+{
+    uint64_t start, t;
+    int i, n, ino;
+
+    if (!wanted(name))
+	return;
+    reformat();
+    n = nops < info.total_inodes - 1 ? nops : info.total_inodes - 1;
+    if (spread > 1) {
+	libsfs_begin(fs);
+	fill_bitmap(info.inode_bitmap_start, info.inode_bitmap_blocks);
+	for (i = 1; i < info.total_inodes; i += spread)
+	    set_inode_status(i, 0);
+	libsfs_end(fs);
+	n = (info.total_inodes - 1) / spread;
+	n = n < nops ? n : nops;
+    }
+    start = trace_now();
+    for (i = 0; i < n; i++) {
+	t = trace_now();
+	libsfs_begin(fs);
+	ino = find_free_inode();
+	if (ino != -1)
+	    set_inode_status(ino, 1);
+	libsfs_end(fs);
+	lat[i] = trace_now() - t;
+	if (ino == -1)
+	    break;
+    }
+    report(name, i, trace_now() - start);
+}
+
+/* get_inode and set_inode on inodes picked at random */
+static void bench_inodes(const char *name, int write)
+{
+    uint64_t start, t;
+    inode node;
+    int i, ino;
+
+    if (!wanted(name))
+	return;
+    memset(&node, 0, sizeof(inode));
+    start = trace_now();
+    for (i = 0; i < nops; i++) {
+	// leave the root alone
+	ino = 1 + next_random() % (info.total_inodes - 1);
+	t = trace_now();
+	libsfs_begin(fs);
+	if (write)
+	    set_inode(ino, node);
+	else
+	    node = get_inode(ino);
+	libsfs_end(fs);
+	lat[i] = trace_now() - t;
+    }
+    report(name, nops, trace_now() - start);
+}
+
+/*
+  Path lookup.  Builds a chain of MAX_DEPTH directories, each holding
+  'width' entries with the one the chain goes on through last, so
+  findInode has to read every entry of every directory on the way
+  down; then times lookups of the last entry at each depth.
+*/
+static void bench_lookup(int width)
+{
+    char path[PATH_MAX], name[64];
+    int depth, i, len, ino;
+    uint64_t start, t;
+    inode node;
+
+    snprintf(name, sizeof(name), "lookup_w%d", width);
+    if (!wanted(name))
+	return;
+    reformat();
+    len = 0;
+    path[0] = '\0';
+    for (depth = 1; depth <= MAX_DEPTH; depth++) {
+	for (i = 0; i < width; i++) {
+	    snprintf(path + len, sizeof(path) - len, "/e%d", i);
+	    if (libsfs_create(fs, path) != 0) {
+		fprintf(stderr, "%s: can't create %s\n", name, path);
+		return;
+	    }
+	}
+	len = strlen(path);
+	libsfs_begin(fs);
+	ino = findInode(path);
+	node = get_inode(ino);
+	node.flags |= SFS_DIR;
+	set_inode(ino, node);
+	libsfs_end(fs);
+    }
+
+    for (depth = 1; depth <= MAX_DEPTH; depth *= 2) {
+	len = 0;
+	for (i = 0; i < depth; i++)
+	    len += snprintf(path + len, sizeof(path) - len, "/e%d", width - 1);
+	snprintf(name, sizeof(name), "lookup_w%d_d%d", width, depth);
+	start = trace_now();
+	for (i = 0; i < nops; i++) {
+	    t = trace_now();
+	    libsfs_begin(fs);
+	    ino = findInode(path);
+	    libsfs_end(fs);
+	    lat[i] = trace_now() - t;
+	}
+	if (ino == -1)
+	    fprintf(stderr, "%s: %s not found\n", name, path);
+	report(name, nops, trace_now() - start);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dir = getenv("TMPDIR");
+    int mb = DEFAULT_IMAGE_MB;
+    int fd, c;
+
+    while ((c = getopt(argc, argv, "pn:m:d:")) != -1) {
+	switch (c) {
+	case 'p':
+	    in_place = 1;
+	    break;
+	case 'n':
+	    nops = atoi(optarg);
+	    break;
+	case 'm':
+	    mb = atoi(optarg);
+	    break;
+	case 'd':
+	    dir = optarg;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (nops <= 0 || mb <= 0)
+	usage();
+    if (optind < argc) {
+	only = argv + optind;
+	nonly = argc - optind;
+    }
+
+    lat = malloc(nops * sizeof(uint64_t));
+    if (lat == NULL) {
+	perror("malloc");
+	return EXIT_FAILURE;
+    }
+    snprintf(image, sizeof(image), "%s/sfs-bench.XXXXXX", dir ? dir : "/tmp");
+    fd = mkstemp(image);
+    if (fd < 0 || ftruncate(fd, (off_t) mb * 1024 * 1024) < 0) {
+	perror(image);
+	return EXIT_FAILURE;
+    }
+    close(fd);
+
+    reformat();
+    printf("mode: %s\n", in_place ? "in place, no background work" : "journaled, background work started");
+    printf("%-28s %8s %12s %8s %8s %8s %10s\n",
+	   "case", "ops", "ops/s", "p50_ns", "p90_ns", "p99_ns", "max_ns");
+    bench_blocks("block_seq_read", 0, 0);
+    bench_blocks("block_seq_write", 1, 0);
+    bench_blocks("block_rand_read", 0, 1);
+    bench_blocks("block_rand_write", 1, 1);
+    bench_inodes("get_inode", 0);
+    bench_inodes("set_inode", 1);
+    bench_alloc_data("alloc_data_empty", 1);
+    bench_alloc_data("alloc_data_full", 100);
+    bench_alloc_inode("alloc_inode_empty", 1);
+    bench_alloc_inode("alloc_inode_full", 1000);
+    bench_lookup(1);
+    bench_lookup(12);
+
+    libsfs_close(fs);
+    unlink(image);
+    free(lat);
+
+    return 0;
+}
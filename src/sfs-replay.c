@@ -0,0 +1,681 @@
+/*
+  Replays a recorded sfs workload.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  usage:  sfs-replay [-m] [-x factor] -i image tracefile|logfile
+	  sfs-replay [-m] [-x factor] -d mountdir tracefile|logfile
+
+  Reads either the binary trace sfs writes with -o trace (see trace.h)
+  or the text log it writes with -o log_level=trace, and issues the
+  same operations again, either straight into libsfs on a freshly
+  formatted image (-i), run with the background work a mount starts,
+  or through the kernel on a mounted sfs (-d).
+
+  The trace has timestamps, so by default its operations are issued
+  at the times they were recorded, -x factor times faster; -m issues
+  them back to back.  The text log has no times and always replays
+  back to back.  The trace has no paths either, only inodes, so each
+  file is replayed as "/i<inode>".  Operations are issued one at a
+  time in the order they started.
+
+  Files the workload uses without creating them first are created
+  before the replay starts, as big as the workload needs.  Prints how
+  many of each operation were replayed, how many failed, and their
+  latency.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "libsfs.h"
+#include "stats.h"
+#include "trace.h"
+
+#define MAX_OPEN 256		// files the mount backend keeps open at once
+#define FILE_HASH 4096
+
+// Every path the workload names, once
+struct file {
+    char *path;
+    int seen;			// prepare() has come across it
+    int sizing;			// still growing 'size' from its reads and writes
+    int precreate;		// the workload uses it before creating it
+    off_t size;
+    struct file *next;		// in file_hash
+};
+
+struct op {
+    int op;			// enum trace_op
+    struct file *file;
+    size_t size;
+    off_t offset;		// or the new size for truncate
+    uint64_t time;		// ns after the start, for traces
+    int result;			// what it returned when recorded, for traces
+};
+
+static struct file *file_hash[FILE_HASH];
+static struct op *ops;
+static size_t nops, ops_cap;
+static int timed;		// whether ops[].time means anything
+
+// where to replay to: libsfs on an image, or a mount
+static struct libsfs *fs;
+static const char *mountdir;
+
+struct open_file {
+    char *path;
+    int fd;
+    int refs;
+};
+static struct open_file open_files[MAX_OPEN];
+
+static char *buf;
+static size_t buf_size;
+
+static void usage()
+{
+    fprintf(stderr, "usage:  sfs-replay [-m] [-x factor] -i image tracefile|logfile\n"
+		    "        sfs-replay [-m] [-x factor] -d mountdir tracefile|logfile\n");
+    exit(EXIT_FAILURE);
+}
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (p == NULL) {
+	perror("malloc");
+	exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static struct file *intern(const char *path)
+{
+    unsigned h = 0;
+    const char *p;
+    struct file *f;
+
+    for (p = path; *p; p++)
+	h = h * 31 + (unsigned char) *p;
+    h %= FILE_HASH;
+    for (f = file_hash[h]; f != NULL; f = f->next)
+	if (strcmp(f->path, path) == 0)
+	    return f;
+    f = calloc(1, sizeof(struct file));
+    if (f == NULL || (f->path = strdup(path)) == NULL) {
+	perror("malloc");
+	exit(EXIT_FAILURE);
+    }
+    f->next = file_hash[h];
+    file_hash[h] = f;
+    return f;
+}
+
+static struct op *add_op(int op, const char *path)
+{
+    struct op *o;
+
+    if (nops == ops_cap) {
+	ops_cap = ops_cap ? ops_cap * 2 : 1024;
+	ops = realloc(ops, ops_cap * sizeof(struct op));
+	if (ops == NULL) {
+	    perror("realloc");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    o = &ops[nops++];
+    memset(o, 0, sizeof(struct op));
+    o->op = op;
+    o->file = intern(path);
+    return o;
+}
+
+/*
+  The text log.  Each operation sfs_<op>(...) logs one line naming it
+  and its arguments; everything else in the log is ignored.
+*/
+static const struct {
+    const char *name;
+    int op;
+} log_ops[] = {
+    { "sfs_getattr(", TRACE_GETATTR },
+    { "sfs_create(", TRACE_CREATE },
+    { "sfs_unlink(", TRACE_UNLINK },
+    { "sfs_open(", TRACE_OPEN },
+    { "sfs_release(", TRACE_RELEASE },
+    { "sfs_read(", TRACE_READ },
+    { "sfs_write(", TRACE_WRITE },
+    { "sfs_truncate(", TRACE_TRUNCATE },
+    { "sfs_ftruncate(", TRACE_FTRUNCATE },
+    { "sfs_utimens(", TRACE_UTIMENS },
+    { "sfs_mkdir(", TRACE_MKDIR },
+    { "sfs_rmdir(", TRACE_RMDIR },
+    { "sfs_opendir(", TRACE_OPENDIR },
+    { "sfs_readdir(", TRACE_READDIR },
+    { "sfs_fsync(", TRACE_FSYNC },
+    { "sfs_fsyncdir(", TRACE_FSYNCDIR },
+};
+
+/* The value of one argument of a logged call
+ * INPUT: the line, the argument's name with its '=' (path is also
+ *        found as path"..." the way older logs wrote open)
+ * OUTPUT: where its value starts, or NULL if the line doesn't have it
+ */
+static const char *log_arg(const char *line, const char *name)
+{
+    const char *p = strstr(line, name);
+
+    if (p == NULL)
+	return NULL;
+    return p + strlen(name);
+}
+
+static void parse_log_line(const char *line)
+{
+    char path[PATH_MAX];
+    const char *p, *end;
+    unsigned i;
+    struct op *o;
+
+    while (*line == ' ')
+	line++;
+    // readdir used to log no arguments at all, and is only ever asked
+    // about the root
+    if (strncmp(line, "entering readdir", 16) == 0) {
+	add_op(TRACE_READDIR, "/");
+	return;
+    }
+    for (i = 0; i < sizeof(log_ops) / sizeof(log_ops[0]); i++)
+	if (strncmp(line, log_ops[i].name, strlen(log_ops[i].name)) == 0)
+	    break;
+    if (i == sizeof(log_ops) / sizeof(log_ops[0]))
+	return;
+
+    p = log_arg(line, "path=\"");
+    if (p == NULL)
+	p = log_arg(line, "path\"");
+    if (p == NULL || (end = strchr(p, '"')) == NULL || end - p >= PATH_MAX)
+	return;
+    memcpy(path, p, end - p);
+    path[end - p] = '\0';
+    o = add_op(log_ops[i].op, path);
+    if ((o->op == TRACE_READ || o->op == TRACE_WRITE) && (p = log_arg(line, " size=")) != NULL)
+	o->size = strtoul(p, NULL, 10);
+    if ((p = log_arg(line, "offset=")) != NULL)
+	o->offset = strtoll(p, NULL, 10);
+    if ((p = log_arg(line, "newsize=")) != NULL)
+	o->offset = strtoll(p, NULL, 10);
+}
+
+static int load_log(const char *name)
+{
+    char line[4096];
+    FILE *f = fopen(name, "r");
+
+    if (f == NULL) {
+	perror(name);
+	return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL)
+	parse_log_line(line);
+    fclose(f);
+    return 0;
+}
+
+/* The binary trace; reads it like sfs-trace does */
+static int load_trace(const char *name, const void *map, size_t length)
+{
+    const struct trace_header *hdr = map;
+    const struct trace_record *records, *r;
+    char path[64];
+    uint64_t first, n;
+    struct op *o;
+
+    if (hdr->version != TRACE_VERSION || hdr->record_size != sizeof(struct trace_record)
+	|| sizeof(*hdr) + hdr->capacity * hdr->record_size > length) {
+	fprintf(stderr, "%s: a different version of the trace\n", name);
+	return -1;
+    }
+    records = (const struct trace_record *) (hdr + 1);
+    first = hdr->next > hdr->capacity ? hdr->next - hdr->capacity : 0;
+    for (n = first; n < hdr->next; n++) {
+	r = &records[n % hdr->capacity];
+	if (r->seq != n + 1 || r->op <= 0 || r->op >= TRACE_NOPS)
+	    continue;
+	// the xattrs are settings of the mount, not workload
+	if (r->op == TRACE_SETXATTR || r->op == TRACE_GETXATTR || r->op == TRACE_LISTXATTR)
+	    continue;
+	// nor are the statistics files, the only paths with no inode that
+	// can be used successfully
+	if (r->inode < 0 && r->result >= 0)
+	    continue;
+	if (r->inode == 0)
+	    snprintf(path, sizeof(path), "/");
+	else if (r->inode < 0)
+	    snprintf(path, sizeof(path), "/.replay-missing");
+	else
+	    snprintf(path, sizeof(path), "/i%d", r->inode);
+	o = add_op(r->op, path);
+	o->size = r->size;
+	o->offset = r->offset;
+	o->time = r->time;
+	o->result = r->result;
+    }
+    timed = 1;
+    return 0;
+}
+
+static int compare_time(const void *a, const void *b)
+{
+    const struct op *x = a, *y = b;
+    return x->time < y->time ? -1 : x->time > y->time;
+}
+
+static int load(const char *name)
+{
+    struct stat st;
+    void *map;
+    int fd, ret;
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+	perror(name);
+	return -1;
+    }
+    if ((size_t) st.st_size >= sizeof(struct trace_header)) {
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map != MAP_FAILED && memcmp(map, TRACE_MAGIC, 8) == 0) {
+	    close(fd);
+	    ret = load_trace(name, map, st.st_size);
+	    munmap(map, st.st_size);
+	    // threads record in the order they finish, not start
+	    if (ret == 0)
+		qsort(ops, nops, sizeof(struct op), compare_time);
+	    return ret;
+	}
+	if (map != MAP_FAILED)
+	    munmap(map, st.st_size);
+    }
+    close(fd);
+    return load_log(name);
+}
+
+static char *mount_path(char *full, const char *path)
+{
+    snprintf(full, PATH_MAX, "%s%s", mountdir, path);
+    return full;
+}
+
+static struct open_file *find_open(const char *path)
+{
+    int i;
+
+    for (i = 0; i < MAX_OPEN; i++)
+	if (open_files[i].path != NULL && strcmp(open_files[i].path, path) == 0)
+	    return &open_files[i];
+    return NULL;
+}
+
+/* Open a file on the mount, or take another reference to it */
+static int mount_open(const char *path)
+{
+    struct open_file *f = find_open(path);
+    char full[PATH_MAX];
+    int i, fd;
+
+    if (f != NULL) {
+	f->refs++;
+	return 0;
+    }
+    fd = open(mount_path(full, path), O_RDWR);
+    if (fd < 0)
+	fd = open(full, O_RDONLY);
+    if (fd < 0)
+	return -errno;
+    for (i = 0; i < MAX_OPEN; i++)
+	if (open_files[i].path == NULL) {
+	    open_files[i].path = strdup(path);
+	    open_files[i].fd = fd;
+	    open_files[i].refs = 1;
+	    return 0;
+	}
+    // out of slots; reads and writes will open it themselves
+    close(fd);
+    return 0;
+}
+
+static int mount_release(const char *path)
+{
+    struct open_file *f = find_open(path);
+
+    if (f != NULL && --f->refs == 0) {
+	close(f->fd);
+	free(f->path);
+	f->path = NULL;
+    }
+    return 0;
+}
+
+static int mount_fsync(const struct op *o)
+{
+    struct open_file *f = find_open(o->file->path);
+    char full[PATH_MAX];
+    int fd, ret;
+
+    fd = f != NULL ? f->fd : open(mount_path(full, o->file->path), O_RDONLY);
+    if (fd < 0)
+	return -errno;
+    ret = fsync(fd) < 0 ? -errno : 0;
+    if (f == NULL)
+	close(fd);
+    return ret;
+}
+
+static int mount_io(const struct op *o, int write)
+{
+    struct open_file *f = find_open(o->file->path);
+    char full[PATH_MAX];
+    ssize_t ret;
+    int fd;
+
+    fd = f != NULL ? f->fd : open(mount_path(full, o->file->path), write ? O_WRONLY : O_RDONLY);
+    if (fd < 0)
+	return -errno;
+    ret = write ? pwrite(fd, buf, o->size, o->offset) : pread(fd, buf, o->size, o->offset);
+    if (ret < 0)
+	ret = -errno;
+    if (f == NULL)
+	close(fd);
+    return ret;
+}
+
+/* Issue one operation on the mount
+ * INPUT: the operation
+ * OUTPUT: what the system call returned, -errno for an error
+ */
+static int replay_mount(const struct op *o)
+{
+    char full[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    int fd;
+
+    mount_path(full, o->file->path);
+    switch (o->op) {
+    case TRACE_GETATTR:
+	return stat(full, &st) < 0 ? -errno : 0;
+    case TRACE_CREATE:
+	fd = open(full, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0)
+	    return -errno;
+	close(fd);
+	return mount_open(o->file->path);
+    case TRACE_UNLINK:
+	return unlink(full) < 0 ? -errno : 0;
+    case TRACE_OPEN:
+	return mount_open(o->file->path);
+    case TRACE_RELEASE:
+	return mount_release(o->file->path);
+    case TRACE_READ:
+	return mount_io(o, 0);
+    case TRACE_WRITE:
+	return mount_io(o, 1);
+    case TRACE_TRUNCATE:
+    case TRACE_FTRUNCATE:
+	return truncate(full, o->offset) < 0 ? -errno : 0;
+    case TRACE_UTIMENS:
+	return utime(full, NULL) < 0 ? -errno : 0;
+    case TRACE_MKDIR:
+	return mkdir(full, 0755) < 0 ? -errno : 0;
+    case TRACE_RMDIR:
+	return rmdir(full) < 0 ? -errno : 0;
+    case TRACE_OPENDIR:
+    case TRACE_READDIR:
+	dir = opendir(full);
+	if (dir == NULL)
+	    return -errno;
+	if (o->op == TRACE_READDIR)
+	    while ((de = readdir(dir)) != NULL)
+		;
+	closedir(dir);
+	return 0;
+    case TRACE_FSYNC:
+    case TRACE_FSYNCDIR:
+	return mount_fsync(o);
+    }
+    return -ENOSYS;
+}
+
+static int count_entry(void *ctx, const char *name)
+{
+    (*(int *) ctx)++;
+    return 0;
+}
+
+/* Issue one operation into libsfs, as sfs.c would for the same request */
+static int replay_lib(const struct op *o)
+{
+    struct libsfs_attr attr;
+    int n = 0;
+
+    switch (o->op) {
+    case TRACE_GETATTR:
+	return libsfs_getattr(fs, o->file->path, &attr);
+    case TRACE_CREATE:
+	return libsfs_create(fs, o->file->path);
+    case TRACE_UNLINK:
+	return libsfs_unlink(fs, o->file->path);
+    case TRACE_OPEN:
+	return libsfs_open_file(fs, o->file->path, NULL);
+    case TRACE_READ:
+	return libsfs_read(fs, o->file->path, buf, o->size, o->offset);
+    case TRACE_WRITE:
+	return libsfs_write(fs, o->file->path, buf, o->size, o->offset);
+    case TRACE_TRUNCATE:
+    case TRACE_FTRUNCATE:
+	return libsfs_truncate(fs, o->file->path, o->offset);
+    case TRACE_UTIMENS:
+	return libsfs_utimens(fs, o->file->path, time(NULL));
+    case TRACE_READDIR:
+	return libsfs_readdir(fs, o->file->path, count_entry, &n);
+    case TRACE_FSYNC:
+    case TRACE_FSYNCDIR:
+	return libsfs_fsync(fs, o->file->path, 0);
+    case TRACE_RELEASE:
+	return libsfs_release(fs, o->file->path);
+    case TRACE_MKDIR:
+    case TRACE_RMDIR:
+    case TRACE_OPENDIR:
+	// sfs does nothing for these
+	return 0;
+    }
+    return -ENOSYS;
+}
+
+static int replay(const struct op *o)
+{
+    return fs != NULL ? replay_lib(o) : replay_mount(o);
+}
+
+/*
+  Creates the files the workload uses before creating them itself,
+  as it found them when it was recorded: big enough for every read
+  and write done to them before they were truncated or removed.
+*/
+static void prepare()
+{
+    struct op setup;
+    struct file *f;
+    size_t i;
+    int op;
+
+    for (i = 0; i < nops; i++) {
+	f = ops[i].file;
+	op = ops[i].op;
+	if (!f->seen) {
+	    f->seen = 1;
+	    // a lookup of a missing file, or one of the root
+	    if (op == TRACE_CREATE || op == TRACE_GETATTR || op == TRACE_UNLINK
+		|| op == TRACE_MKDIR || op == TRACE_OPENDIR || op == TRACE_READDIR
+		|| strcmp(f->path, "/") == 0 || strcmp(f->path, "/.replay-missing") == 0)
+		continue;
+	    f->precreate = 1;
+	    f->sizing = 1;
+	}
+	if (!f->sizing)
+	    continue;
+	if (op == TRACE_CREATE || op == TRACE_UNLINK
+	    || op == TRACE_TRUNCATE || op == TRACE_FTRUNCATE)
+	    f->sizing = 0;
+	else if ((op == TRACE_READ || op == TRACE_WRITE)
+		 && ops[i].offset + (off_t) ops[i].size > f->size)
+	    f->size = ops[i].offset + ops[i].size;
+    }
+
+    for (i = 0; i < FILE_HASH; i++)
+	for (f = file_hash[i]; f != NULL; f = f->next) {
+	    if (!f->precreate)
+		continue;
+	    memset(&setup, 0, sizeof(setup));
+	    setup.file = f;
+	    setup.op = TRACE_CREATE;
+	    replay(&setup);
+	    if (fs == NULL)
+		mount_release(f->path);
+	    setup.op = TRACE_TRUNCATE;
+	    setup.offset = f->size;
+	    replay(&setup);
+	}
+}
+
+static void sleep_until(uint64_t when)
+{
+    uint64_t now = trace_now();
+    struct timespec ts;
+
+    if (when <= now)
+	return;
+    ts.tv_sec = (when - now) / 1000000000;
+    ts.tv_nsec = (when - now) % 1000000000;
+    nanosleep(&ts, NULL);
+}
+
+static void print_summary(uint64_t elapsed, uint64_t mismatched)
+{
+    struct stats *total = xmalloc(sizeof(struct stats));
+    int op;
+
+    stats_merge(total);
+    printf("%-9s %10s %8s %10s %10s %10s\n", "op", "count", "errors", "p50_us", "p99_us", "max_us");
+    for (op = 1; op < TRACE_NOPS; op++) {
+	struct stats_op *s = &total->ops[op];
+	if (s->calls == 0)
+	    continue;
+	printf("%-9s %10" PRIu64 " %8" PRIu64 " %10.1f %10.1f %10.1f\n",
+	       trace_op_name(op), s->calls, s->errors,
+	       stats_percentile(s, 50) / 1000.0, stats_percentile(s, 99) / 1000.0,
+	       stats_percentile(s, 100) / 1000.0);
+    }
+    printf("%zu operations in %.3fs", nops, elapsed / 1e9);
+    if (timed)
+	printf(", %" PRIu64 " succeeded or failed unlike when recorded", mismatched);
+    printf("\n");
+    free(total);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *image = NULL;
+    uint64_t start, t, mismatched = 0;
+    double factor = 1;
+    int max_speed = 0;
+    size_t i;
+    int c, ret;
+
+    while ((c = getopt(argc, argv, "mx:i:d:")) != -1) {
+	switch (c) {
+	case 'm':
+	    max_speed = 1;
+	    break;
+	case 'x':
+	    factor = atof(optarg);
+	    break;
+	case 'i':
+	    image = optarg;
+	    break;
+	case 'd':
+	    mountdir = optarg;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind != argc - 1 || (image == NULL) == (mountdir == NULL) || factor <= 0)
+	usage();
+
+    if (load(argv[optind]) < 0)
+	return EXIT_FAILURE;
+    if (nops == 0) {
+	fprintf(stderr, "%s: no operations to replay\n", argv[optind]);
+	return EXIT_FAILURE;
+    }
+    for (i = 0; i < nops; i++)
+	if (ops[i].size > buf_size)
+	    buf_size = ops[i].size;
+    buf = xmalloc(buf_size + 1);
+    memset(buf, 'r', buf_size + 1);
+
+    if (image != NULL) {
+	ret = libsfs_open(image, LIBSFS_FORMAT, &fs);
+	if (ret != 0) {
+	    fprintf(stderr, "%s: %s\n", image, strerror(-ret));
+	    return EXIT_FAILURE;
+	}
+	// run the image the way a mount does
+	ret = libsfs_start(fs);
+	if (ret != 0) {
+	    fprintf(stderr, "%s: can't start background work: %s\n", image, strerror(-ret));
+	    libsfs_close(fs);
+	    return EXIT_FAILURE;
+	}
+    }
+    prepare();
+
+    start = trace_now();
+    for (i = 0; i < nops; i++) {
+	if (timed && !max_speed)
+	    sleep_until(start + (uint64_t) (ops[i].time / factor));
+	t = trace_now();
+	ret = replay(&ops[i]);
+	stats_op(ops[i].op, ret, trace_now() - t);
+	if ((ret < 0) != (ops[i].result < 0))
+	    mismatched++;
+    }
+    print_summary(trace_now() - start, mismatched);
+
+    for (i = 0; i < MAX_OPEN; i++)
+	if (open_files[i].path != NULL)
+	    close(open_files[i].fd);
+    if (fs != NULL)
+	libsfs_close(fs);
+
+    return 0;
+}
@@ -0,0 +1,142 @@
+/*
+  Decoder for the binary trace sfs writes with -o trace.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  usage:  sfs-trace [-s] tracefile
+
+  Prints one line per traced operation, oldest first, or with -s a
+  summary per operation: count, errors, bytes moved and latency.
+*/
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+struct op_summary {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t latency;		// total, ns
+    uint64_t max_latency;
+};
+
+static void usage()
+{
+    fprintf(stderr, "usage:  sfs-trace [-s] tracefile\n");
+    exit(EXIT_FAILURE);
+}
+
+static void print_record(const struct trace_record *r)
+{
+    printf("%10" PRIu64 ".%06" PRIu64 " %-9s ino %-6" PRId32 " off %-10" PRId64
+	   " size %-8" PRIu32 " %8" PRIu64 "us  = %" PRId32 "\n",
+	   r->time / 1000000000, r->time / 1000 % 1000000, trace_op_name(r->op),
+	   r->inode, r->offset, r->size, r->latency / 1000, r->result);
+}
+
+static void print_summary(const struct op_summary *sum)
+{
+    int op;
+
+    printf("%-9s %10s %8s %14s %10s %10s\n",
+	   "op", "count", "errors", "bytes", "avg_us", "max_us");
+    for (op = 1; op < TRACE_NOPS; op++) {
+	if (sum[op].count == 0)
+	    continue;
+	printf("%-9s %10" PRIu64 " %8" PRIu64 " %14" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+	       trace_op_name(op), sum[op].count, sum[op].errors, sum[op].bytes,
+	       sum[op].latency / sum[op].count / 1000, sum[op].max_latency / 1000);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct op_summary sum[TRACE_NOPS];
+    const struct trace_header *hdr;
+    const struct trace_record *records, *r;
+    uint64_t first, n, torn = 0;
+    struct stat st;
+    int summary = 0;
+    void *map;
+    int fd, c;
+
+    while ((c = getopt(argc, argv, "s")) != -1) {
+	if (c == 's')
+	    summary = 1;
+	else
+	    usage();
+    }
+    if (optind != argc - 1)
+	usage();
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+	perror(argv[optind]);
+	return EXIT_FAILURE;
+    }
+    if ((size_t) st.st_size < sizeof(struct trace_header)) {
+	fprintf(stderr, "%s: not an sfs trace\n", argv[optind]);
+	return EXIT_FAILURE;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+	perror("mmap");
+	return EXIT_FAILURE;
+    }
+    close(fd);
+
+    hdr = map;
+    if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0
+	|| hdr->version != TRACE_VERSION
+	|| hdr->record_size != sizeof(struct trace_record)
+	|| sizeof(*hdr) + hdr->capacity * hdr->record_size > (uint64_t) st.st_size) {
+	fprintf(stderr, "%s: not an sfs trace, or a different version\n", argv[optind]);
+	return EXIT_FAILURE;
+    }
+    records = (const struct trace_record *) (hdr + 1);
+
+    // once the ring has wrapped only the last capacity records are left
+    first = hdr->next > hdr->capacity ? hdr->next - hdr->capacity : 0;
+    memset(sum, 0, sizeof(sum));
+    for (n = first; n < hdr->next; n++) {
+	r = &records[n % hdr->capacity];
+	if (r->seq != n + 1) {
+	    // still being written, or overwritten, when sfs stopped
+	    torn++;
+	    continue;
+	}
+	if (!summary) {
+	    print_record(r);
+	    continue;
+	}
+	if (r->op <= 0 || r->op >= TRACE_NOPS)
+	    continue;
+	sum[r->op].count++;
+	if (r->result < 0)
+	    sum[r->op].errors++;
+	else if (r->op == TRACE_READ || r->op == TRACE_WRITE)
+	    sum[r->op].bytes += r->result;
+	sum[r->op].latency += r->latency;
+	if (r->latency > sum[r->op].max_latency)
+	    sum[r->op].max_latency = r->latency;
+    }
+    if (summary)
+	print_summary(sum);
+    if (first > 0 || torn > 0)
+	fprintf(stderr, "%" PRIu64 " older records overwritten, %" PRIu64 " incomplete\n",
+		first, torn);
+
+    munmap(map, st.st_size);
+    return EXIT_SUCCESS;
+}
@@ -5,18 +5,20 @@
   Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
   His code is licensed under the LGPLv2.
 
+  The FUSE frontend.  The filesystem itself is libsfs (libsfs.c); the
+  callbacks here translate between FUSE and the libsfs calls, and add
+  what only makes sense on a mount: the statistics files, tunables,
+  timing and tracing of each request, and option parsing.
 */
 
 #include "params.h"
-#include "block.h"
 
-#include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
-#include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -27,456 +29,146 @@
 #include <sys/xattr.h>
 #endif
 
+#include "delalloc.h"
+#include "journal.h"
+#include "libsfs.h"
 #include "log.h"
+#include "prealloc.h"
+#include "stats.h"
+#include "trace.h"
+#include "tunables.h"
+#include "workq.h"
 
+// the image, opened by main before mounting
+static struct libsfs *fs;
+static time_t mounted;
 
-char buffer[BLOCK_SIZE];
-inode_block entry_buffer;
-struct stat s;
-metadata_info info; 
-char * filepath;
+int sfs_open(const char *path, struct fuse_file_info *fi);
 
-extern int diskfile;
-// CURRENTLY WORKS ONLY FOR TOTAL SIZE, MULTIPLES OF 4 MB (8MB, 16MB,32MB, ETC)
 /*
-  This function initializes all the structure: 25% is for metadata, 75% for data
-  
+  Registers the settings that can be changed with setxattr on the
+  root directory (tunables.c), and shows the ones fixed at mount
 
-  INPUT: The total size of the file, metadata_info pointer to store metadata value
-  OUTPUT: 0 on success
-
-*/
-int get_metadata_info(int total_size, metadata_info * info){
-
-  // ----------------------------------------------
-  //This gets just the information for the data regions 
-
-  int data_size = 0.75 * total_size; //75% of the total space will be used for the data region
-  int data_blocks = data_size / BLOCK_SIZE;  //Gets the actual number of data blocks
-  // See how many bitmap blocks are needed to address all the data blocks.
-  //Each bitmap block can address BITS_PER_BLOCK blcoks
-  int data_bitmap_blocks = data_blocks / BITS_PER_BLOCK; 
-  info->dataregion_blocks = data_blocks;
-  info->dataregion_bitmap_blocks = data_bitmap_blocks;
-
-  //----------------------------------------------------
-
-  int metadata_size = total_size - data_size; //25% of th total space for metadata
-  int num_metadata_blocks = metadata_size / (BLOCK_SIZE); //Number of blocks based on size
-  num_metadata_blocks = num_metadata_blocks - data_bitmap_blocks - 1; // Total blocks minus data_bitmap_blocks minus superblock
-
-  //int inode_bitmap = (num_metadata_blocks / VALUE) + 1;
-  int inode_bitmap =  num_metadata_blocks / VALUE; //gets the number of inodes. See documentation
-  if (inode_bitmap % VALUE != 0){
-    inode_bitmap++;
-  }
-  num_metadata_blocks = num_metadata_blocks - inode_bitmap;
-
-
-
-  info->disksize = total_size;
-  info->inode_blocks = num_metadata_blocks;
-  info->inode_bitmap_blocks = inode_bitmap;
-  
-  info->total_inodes = info->inode_blocks * INODES_PER_BLOCK;
-
-  info->dataregion_bitmap_start = 1;
-  info->inode_bitmap_start = 1 + info->dataregion_bitmap_blocks;
-
-  info->inode_blocks_start = 1 + info->dataregion_bitmap_blocks + info->inode_bitmap_blocks;
-  info->dataregion_blocks_start = 1 + info->dataregion_bitmap_blocks + info->inode_bitmap_blocks + info->inode_blocks;
-
-
-  return 0;
-
-}
-
-
-
-
-/*
-  Checks the status of a specific inode. Returns this value
-  
-
-  INPUT: The inode number to check
-  OUTPUT: The status (1 allocated, 0 unallocated)
-
-*/
-int check_inode_status(int inode_number){
-
-  int blk_number = inode_number/(BITS_PER_BLOCK); //Finds out in which block bit is
-  block_read(info.inode_bitmap_start + blk_number, buffer); //reads the block
-
-  int byte_offset = (inode_number - (BITS_PER_BLOCK * blk_number)) / BITS_PER_BYTE; //Finds how many bytes from begining that specific bit is
-  char * ptr = buffer + byte_offset; 
-  char data_bits = *ptr; //Obtains 8 bits in which desired bit is contained
-
-  int bit_offset = inode_number - (BITS_PER_BLOCK * blk_number) - (byte_offset * BITS_PER_BYTE); //where in the 8 bits the desired is lcoated
-  int bit = ZERO_INDEX_BITS - bit_offset; //counting offset from the MSB
-  
-
-  bit = (data_bits & ( 1 << bit )) >> bit; //Gets the required bit
-    
-  return bit;
-}
-
-
-/*
-  Sets the status of a specific inode. Returns this value
-  
-
-  INPUT: The inode number to set, the value to set it to
-  OUTPUT: The status (1 allocated, 0 unallocated)
-
-*/
-int set_inode_status(int inode_number, int status){
-
-  int blk_number = inode_number/(BITS_PER_BLOCK); //Finds out in which block bit is
-  block_read(info.inode_bitmap_start + blk_number, buffer); //reads the block
-
-  int byte_offset = (inode_number - (BITS_PER_BLOCK * blk_number)) / BITS_PER_BYTE;//Finds how many bytes from begining that specific bit is
-  char * ptr = buffer + byte_offset;
-  char data_bits = *ptr; //Obtains 8 bits in which desired bit is contained
-
-  int bit_offset = inode_number - (BITS_PER_BLOCK * blk_number) - (byte_offset * BITS_PER_BYTE); //where in the 8 bits the desired is lcoated
-  int bit = ZERO_INDEX_BITS - bit_offset;
-
-  data_bits ^= (-status ^ data_bits) & (1 << bit); //sets the required bit
-  *ptr = data_bits; //puts set of 8 bits back into buffer
-  block_write(info.inode_bitmap_start + blk_number, buffer); //writes block back to file
-  return 0;
-
-}
-
-
-
-/*
-  Checks the status of a specific inode. Returns this value
-  
-
-  INPUT: The inode number to check
-  OUTPUT: The status (1 allocated, 0 unallocated)
-
-*/
-int check_dataregion_status(int datablock_number){
-
-  int blk_number = datablock_number/(BITS_PER_BLOCK); //Finds out in which block bit is
-  block_read(info.dataregion_bitmap_start + blk_number, buffer);  //reads the block
-
-  int byte_offset = (datablock_number - (BITS_PER_BLOCK * blk_number)) / BITS_PER_BYTE; //Finds how many bytes from begining that specific bit is
-  char * ptr = buffer + byte_offset; 
-  char data_bits = *ptr; //Obtains 8 bits in which desired bit is contained
-
-  int bit_offset = datablock_number - (BITS_PER_BLOCK * blk_number) - (byte_offset * BITS_PER_BYTE); //where in the 8 bits the desired is lcoated
-  int bit = ZERO_INDEX_BITS - bit_offset; //counting offset from the MSB
-  
-
-  bit = (data_bits & ( 1 << bit )) >> bit; //Gets the required bit
-    
-  return bit;
-}
-
-
-/*
-  Sets the status of a specific inode. Returns this value
-  
-
-  INPUT: The inode number to set, the value to set it to
-  OUTPUT: The status (1 allocated, 0 unallocated)
-
-*/
-int set_dataregion_status(int datablock_number, int status){
-
-  int blk_number = datablock_number/(BITS_PER_BLOCK); //Finds out in which block bit is
-  block_read(info.dataregion_bitmap_start + blk_number, buffer);  //reads the block
-
-  int byte_offset = (datablock_number - (BITS_PER_BLOCK * blk_number)) / BITS_PER_BYTE;//Finds how many bytes from begining that specific bit is
-  char * ptr = buffer + byte_offset;
-  char data_bits = *ptr; //Obtains 8 bits in which desired bit is contained
-
-  int bit_offset = datablock_number - (BITS_PER_BLOCK * blk_number) - (byte_offset * BITS_PER_BYTE); //where in the 8 bits the desired is lcoated
-  int bit = ZERO_INDEX_BITS - bit_offset;
-
-  data_bits ^= (-status ^ data_bits) & (1 << bit); //sets the required bit
-  *ptr = data_bits; //puts set of 8 bits back into buffer
-  block_write(info.dataregion_bitmap_start + blk_number, buffer); //writes block back to file
-  return 0;
-
-}
-
-/*
-  Gets a copy of the specified inode at returns it to the user
-
-  INPUT: The inode number that is requested
-  OUTPUT: A struct containing the inode
-
-*/
-
-inode get_inode(int inode_number){
-    
-  inode node;
-  int blk_number = inode_number / INODES_PER_BLOCK; // Finds which block to read
-  block_read(info.inode_blocks_start + blk_number, &entry_buffer); // Reads the block
-  
-  
-  int offset = inode_number - (INODES_PER_BLOCK * blk_number);
-  node = (entry_buffer.list[offset]);
-  return node;
-  
-}
-
-/*
-  Sets a certain inode in the metadata region
-
-  INPUT: The inode number to write to, the inode itself
+  INPUT: The mount's state
   OUTPUT: none
 
 */
-void set_inode(int inode_number, inode node){
-
-  int blk_number = inode_number / INODES_PER_BLOCK; // Finds which block to read
-  block_read(info.inode_blocks_start + blk_number, &entry_buffer); // Reads the block
-  
-  
-  int offset = inode_number - (INODES_PER_BLOCK * blk_number);
-  entry_buffer.list[offset] = node;
-  block_write(info.inode_blocks_start + blk_number, &entry_buffer);
-  
+static void register_tunables(struct sfs_state *state){
+  struct tunable t[] = {
+    { "log_level", &log_level, LOG_ERROR, LOG_TRACE, 0, log_level_parse, NULL },
+    { "log_flush_ms", &log_flush_ms, 1, 10000, 0, NULL, NULL },
+    { "journal_commit_ms", &journal_commit_ms, 1, 60000, 0, NULL, NULL },
+    { "delalloc_kb", &delalloc_kb, 0, INT_MAX, 0, NULL, NULL },
+    { "delalloc_ms", &delalloc_ms, 1, 60000, 0, NULL, NULL },
+    { "prealloc_kb", &prealloc_kb, 0, 1048576, 0, NULL, NULL },
+    { "keep_cache", &state->keep_cache, 0, 1, 0, NULL, NULL },
+    { "trace", &trace_active, 0, 1, !state->trace, NULL, NULL },
+    { "cache_timeout", &state->cache_timeout, 0, INT_MAX, 1, NULL, NULL },
+    { "workers", &state->workers, 0, INT_MAX, 1, NULL, NULL },
+  };
+  unsigned i;
+
+  for (i = 0; i < sizeof(t) / sizeof(t[0]); i++) {
+    tunable_register(&t[i]);
+  }
 }
 
 /*
-  Gets the number of directories in a file path
-
-  INPUT: The file path
-  OUTPUT: the number of different portions of the filepath
-
+  The statistics files.  SFS_STATS_PATH and SFS_STATS_JSON_PATH are
+  not in any directory and have no inode; getattr makes them up, open
+  renders a snapshot of the statistics that reads are served from,
+  and release throws it away.  Nothing here touches the disk image.
 */
-
-int get_num_dirs(const char * filepath){
-  int length = strlen(filepath);
-  char slash = 47;
-  int i, count;
-  count = 0;
-  for (i = 0; i < length; i++){
-    if (filepath[i] == slash)
-      count++;
-  }
-  return count;
-}
+struct stats_snapshot {
+  size_t length;
+  char *text;
+};
 
 /*
-  Get each file path returned as a char *
+  Tells whether a path names one of the statistics files
 
-  INPUT: The file path
-  OUTPUT: A char ** that points to each string in the filepath
+  INPUT: The path
+  OUTPUT: 1 for the text file, 2 for the JSON one, 0 otherwise
 
 */
-
-
-char ** parsePath(const char * filepath){
-
-  int length = strlen(filepath);
-  int i, count;
-  char slash = 47;
-  count = 0;
-
-  //Figures out how many "/" are present -- stores in count
-  for (i = 0; i < length; i++){
-    if (filepath[i] == slash)
-      count++;
+static int stats_file(const char *path){
+  if (strcmp(path, SFS_STATS_PATH) == 0) {
+    return 1;
   }
-  
-
-  int * indices = (int * ) malloc ((count + 1) * sizeof(int)); //stores the index of each slash
-  int j = 0;
-  for (i = 0; i < length; i++){
-
-    if (filepath[i] == slash){
-      indices[j] = i;
-      j++;
-    }
-
-    
+  if (strcmp(path, SFS_STATS_JSON_PATH) == 0) {
+    return 2;
   }
-  indices[count] = length; 
-
-  char ** strings = (char **) malloc(count * sizeof(char *)); //MUST FREE THIS LATER
-
-  for (i = 0; i < count; i++){
-    int size = (indices[i + 1] - indices[i]);
-    strings[i] = (char *) malloc(sizeof(char) * size);
-    strncpy(strings[i], (filepath + indices[i] + 1), (size - 1));
-    
-  }
-  free(indices);
-  
-  return strings;
-
+  return 0;
 }
 
 /*
-  Finds the inode based on a filepath
+  Renders the statistics for an open of a statistics file
 
-  INPUT: The file path
-  OUTPUT: An integer representing a inode
+  INPUT: Which file (from stats_file), the open's fuse_file_info
+  OUTPUT: 0 on success, -errno otherwise
 
 */
-int findInode(const char *path) {
-
-  super_block sblock;
-  block_read(0, &sblock);
-  int dataRegionOffset = sblock.list[0].dataregion_blocks_start;
-  filepath_block rblock;
-  block_read(dataRegionOffset, &rblock);
-  int inodeNum = rblock.inode;
-  int inodeBlock = inodeNum/8;
-  if (inodeNum%8 != 0) {
-    inodeBlock++;
+static int stats_open(int which, struct fuse_file_info *fi){
+  struct stats_snapshot *snap;
+  struct libsfs_statfs st;
+  struct stats_fs sfs;
+
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    return -EACCES;
   }
-  int inodeOffset = inodeNum - (inodeBlock - 1)*8;
-  int numOfDirs = get_num_dirs(path);
-  char ** fldrs = parsePath(filepath);
-  inode_block iblock;
-  filepath_block fblock;
-  int i, j, gotem;
-  inode node;
-  // go through each inode of each folder in the path to find the inode for the filepath
-  for (i = 0; i < numOfDirs; i++) {
-    block_read(inodeBlock, &iblock);
-    node = iblock.list[inodeOffset];
-    gotem = 0;
-    // check each direct_ptr in inode until the correct folder is found
-    for (j = 0; j < 12; j++) {
-      block_read(node.direct_ptrs[j], &fblock);
-      int fcheck = 0;
-      int l = 0;
-      while (fldrs[i][l]) {
-        if (fblock.filepath[l] != fldrs[i][l]) {
-          fcheck = 1;
-        }
-        l++;
-      }
-      if (fcheck == 0) {
-        gotem = 1;
-        break;
-      }
-    }
-    if (gotem == 1) {
-      inodeNum = fblock.inode;
-      if (i == numOfDirs - 1) {
-        break;
-      }
-      inodeBlock = inodeNum/8;
-      if (inodeNum%8 != 0) {
-        inodeBlock++;
-      }
-      inodeOffset = inodeNum - (inodeBlock - 1)*8;
-    }
-    else {
-      // do indirect ptr stuff
-      int k;
-      for (k = 0; k < numOfDirs; k++) {
-        free(fldrs[k]);
-      }
-      return -1;
-    }
+  libsfs_statfs(fs, &st);
+  sfs.uptime = time(NULL) - mounted;
+  sfs.block_size = st.block_size;
+  sfs.data_blocks = st.data_blocks;
+  sfs.free_data_blocks = st.free_data_blocks;
+  sfs.inodes = st.inodes;
+  sfs.free_inodes = st.free_inodes;
+  sfs.icache_used = st.icache_used;
+  sfs.icache_size = st.icache_size;
+
+  snap = malloc(sizeof(struct stats_snapshot));
+  if (snap == NULL) {
+    return -ENOMEM;
   }
-  for (i = 0; i < numOfDirs; i++) {
-    free(fldrs[i]);
+  snap->text = stats_render(&sfs, which == 2, &snap->length);
+  if (snap->text == NULL) {
+    free(snap);
+    return -ENOMEM;
   }
-  return inodeNum;
+  // the size getattr reported is made up, so read until EOF
+  fi->fh = (uint64_t) (uintptr_t) snap;
+  fi->direct_io = 1;
+  fi->keep_cache = 0;
+  return 0;
 }
 
-/*
-  Finds the filepath block based on a path
-
-  INPUT: The file path
-  OUTPUT: An integer representing a inode
+/* Write the operation counts and latencies gathered since mount to the log */
+static void log_stats()
+{
+    struct stats *total;
+    int i;
 
-*/
-int findFilepathBlock(const char *path) {
-
-  super_block sblock;
-  block_read(0, &sblock);
-  int dataRegionOffset = sblock.list[0].dataregion_blocks_start;
-  filepath_block rblock;
-  block_read(dataRegionOffset, &rblock);
-  int inodeNum = rblock.inode;
-  int inodeBlock = inodeNum/8;
-  if (inodeNum%8 != 0) {
-    inodeBlock++;
-  }
-  int inodeOffset = inodeNum - (inodeBlock - 1)*8;
-  int numOfDirs = get_num_dirs(path);
-  char ** fldrs = parsePath(filepath);
-  inode_block iblock;
-  filepath_block fblock;
-  int i, j, gotem, fblockNum;
-  inode node;
-  // go through each inode of each folder in the path to find the inode for the filepath
-  for (i = 0; i < numOfDirs; i++) {
-    block_read(inodeBlock, &iblock);
-    node = iblock.list[inodeOffset];
-    gotem = 0;
-    // check each direct_ptr in inode until the correct folder is found
-    for (j = 0; j < 12; j++) {
-      block_read(node.direct_ptrs[j], &fblock);
-      int fcheck = 0;
-      int l = 0;
-      while (fldrs[i][l]) {
-        if (fblock.filepath[l] != fldrs[i][l]) {
-          fcheck = 1;
-        }
-        l++;
-      }
-      if (fcheck == 0) {
-        gotem = 1;
-        break;
-      }
-    }
-    if (gotem == 1) {
-      inodeNum = fblock.inode;
-      if (i == numOfDirs - 1) {
-        break;
-      }
-      inodeBlock = inodeNum/8;
-      if (inodeNum%8 != 0) {
-        inodeBlock++;
-      }
-      inodeOffset = inodeNum - (inodeBlock - 1)*8;
+    if (!log_enabled(LOG_INFO))
+      return;
+    total = malloc(sizeof(struct stats));
+    if (total == NULL)
+      return;
+    stats_merge(total);
+    for (i = 1; i < TRACE_NOPS; i++) {
+      struct stats_op *op = &total->ops[i];
+      if (op->calls == 0)
+        continue;
+      log_info("    %s: calls %llu errors %llu bytes %llu p50 %lluns p99 %lluns\n",
+               trace_op_name(i), (unsigned long long) op->calls,
+               (unsigned long long) op->errors, (unsigned long long) op->bytes,
+               (unsigned long long) stats_percentile(op, 50),
+               (unsigned long long) stats_percentile(op, 99));
     }
-    else {
-      // do indirect ptr stuff
+    for (i = 0; i < STATS_NCOUNTERS; i++) {
+      log_info("    %s: %llu\n", stats_counter_name(i),
+               (unsigned long long) total->counters[i]);
     }
-  }
-  for (i = 0; i < numOfDirs; i++) {
-    free(fldrs[i]);
-  }
-  return fblockNum;
-}
-
-int find_free_datablock(){
-  int i;
-  int totalDatablocks = info.dataregion_blocks;
-  for (i = 0; i < totalDatablocks; i++){
-    if (check_dataregion_status(i) == 0)
-      return i;
-    
-  }
-
-  return -1;
-}
-
-int find_free_inode(){
-  int i;
-  int totalInodes = info.total_inodes;
-  for (i = 0; i < totalInodes; i++){
-    if (check_inode_status(i) == 0)
-      return i;
-    
-  }
-
-  return -1;
+    free(total);
 }
 
 ///////////////////////////////////////////////////////////
@@ -497,72 +189,28 @@ int find_free_inode(){
  */
 void *sfs_init(struct fuse_conn_info *conn)
 {
+    // fuse_main has forked into the background by now, so this is
+    // the earliest the log writer thread can be started
+    log_start();
+    // and the ones libsfs runs in the background
+    if (libsfs_start(fs) != 0)
+      log_error("sfs_init: can't start background work, the inode table is zeroed as it is used\n");
 
-    inode node;
-    inode_block block;
-    super_block sblock;
-    int count;
-
-    filepath = SFS_DATA->diskfile;
-    disk_open(filepath); //opens the disk
-    count = 0;
-
-
-    //clearing all fields for the node
-    int i;  
-    node.size = 0;
-    node.indirect_ptr = 0;
-    node.test = 0;
-    node.flags = 0;
-
-    for(i = 0; i < 12; i++){
-
-      node.direct_ptrs[i] = 0;
-    }
-
-  //clearing all fields for the inode_entry
-    for(i = 0; i < 8; i++){
-      
-      block.list[i] = node;
-
-    }
-    int jjj = NAME_MAX;
-    log_msg("\n The value of name max is %d", jjj);
-
-    fstat(diskfile, &s); //get file information
-    get_metadata_info(s.st_size, &info); //gets all the metadata info
-
-    sblock.list[0] = info; //setting the superblock
+    mounted = time(NULL);
 
-    printf("Writing the superblock\n");
-    block_write(count, &sblock);
-    count++;
-
-    printf("Writing the data bitmap\n");
-    for (i = 0; i < info.dataregion_bitmap_blocks; i++){
-      block_write(count, buffer);
-      count++;
-    }
-
-    printf("Writing the inode bitmap\n");
-    for (i = 0; i < info.inode_bitmap_blocks; i++){
-      block_write(count, buffer);
-      count++;
-    } 
-
-    printf("Writing the inode blocks\n");
-    for (i = 0; i < info.inode_blocks; i++){
-      block_write(count, &block);
-      count++;
-    }
-
-    
+    register_tunables(SFS_DATA);
 
     fprintf(stderr, "in bb-init\n");
-    log_msg("\nsfs_init()\n");
+    log_info("\nsfs_init()\n");
+
+    // Take the largest requests the kernel will send in one go
+    if (conn->capable & FUSE_CAP_BIG_WRITES)
+      conn->want |= FUSE_CAP_BIG_WRITES;
     
-    log_conn(conn);
-    log_fuse_context(fuse_get_context());
+    if (log_enabled(LOG_DEBUG)) {
+	log_conn(conn);
+	log_fuse_context(fuse_get_context());
+    }
 
     //sfs_create("/.Trash", S_IRWXU, NULL);
 
@@ -578,8 +226,13 @@ void *sfs_init(struct fuse_conn_info *conn)
  */
 void sfs_destroy(void *userdata)
 {
-    log_msg("\nsfs_destroy(userdata=0x%08x)\n", userdata);
-    disk_close();
+    log_info("\nsfs_destroy(userdata=0x%08x)\n", userdata);
+    log_stats();
+    tunables_clear();
+    libsfs_close(fs);
+    fs = NULL;
+    trace_close();
+    log_close();
 }
 
 /** Get file attributes.
@@ -590,32 +243,32 @@ void sfs_destroy(void *userdata)
  */
 int sfs_getattr(const char *path, struct stat *statbuf)
 {
-    int retstat = 0;
-    char slash = 47;
-    char fpath[PATH_MAX];
+    struct libsfs_attr attr;
+    int retstat;
     
-    log_msg("\nsfs_getattr(path=\"%s\", statbuf=0x%08x)\n",
+    log_trace("\nsfs_getattr(path=\"%s\", statbuf=0x%08x)\n",
     path, statbuf);
 
     memset(statbuf, 0, sizeof(struct stat)); // initialize buffer
-    statbuf->st_dev = 0;
-    statbuf->st_blksize = 0;
-    statbuf->st_ino = 0;
-    memset(&fpath, '?', PATH_MAX);  // initialize fpath before copying path into it so the final character can be found
-    int i = 0;
-    while (path[i]) {
-      fpath[i] = path[i];
-      i++;
+
+    if (stats_file(path)) {
+      statbuf->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+      statbuf->st_nlink = 1;
+      statbuf->st_uid = getuid();
+      statbuf->st_gid = getgid();
+      statbuf->st_blksize = BLOCK_SIZE;
+      statbuf->st_atime = statbuf->st_mtime = statbuf->st_ctime = time(NULL);
+      return 0;
     }
-    char finalChar;
-    for (i = 0; i < PATH_MAX; i++) {
-      if (fpath[i] == '?') {
-        finalChar = fpath[i - 1];
-        break;
-      }
+
+    // A missing file is answered with ENOENT, which the kernel caches
+    // for negative_timeout seconds like any other entry
+    retstat = libsfs_getattr(fs, path, &attr);
+    if (retstat != 0) {
+      return retstat;
     }
 
-    if (finalChar == slash) {
+    if (attr.is_dir) {
       statbuf->st_mode = S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
       statbuf->st_nlink = 2;
     }
@@ -624,28 +277,23 @@ int sfs_getattr(const char *path, struct stat *statbuf)
       statbuf->st_nlink = 1;
     }
 
+    statbuf->st_ino = attr.ino;
     statbuf->st_uid = getuid();
     statbuf->st_gid = getgid();
     statbuf->st_rdev = 0;
-    super_block sblock;
-    block_read(0, &sblock);
-    int inodeNum = findInode(path);
-    int inodeBlockOffset = sblock.list[0].inode_blocks_start;
-    int inodeBlock = inodeNum/8;
-    int inodeOffset = inodeNum - inodeBlock*8;
-    inode_block iblock;
-    block_read(inodeBlockOffset + inodeBlock, &iblock);
-    statbuf->st_size = iblock.list[inodeOffset].size;
+    statbuf->st_blksize = BLOCK_SIZE;
+    statbuf->st_size = attr.size;
     statbuf->st_blocks = statbuf->st_size/BLOCK_SIZE;
-    if (statbuf->st_size%8 != 0) {
+    if (statbuf->st_size%BLOCK_SIZE != 0) {
       statbuf->st_blocks += 1;
     }
-    /*
-    statbuf->st_atime = time(NULL);
-    statbuf->st_mtime = time(NULL);
-    statbuf->st_ctime = time(NULL);
-    */
-    return retstat;
+    // the kernel compares mtime and size to decide whether cached
+    // attributes and pages still describe the file
+    statbuf->st_atime = attr.mtime;
+    statbuf->st_mtime = attr.mtime;
+    statbuf->st_ctime = attr.mtime;
+
+    return 0;
 }
 
 /**
@@ -663,49 +311,17 @@ int sfs_getattr(const char *path, struct stat *statbuf)
 int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
     int retstat = 0;
-    log_msg("\nsfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n",
+    log_trace("\nsfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n",
       path, mode, fi);
-    
-    super_block sblock;
-    block_read(0, &sblock);
-    int totalInodes = sblock.list[0].total_inodes;
-    int totalDatablocks = sblock.list[0].dataregion_blocks;
-    int inodeNum = findInode(path);
-    // file does not exist
-    if (inodeNum == -1) {
-      int i, inodeStatus, datablockStatus;
-      inode node;
-      filepath_block fblock;
-      // find available inode
-      for (i = 0; i < totalInodes; i++) {
-        inodeStatus = check_inode_status(i);
-        // inode is available
-        if (!inodeStatus) {
-          set_inode_status(i, 1);
-          node.size = 0;
-          set_inode(i, node);
-          inodeNum = i;
-          break;
-        }
-      }
-      // find available datablock
-      for (i = 0; i < totalDatablocks; i++) {
-        datablockStatus = check_dataregion_status(i);
-        if(!datablockStatus) {
-          int datablockOffset = sblock.list[0].dataregion_blocks_start + i;
-          int numOfDirs = get_num_dirs(path);
-          char ** fldrs = parsePath(path);
-          int j = 0;
-          while (fldrs[numOfDirs - 1][j]) {
-            fblock.filepath[j] = fldrs[numOfDirs - 1][j];
-          }
-          fblock.inode = inodeNum;
-          block_write(datablockOffset + i, &fblock);
-          break;
-        }
-      }
+
+    if (stats_file(path)) {
+      return -EEXIST;
+    }
+    retstat = libsfs_create(fs, path);
+    if (retstat != 0) {
+      return retstat;
     }
-    sfs_open(path, fi);
+    retstat = sfs_open(path, fi);
     
     return retstat;
 }
@@ -713,22 +329,13 @@ int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 /** Remove a file */
 int sfs_unlink(const char *path)
 {
-    int retstat = 0;
-    log_msg("sfs_unlink(path=\"%s\")\n", path);
-
-    int inodeNum = findInode(path);
-    int fblockNum = findFilepathBlock(path);
-    inode node = get_inode(inodeNum);
-    int i, direct_ptr;
-    for (i = 0; i < 12; i++) {
-      if (node.direct_ptrs[i] != 0) {
-        set_dataregion_status(node.direct_ptrs[i], 0);
-      }
+    log_trace("sfs_unlink(path=\"%s\")\n", path);
+
+    if (stats_file(path)) {
+      return -EPERM;
     }
-    set_dataregion_status(fblockNum, 0);
-    set_inode_status(inodeNum, 0);
-    
-    return retstat;
+
+    return libsfs_unlink(fs, path);
 }
 
 /** File open operation
@@ -743,16 +350,24 @@ int sfs_unlink(const char *path)
  */
 int sfs_open(const char *path, struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    log_msg("\nsfs_open(path\"%s\", fi=0x%08x)\n",
+    int keep;
+    int retstat;
+    log_trace("\nsfs_open(path=\"%s\", fi=0x%08x)\n",
       path, fi);
 
-    int inodeNum = findInode(path);
-    log_msg("\n The inode number is %d", inodeNum);
-    if (inodeNum == -1) {
-      //fi->flags = fi->flags | O_CREAT;
-      sfs_create(path, S_IRWXU, fi);
-      return ENOENT;
+    int which = stats_file(path);
+    if (which) {
+      return stats_open(which, fi);
+    }
+
+    // Pages the kernel cached on an earlier open are still good
+    // unless the file was changed since then
+    if (__atomic_load_n(&SFS_DATA->keep_cache, __ATOMIC_RELAXED)) {
+      retstat = libsfs_open_file(fs, path, &keep);
+      fi->keep_cache = keep;
+    }
+    else {
+      retstat = libsfs_open_file(fs, path, NULL);
     }
     
     return retstat;
@@ -775,13 +390,42 @@ int sfs_open(const char *path, struct fuse_file_info *fi)
 int sfs_release(const char *path, struct fuse_file_info *fi)
 {
     int retstat = 0;
-    log_msg("\nsfs_release(path=\"%s\", fi=0x%08x)\n",
+    log_trace("\nsfs_release(path=\"%s\", fi=0x%08x)\n",
 	  path, fi);
-    
+
+    if (stats_file(path) && fi->fh != 0) {
+      struct stats_snapshot *snap = (struct stats_snapshot *) (uintptr_t) fi->fh;
+      free(snap->text);
+      free(snap);
+      fi->fh = 0;
+    }
+    else if (!stats_file(path)) {
+      libsfs_release(fs, path);
+    }
 
     return retstat;
 }
 
+/** Synchronize file contents
+ *
+ * If the datasync parameter is non-zero, then only the user data
+ * should be flushed, not the meta data.  sfs keeps the size with the
+ * meta data, so it flushes both either way (libsfs_fsync).
+ *
+ * Changed in version 2.2
+ */
+int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    log_trace("\nsfs_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n",
+	    path, datasync, fi);
+
+    if (stats_file(path)) {
+      return 0;
+    }
+
+    return libsfs_fsync(fs, path, datasync);
+}
+
 /** Read data from an open file
  *
  * Read should return exactly the number of bytes requested except
@@ -795,55 +439,22 @@ int sfs_release(const char *path, struct fuse_file_info *fi)
  */
 int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    log_msg("\nsfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
+    log_trace("\nsfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
       path, buf, size, offset, fi);
 
-    int inodeNum = findInode(path);
-    inode node = get_inode(inodeNum);
-    int fileSize = node.size;
-    if (offset >= fileSize) {
-      return 0;
-    }
-    if (offset + size > fileSize) {
-      size = fileSize - offset;
-    }
-    int readBlockNum = offset/BLOCK_SIZE;
-    if (offset%BLOCK_SIZE != 0) {
-      readBlockNum++;
-    }
-    int readOffset = offset%BLOCK_SIZE;
-    int numOfBlocksNeeded = 1;
-    if (size > BLOCK_SIZE - readOffset) {
-      numOfBlocksNeeded = (size + readOffset)/BLOCK_SIZE;
-      if ((size + readOffset)%BLOCK_SIZE != 0) {
-        numOfBlocksNeeded++;
-      }
-    }
-    char buffer[BLOCK_SIZE];
-    int unreadSize = size;
-    int i;
-    for (i = 0; i < numOfBlocksNeeded; i++) {
-      block_read(node.direct_ptrs[readBlockNum + i], &buffer);
-      if (size <= BLOCK_SIZE - readOffset) {
-        int j;
-        for (j = readOffset; j < readOffset + unreadSize; j++) {
-          buf[j - readOffset] = buffer[j];
-        }
-        unreadSize = 0;
+    if (stats_file(path)) {
+      struct stats_snapshot *snap = (struct stats_snapshot *) (uintptr_t) fi->fh;
+      if (snap == NULL || offset >= snap->length) {
+        return 0;
       }
-      else {
-        int j;
-        for (j = readOffset; j < BLOCK_SIZE; j++) {
-          buf[size - unreadSize + j - readOffset] = buffer[j];
-        }
-        unreadSize -= (BLOCK_SIZE - readOffset);
+      if (offset + size > snap->length) {
+        size = snap->length - offset;
       }
+      memcpy(buf, snap->text + offset, size);
+      return size;
     }
-    retstat = size;
 
-   
-    return retstat;
+    return libsfs_read(fs, path, buf, size, offset);
 }
 
 /** Write data to an open file
@@ -857,79 +468,49 @@ int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
 int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
 	     struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    log_msg("\nsfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
+    log_trace("\nsfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
       path, buf, size, offset, fi);
-    
-    if (offset >= 12*BLOCK_SIZE) {
-      return 0;
-    }
-    if (offset + size > 12*BLOCK_SIZE) {
-      size = 12*BLOCK_SIZE - offset;
-    }
-    int inodeNum = findInode(path);
-    inode node = get_inode(inodeNum);
-    int writeBlockNum = offset/BLOCK_SIZE;
-    if (offset%BLOCK_SIZE != 0) {
-      writeBlockNum++;
-    }
-    int writeOffset = offset%BLOCK_SIZE;
-    int currentNumOfBlocks = 0;
-    int i;
-    int numOfBlocksNeeded = 1;
-    for (i = 0; i < 12; i++) {
-      if (node.direct_ptrs[i] != 0) {
-        currentNumOfBlocks++;
-      }
-    }
-    if (currentNumOfBlocks < writeBlockNum) {
-      while (currentNumOfBlocks != writeBlockNum) {
-        currentNumOfBlocks++;
-        node.direct_ptrs[currentNumOfBlocks] = find_free_datablock();
-        set_dataregion_status(node.direct_ptrs[currentNumOfBlocks], 1);
-      }
-    }
-    if (size > BLOCK_SIZE - writeOffset) {
-      numOfBlocksNeeded = (size + writeOffset)/BLOCK_SIZE;
-      if ((size + writeOffset)%BLOCK_SIZE != 0) {
-        numOfBlocksNeeded++;
-      }
-      for (i = 0; i < numOfBlocksNeeded; i++) {
-        currentNumOfBlocks++;
-        node.direct_ptrs[currentNumOfBlocks] = find_free_datablock();
-        set_dataregion_status(node.direct_ptrs[currentNumOfBlocks], 1);
-      }
-    }
-    node.size = (currentNumOfBlocks - 1)*BLOCK_SIZE;
-    if (size%BLOCK_SIZE != 0) {
-      node.size += size%BLOCK_SIZE;
+
+    if (stats_file(path)) {
+      return -EACCES;
     }
-    else {
-      node.size += BLOCK_SIZE;
+
+    return libsfs_write(fs, path, buf, size, offset);
+}
+
+/** Change the size of a file */
+int sfs_truncate(const char *path, off_t newsize)
+{
+    log_trace("\nsfs_truncate(path=\"%s\", newsize=%lld)\n",
+	    path, newsize);
+
+    if (stats_file(path)) {
+      return -EACCES;
     }
-    char buffer[BLOCK_SIZE];
-    int unwrittenSize = size;
-    for (i = 0; i < numOfBlocksNeeded; i++) {
-      block_read(node.direct_ptrs[writeBlockNum + i], &buffer);
-      if (size <= BLOCK_SIZE - writeOffset) {
-        int j;
-        for (j = writeOffset; j < writeOffset + unwrittenSize; j++) {
-          buffer[j] = buf[j - writeOffset];
-        }
-        unwrittenSize = 0;
-      }
-      else {
-        int j;
-        for (j = writeOffset; j < BLOCK_SIZE; j++) {
-          buffer[j] = buf[size - unwrittenSize + j - writeOffset];
-        }
-        unwrittenSize -= (BLOCK_SIZE - writeOffset);
-      }
-      block_write(node.direct_ptrs[writeBlockNum + i], &buffer);
+
+    return libsfs_truncate(fs, path, newsize);
+}
+
+/** Change the size of an open file */
+int sfs_ftruncate(const char *path, off_t newsize, struct fuse_file_info *fi)
+{
+    log_trace("\nsfs_ftruncate(path=\"%s\", newsize=%lld, fi=0x%08x)\n",
+	    path, newsize, fi);
+
+    return sfs_truncate(path, newsize);
+}
+
+/** Change the access and modification times of a file */
+int sfs_utimens(const char *path, const struct timespec tv[2])
+{
+    log_trace("\nsfs_utimens(path=\"%s\", tv=0x%08x)\n",
+	    path, tv);
+
+    if (stats_file(path)) {
+      return -EACCES;
     }
-    retstat = size;
-    
-    return retstat;
+
+    return libsfs_utimens(fs, path, tv[1].tv_sec);
 }
 
 
@@ -937,7 +518,7 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
 int sfs_mkdir(const char *path, mode_t mode)
 {
     int retstat = 0;
-    log_msg("\nsfs_mkdir(path=\"%s\", mode=0%3o)\n",
+    log_trace("\nsfs_mkdir(path=\"%s\", mode=0%3o)\n",
 	    path, mode);
    
     
@@ -949,7 +530,7 @@ int sfs_mkdir(const char *path, mode_t mode)
 int sfs_rmdir(const char *path)
 {
     int retstat = 0;
-    log_msg("sfs_rmdir(path=\"%s\")\n",
+    log_trace("sfs_rmdir(path=\"%s\")\n",
 	    path);
     
     
@@ -967,13 +548,24 @@ int sfs_rmdir(const char *path)
 int sfs_opendir(const char *path, struct fuse_file_info *fi)
 {
     int retstat = 0;
-    log_msg("\nsfs_opendir(path=\"%s\", fi=0x%08x)\n",
+    log_trace("\nsfs_opendir(path=\"%s\", fi=0x%08x)\n",
 	  path, fi);
     
     
     return retstat;
 }
 
+// Hands the entries libsfs_readdir finds to FUSE's filler
+struct readdir_ctx {
+  void *buf;
+  fuse_fill_dir_t filler;
+};
+
+static int readdir_fill(void *ctx, const char *name){
+  struct readdir_ctx *c = ctx;
+  return c->filler(c->buf, name, NULL, 0);
+}
+
 /** Read directory
  *
  * This supersedes the old getdir() interface.  New applications
@@ -998,22 +590,11 @@ int sfs_opendir(const char *path, struct fuse_file_info *fi)
 int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 	       struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    log_msg("\n entering readdir \n");
-    int pathInodeNum = findInode(path);
-    inode pathInode = get_inode(pathInodeNum);
-    int i = 0;
-    directory_block dblock;
-    int fillerReturn;
-    while (pathInode.direct_ptrs[i]) {
-      block_read(pathInode.direct_ptrs[i], &dblock);
-      fillerReturn = filler(buf, dblock.list[0].d_name, NULL, sizeof(struct dirent));
-      if (fillerReturn != 0) {
-        return retstat;
-      }
-    }
-    
-    return retstat;
+    struct readdir_ctx ctx = { buf, filler };
+    log_trace("\nsfs_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n",
+	    path, buf, filler, offset, fi);
+
+    return libsfs_readdir(fs, path, readdir_fill, &ctx);
 }
 
 /** Release directory
@@ -1028,32 +609,373 @@ int sfs_releasedir(const char *path, struct fuse_file_info *fi)
     return retstat;
 }
 
+/** Synchronize directory contents
+ *
+ * Its entries are made durable with the directory itself.
+ *
+ * Introduced in version 2.3
+ */
+int sfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    log_trace("\nsfs_fsyncdir(path=\"%s\", datasync=%d, fi=0x%08x)\n",
+	    path, datasync, fi);
+
+    return libsfs_fsync(fs, path, datasync);
+}
+
+/*
+  The image size, on the root directory beside the tunables.  Reading
+  it gives the size in bytes; setting it to a bigger one (a number of
+  bytes, or with a K, M or G suffix) grows the image there and then,
+  see libsfs_grow.  It isn't a tunable, since it doesn't fit an int
+  and setting it is an operation rather than a setting.
+*/
+#define SFS_SIZE_XATTR TUNABLE_PREFIX "size"
+
+/*
+  Grows the image to the size a setxattr of SFS_SIZE_XATTR asks for
+
+  INPUT: The attribute value, not NUL terminated, and its length
+  OUTPUT: 0 on success, -EINVAL if it isn't a size, or what libsfs_grow returns
+
+*/
+static int set_size_xattr(const char *value, size_t size){
+  char text[32], *end;
+  long long n;
+
+  if (size == 0 || size >= sizeof(text)) {
+    return -EINVAL;
+  }
+  memcpy(text, value, size);
+  text[size] = '\0';
+  n = strtoll(text, &end, 10);
+  if (end == text || n <= 0) {
+    return -EINVAL;
+  }
+  switch (*end) {
+  case 'G': case 'g':
+    n *= 1024;
+    // fall through
+  case 'M': case 'm':
+    n *= 1024;
+    // fall through
+  case 'K': case 'k':
+    n *= 1024;
+    end++;
+  }
+  // tolerate the newline echo leaves on
+  if (*end == '\n') {
+    end++;
+  }
+  if (*end != '\0') {
+    return -EINVAL;
+  }
+
+  return libsfs_grow(fs, (off_t) n);
+}
+
+/** Set extended attributes
+ *
+ * Only the root directory has any: the tunables, named user.sfs.*
+ * (see tunables.c), and SFS_SIZE_XATTR.  Setting one changes the
+ * running filesystem.
+ */
+int sfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+    log_trace("\nsfs_setxattr(path=\"%s\", name=\"%s\", size=%d, flags=0x%08x)\n",
+	    path, name, size, flags);
+
+    if (strcmp(path, "/") != 0) {
+      return -ENOTSUP;
+    }
+#ifdef XATTR_CREATE
+    // every tunable always exists
+    if (flags & XATTR_CREATE) {
+      return -EEXIST;
+    }
+#endif
+    if (strcmp(name, SFS_SIZE_XATTR) == 0) {
+      return set_size_xattr(value, size);
+    }
+    int retstat = tunable_set(name, value, size);
+    if (retstat == 0) {
+      log_info("tunable %s changed\n", name);
+    }
+
+    return retstat;
+}
+
+/** Get extended attributes */
+int sfs_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    log_trace("\nsfs_getxattr(path=\"%s\", name=\"%s\", size=%d)\n",
+	    path, name, size);
+
+    if (strcmp(path, "/") != 0) {
+      return -ENOTSUP;
+    }
+
+    if (strcmp(name, SFS_SIZE_XATTR) == 0) {
+      struct libsfs_statfs st;
+      char text[32];
+      int len;
+
+      libsfs_statfs(fs, &st);
+      len = snprintf(text, sizeof(text), "%lld", (long long) st.image_size);
+      if (size == 0) {
+        return len;
+      }
+      if (size < (size_t) len) {
+        return -ERANGE;
+      }
+      memcpy(value, text, len);
+      return len;
+    }
+
+    return tunable_get(name, value, size);
+}
+
+/** List extended attributes */
+int sfs_listxattr(const char *path, char *list, size_t size)
+{
+    log_trace("\nsfs_listxattr(path=\"%s\", size=%d)\n",
+	    path, size);
+
+    if (strcmp(path, "/") != 0) {
+      return 0;
+    }
+
+    int len = tunable_list(NULL, 0);
+    if (size == 0) {
+      return len + sizeof(SFS_SIZE_XATTR);
+    }
+    if (size < len + sizeof(SFS_SIZE_XATTR)) {
+      return -ERANGE;
+    }
+    tunable_list(list, size);
+    memcpy(list + len, SFS_SIZE_XATTR, sizeof(SFS_SIZE_XATTR));
+
+    return len + sizeof(SFS_SIZE_XATTR);
+}
+
+/*
+  Every operation in sfs_oper goes through one of these wrappers,
+  which time the real operation and count it (stats.c), and append a
+  record to the binary trace when -o trace is on.
+*/
+#define OP_CALL(op, offset, size, call)					\
+  do {									\
+    uint64_t start = trace_now();					\
+    libsfs_last_inode();						\
+    int ret = call;							\
+    uint64_t latency = trace_now() - start;				\
+    stats_op(op, ret, latency);						\
+    if (__atomic_load_n(&trace_active, __ATOMIC_RELAXED))		\
+      trace_record(op, libsfs_last_inode(), offset, size, ret, start, latency); \
+    return ret;								\
+  } while (0)
+
+static int traced_getattr(const char *path, struct stat *statbuf)
+{
+    OP_CALL(TRACE_GETATTR, 0, 0, sfs_getattr(path, statbuf));
+}
+
+static int traced_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    OP_CALL(TRACE_CREATE, 0, 0, sfs_create(path, mode, fi));
+}
+
+static int traced_unlink(const char *path)
+{
+    OP_CALL(TRACE_UNLINK, 0, 0, sfs_unlink(path));
+}
+
+static int traced_open(const char *path, struct fuse_file_info *fi)
+{
+    OP_CALL(TRACE_OPEN, 0, 0, sfs_open(path, fi));
+}
+
+static int traced_release(const char *path, struct fuse_file_info *fi)
+{
+    OP_CALL(TRACE_RELEASE, 0, 0, sfs_release(path, fi));
+}
+
+static int traced_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    OP_CALL(TRACE_FSYNC, 0, 0, sfs_fsync(path, datasync, fi));
+}
+
+static int traced_read(const char *path, char *buf, size_t size, off_t offset,
+		       struct fuse_file_info *fi)
+{
+    OP_CALL(TRACE_READ, offset, size, sfs_read(path, buf, size, offset, fi));
+}
+
+static int traced_write(const char *path, const char *buf, size_t size, off_t offset,
+			struct fuse_file_info *fi)
+{
+    OP_CALL(TRACE_WRITE, offset, size, sfs_write(path, buf, size, offset, fi));
+}
+
+static int traced_truncate(const char *path, off_t newsize)
+{
+    OP_CALL(TRACE_TRUNCATE, newsize, 0, sfs_truncate(path, newsize));
+}
+
+static int traced_ftruncate(const char *path, off_t newsize, struct fuse_file_info *fi)
+{
+    OP_CALL(TRACE_FTRUNCATE, newsize, 0, sfs_ftruncate(path, newsize, fi));
+}
+
+static int traced_utimens(const char *path, const struct timespec tv[2])
+{
+    OP_CALL(TRACE_UTIMENS, 0, 0, sfs_utimens(path, tv));
+}
+
+static int traced_mkdir(const char *path, mode_t mode)
+{
+    OP_CALL(TRACE_MKDIR, 0, 0, sfs_mkdir(path, mode));
+}
+
+static int traced_rmdir(const char *path)
+{
+    OP_CALL(TRACE_RMDIR, 0, 0, sfs_rmdir(path));
+}
+
+static int traced_opendir(const char *path, struct fuse_file_info *fi)
+{
+    OP_CALL(TRACE_OPENDIR, 0, 0, sfs_opendir(path, fi));
+}
+
+static int traced_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+			  struct fuse_file_info *fi)
+{
+    OP_CALL(TRACE_READDIR, offset, 0, sfs_readdir(path, buf, filler, offset, fi));
+}
+
+static int traced_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    OP_CALL(TRACE_FSYNCDIR, 0, 0, sfs_fsyncdir(path, datasync, fi));
+}
+
+static int traced_setxattr(const char *path, const char *name, const char *value,
+			   size_t size, int flags)
+{
+    OP_CALL(TRACE_SETXATTR, 0, size, sfs_setxattr(path, name, value, size, flags));
+}
+
+static int traced_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    OP_CALL(TRACE_GETXATTR, 0, size, sfs_getxattr(path, name, value, size));
+}
+
+static int traced_listxattr(const char *path, char *list, size_t size)
+{
+    OP_CALL(TRACE_LISTXATTR, 0, size, sfs_listxattr(path, list, size));
+}
+
 struct fuse_operations sfs_oper = {
   .init = sfs_init,
   .destroy = sfs_destroy,
 
-  .getattr = sfs_getattr,
-  .create = sfs_create,
-  .unlink = sfs_unlink,
-  .open = sfs_open,
-  .release = sfs_release,
-  .read = sfs_read,
-  .write = sfs_write,
-
-  .rmdir = sfs_rmdir,
-  .mkdir = sfs_mkdir,
-
-  .opendir = sfs_opendir,
-  .readdir = sfs_readdir,
-  .releasedir = sfs_releasedir
+  .getattr = traced_getattr,
+  .create = traced_create,
+  .unlink = traced_unlink,
+  .open = traced_open,
+  .release = traced_release,
+  .fsync = traced_fsync,
+  .read = traced_read,
+  .write = traced_write,
+  .truncate = traced_truncate,
+  .ftruncate = traced_ftruncate,
+  .utimens = traced_utimens,
+  .setxattr = traced_setxattr,
+  .getxattr = traced_getxattr,
+  .listxattr = traced_listxattr,
+
+  .rmdir = traced_rmdir,
+  .mkdir = traced_mkdir,
+
+  .opendir = traced_opendir,
+  .readdir = traced_readdir,
+  .releasedir = sfs_releasedir,
+  .fsyncdir = traced_fsyncdir
 };
 
 void sfs_usage()
 {
     fprintf(stderr, "usage:  sfs [FUSE and mount options] diskFile mountPoint\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "diskFile must have been formatted with mkfs.sfs\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "sfs options:\n");
+    fprintf(stderr, "    -o cache_timeout=N     entry/attr/negative timeout in seconds (default %d)\n", SFS_CACHE_TIMEOUT);
+    fprintf(stderr, "    -o nokeep_cache        drop cached file pages on every open\n");
+    fprintf(stderr, "    -o workers=N           run requests on a pool of N worker threads\n");
+    fprintf(stderr, "    -o log_level=LEVEL     error, warn, info, debug or trace (default info)\n");
+    fprintf(stderr, "    -o trace               record every operation in sfs.trace (see sfs-trace)\n");
+    fprintf(stderr, "    -o trace_records=N     keep the last N operations in the trace (default %d)\n",
+	    TRACE_DEFAULT_RECORDS);
     abort();
 }
 
+#define SFS_OPT(t, p, v) { t, offsetof(struct sfs_state, p), v }
+
+static struct fuse_opt sfs_opts[] = {
+    SFS_OPT("cache_timeout=%d", cache_timeout, 0),
+    SFS_OPT("nokeep_cache", keep_cache, 0),
+    SFS_OPT("workers=%d", workers, 0),
+    SFS_OPT("log_level=%s", log_level, 0),
+    SFS_OPT("trace", trace, 1),
+    SFS_OPT("trace_records=%d", trace_records, 0),
+    FUSE_OPT_END
+};
+
+static struct fuse *sfs_fuse;
+
+static void sfs_process_cmd(void *cmd)
+{
+    fuse_process_cmd(sfs_fuse, cmd);
+}
+
+/*
+  Runs the filesystem with requests handed to a pool of workers.
+
+  The main thread does nothing but read requests from the kernel and
+  queue them; each worker runs the operation and sends the reply when
+  it completes.  A read that has to go to the disk therefore only
+  ever ties up one worker, never the thread taking in new requests.
+
+  INPUT: The FUSE arguments, the sfs state
+  OUTPUT: 0 on success, 1 on failure (like fuse_main)
+*/
+static int sfs_main_async(struct fuse_args *args, struct sfs_state *sfs_data)
+{
+    char *mountpoint;
+    int multithreaded;
+
+    sfs_fuse = fuse_setup(args->argc, args->argv, &sfs_oper, sizeof(sfs_oper),
+			  &mountpoint, &multithreaded, sfs_data);
+    if (sfs_fuse == NULL)
+	return 1;
+    if (workq_start(sfs_data->workers) != 0) {
+	perror("workq_start");
+	fuse_teardown(sfs_fuse, mountpoint);
+	return 1;
+    }
+
+    while (!fuse_exited(sfs_fuse)) {
+	struct fuse_cmd *cmd = fuse_read_cmd(sfs_fuse);
+	if (cmd != NULL)
+	    workq_submit(sfs_process_cmd, cmd);
+    }
+
+    workq_stop();
+    fuse_teardown(sfs_fuse, mountpoint);
+
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int fuse_stat;
@@ -1074,13 +996,67 @@ int main(int argc, char *argv[])
     argv[argc-2] = argv[argc-1];
     argv[argc-1] = NULL;
     argc--;
+
+    // Pull out the sfs options, then put the cache timeouts and request
+    // sizes in front of whatever was given on the command line so an
+    // explicit -o attr_timeout=... or -o max_write=... still wins
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char cache_opts[128];
+    char io_opts[128];
+    sfs_data->cache_timeout = SFS_CACHE_TIMEOUT;
+    sfs_data->keep_cache = 1;
+    sfs_data->workers = 0;
+    sfs_data->log_level = NULL;
+    sfs_data->trace = 0;
+    sfs_data->trace_records = TRACE_DEFAULT_RECORDS;
+    if (fuse_opt_parse(&args, sfs_data, sfs_opts, NULL) == -1)
+	sfs_usage();
+    if (sfs_data->log_level != NULL) {
+	log_level = log_level_parse(sfs_data->log_level);
+	if (log_level < 0)
+	    sfs_usage();
+	if (log_level > SFS_LOG_LEVEL)
+	    fprintf(stderr, "log_level %s is compiled out, see configure --with-log-level\n",
+		    sfs_data->log_level);
+    }
+    snprintf(cache_opts, sizeof(cache_opts),
+	     "-oentry_timeout=%d,attr_timeout=%d,negative_timeout=%d",
+	     sfs_data->cache_timeout, sfs_data->cache_timeout, sfs_data->cache_timeout);
+    fuse_opt_insert_arg(&args, 1, cache_opts);
+    snprintf(io_opts, sizeof(io_opts), "-obig_writes,max_write=%d,max_readahead=%d",
+	     SFS_MAX_WRITE, SFS_MAX_WRITE);
+    fuse_opt_insert_arg(&args, 1, io_opts);
     
     sfs_data->logfile = log_open();
+    // like the log, the trace goes in the directory sfs was started from
+    if (sfs_data->trace) {
+	int err = sfs_data->trace_records > 0 ? trace_open("sfs.trace", sfs_data->trace_records) : -EINVAL;
+	if (err < 0) {
+	    fprintf(stderr, "sfs.trace: %s\n", strerror(-err));
+	    return EXIT_FAILURE;
+	}
+    }
+    
+    // open the image before mounting, so one that isn't usable is
+    // reported here rather than leaving a dead mount behind; the
+    // descriptor survives fuse_main forking into the background
+    int err = libsfs_open(sfs_data->diskfile, 0, &fs);
+    if (err != 0) {
+	fprintf(stderr, "%s: %s\n", sfs_data->diskfile,
+		err == -EINVAL ? "not an sfs image, or a different version (see mkfs.sfs)" : strerror(-err));
+	return EXIT_FAILURE;
+    }
     
     // turn over control to fuse
     fprintf(stderr, "about to call fuse_main, %s \n", sfs_data->diskfile);
-    fuse_stat = fuse_main(argc, argv, &sfs_oper, sfs_data);
+    if (sfs_data->workers > 0)
+	fuse_stat = sfs_main_async(&args, sfs_data);
+    else
+	fuse_stat = fuse_main(args.argc, args.argv, &sfs_oper, sfs_data);
     fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
+    // still open if the mount failed before sfs_destroy could run
+    libsfs_close(fs);
+    fuse_opt_free_args(&args);
     
     return fuse_stat;
 }
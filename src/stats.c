@@ -0,0 +1,326 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Operation counters and latency histograms.  Every thread counts into
+  its own struct stats, so recording costs a few uncontended stores and
+  no locks; stats_merge adds them up when somebody asks.  When a thread
+  exits its counts are folded into 'retired' so nothing is lost.
+*/
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+struct stats_thread {
+    struct stats s;
+    struct stats_thread *next;
+};
+
+static struct stats retired;
+static struct stats_thread *threads = NULL;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static __thread struct stats_thread *mine = NULL;
+
+static const char *counter_names[STATS_NCOUNTERS] = {
+    [STATS_BLOCK_READS] = "block_reads",
+    [STATS_BLOCKS_READ] = "blocks_read",
+    [STATS_BLOCK_WRITES] = "block_writes",
+    [STATS_BLOCKS_WRITTEN] = "blocks_written",
+    [STATS_BLOCKS_PUNCHED] = "blocks_punched",
+    [STATS_SYNCS] = "syncs",
+    [STATS_CACHE_HITS] = "cache_hits",
+    [STATS_CACHE_MISSES] = "cache_misses",
+    [STATS_JOURNAL_COMMITS] = "journal_commits",
+    [STATS_JOURNAL_BLOCKS] = "journal_blocks",
+    [STATS_DELALLOC_BLOCKS] = "delalloc_blocks",
+    [STATS_DELALLOC_DROPPED] = "delalloc_dropped",
+    [STATS_PREALLOC_BLOCKS] = "prealloc_blocks",
+    [STATS_PREALLOC_TRIMMED] = "prealloc_trimmed",
+};
+
+// Only the owning thread writes its counters, but stats_merge reads
+// them from another thread, so they go through relaxed atomics
+static inline void add(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static void stats_add(struct stats *total, struct stats *s)
+{
+    int op, i;
+
+    for (op = 0; op < TRACE_NOPS; op++) {
+	total->ops[op].calls += __atomic_load_n(&s->ops[op].calls, __ATOMIC_RELAXED);
+	total->ops[op].errors += __atomic_load_n(&s->ops[op].errors, __ATOMIC_RELAXED);
+	total->ops[op].bytes += __atomic_load_n(&s->ops[op].bytes, __ATOMIC_RELAXED);
+	for (i = 0; i < STATS_BUCKETS; i++)
+	    total->ops[op].latency[i] += __atomic_load_n(&s->ops[op].latency[i], __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < STATS_NCOUNTERS; i++)
+	total->counters[i] += __atomic_load_n(&s->counters[i], __ATOMIC_RELAXED);
+}
+
+static void thread_exit(void *arg)
+{
+    struct stats_thread *t = arg, **p;
+
+    pthread_mutex_lock(&threads_lock);
+    stats_add(&retired, &t->s);
+    for (p = &threads; *p != t; p = &(*p)->next)
+	;
+    *p = t->next;
+    pthread_mutex_unlock(&threads_lock);
+    free(t);
+}
+
+static void make_key()
+{
+    pthread_key_create(&thread_key, thread_exit);
+}
+
+static struct stats_thread *my_stats()
+{
+    if (mine != NULL)
+	return mine;
+
+    pthread_once(&thread_key_once, make_key);
+    mine = calloc(1, sizeof(struct stats_thread));
+    if (mine == NULL)
+	return NULL;
+    pthread_setspecific(thread_key, mine);
+    pthread_mutex_lock(&threads_lock);
+    mine->next = threads;
+    threads = mine;
+    pthread_mutex_unlock(&threads_lock);
+
+    return mine;
+}
+
+/* Histogram bucket a latency falls in
+ * INPUT: latency in ns
+ * OUTPUT: index into stats_op.latency
+ */
+static int bucket(uint64_t ns)
+{
+    int msb;
+
+    if (ns < STATS_SUB_BUCKETS)
+	return ns;
+    msb = 63 - __builtin_clzll(ns);
+    if (msb >= STATS_MAX_BITS)
+	return STATS_BUCKETS - 1;
+    return (msb - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS
+	+ ((ns >> (msb - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+}
+
+/* Smallest latency that falls in a bucket, the inverse of bucket() */
+static uint64_t bucket_floor(int i)
+{
+    int msb;
+
+    if (i < STATS_SUB_BUCKETS)
+	return i;
+    msb = i / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+    return (uint64_t) (STATS_SUB_BUCKETS + i % STATS_SUB_BUCKETS) << (msb - STATS_SUB_BITS);
+}
+
+/** Count one call of a filesystem operation
+ *
+ * @result is what the operation returned: negative for an error, the
+ * number of bytes moved for read and write.
+ */
+void stats_op(int op, int result, uint64_t latency)
+{
+    struct stats_thread *t = my_stats();
+    struct stats_op *o;
+
+    if (t == NULL || op <= 0 || op >= TRACE_NOPS)
+	return;
+    o = &t->s.ops[op];
+    add(&o->calls, 1);
+    if (result < 0)
+	add(&o->errors, 1);
+    else if (op == TRACE_READ || op == TRACE_WRITE)
+	add(&o->bytes, result);
+    add(&o->latency[bucket(latency)], 1);
+}
+
+/** Add to one of the counters kept below the operations */
+void stats_count(int counter, uint64_t n)
+{
+    struct stats_thread *t = my_stats();
+
+    if (t == NULL || counter < 0 || counter >= STATS_NCOUNTERS)
+	return;
+    add(&t->s.counters[counter], n);
+}
+
+/** Add up the counts of every thread, live or gone */
+void stats_merge(struct stats *total)
+{
+    struct stats_thread *t;
+
+    memset(total, 0, sizeof(struct stats));
+    pthread_mutex_lock(&threads_lock);
+    stats_add(total, &retired);
+    for (t = threads; t != NULL; t = t->next)
+	stats_add(total, &t->s);
+    pthread_mutex_unlock(&threads_lock);
+}
+
+/** Latency below which a given percentage of the calls finished
+ *
+ * Accurate to the width of a bucket; 0 if there were no calls.
+ */
+uint64_t stats_percentile(const struct stats_op *op, double percent)
+{
+    uint64_t total = 0, want, seen = 0;
+    int i;
+
+    for (i = 0; i < STATS_BUCKETS; i++)
+	total += op->latency[i];
+    if (total == 0)
+	return 0;
+    want = (uint64_t) (total * percent / 100.0 + 0.5);
+    if (want == 0)
+	want = 1;
+    for (i = 0; i < STATS_BUCKETS - 1; i++) {
+	seen += op->latency[i];
+	if (seen >= want)
+	    break;
+    }
+    // report the middle of the bucket
+    return bucket_floor(i) + (bucket_floor(i + 1) - bucket_floor(i)) / 2;
+}
+
+const char *stats_counter_name(int counter)
+{
+    if (counter < 0 || counter >= STATS_NCOUNTERS)
+	return "unknown";
+    return counter_names[counter];
+}
+
+// a string that grows as it is printed into
+struct text {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+static void emit(struct text *t, const char *format, ...)
+{
+    va_list ap;
+    int n;
+
+    if (t->buf == NULL)
+	return;
+    va_start(ap, format);
+    n = vsnprintf(t->buf + t->len, t->cap - t->len, format, ap);
+    va_end(ap);
+    if (n < 0)
+	return;
+    if ((size_t) n >= t->cap - t->len) {
+	char *bigger;
+	t->cap = (t->len + n + 1) * 2;
+	bigger = realloc(t->buf, t->cap);
+	if (bigger == NULL) {
+	    free(t->buf);
+	    t->buf = NULL;
+	    return;
+	}
+	t->buf = bigger;
+	va_start(ap, format);
+	vsnprintf(t->buf + t->len, t->cap - t->len, format, ap);
+	va_end(ap);
+    }
+    t->len += n;
+}
+
+static const double percentiles[] = { 50, 90, 99, 99.9, 100 };
+static const char *percentile_names[] = { "p50", "p90", "p99", "p999", "max" };
+#define NPERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
+
+/** Render the current statistics
+ *
+ * Text is one "name value" pair per line, with per-operation figures
+ * named <op>.<figure>; json is a single object.  Returns a malloc'd
+ * string and its length in @length, or NULL if out of memory.
+ */
+char *stats_render(const struct stats_fs *fs, int json, size_t *length)
+{
+    struct stats *total = malloc(sizeof(struct stats));
+    struct text t = { malloc(4096), 0, 4096 };
+    const char *sep;
+    unsigned p;
+    int i;
+
+    if (total == NULL || t.buf == NULL) {
+	free(total);
+	free(t.buf);
+	return NULL;
+    }
+    stats_merge(total);
+
+    if (json) {
+	emit(&t, "{\"fs\":{\"uptime\":%" PRIu64 ",\"block_size\":%" PRIu64
+	     ",\"data_blocks\":%" PRIu64 ",\"free_data_blocks\":%" PRIu64
+	     ",\"inodes\":%" PRIu64 ",\"free_inodes\":%" PRIu64
+	     ",\"icache_used\":%" PRIu64 ",\"icache_size\":%" PRIu64 "}",
+	     fs->uptime, fs->block_size, fs->data_blocks, fs->free_data_blocks,
+	     fs->inodes, fs->free_inodes, fs->icache_used, fs->icache_size);
+	emit(&t, ",\"counters\":{");
+	for (i = 0; i < STATS_NCOUNTERS; i++)
+	    emit(&t, "%s\"%s\":%" PRIu64, i ? "," : "", counter_names[i], total->counters[i]);
+	emit(&t, "},\"ops\":{");
+	sep = "";
+	for (i = 1; i < TRACE_NOPS; i++) {
+	    struct stats_op *op = &total->ops[i];
+	    if (op->calls == 0)
+		continue;
+	    emit(&t, "%s\"%s\":{\"calls\":%" PRIu64 ",\"errors\":%" PRIu64
+		 ",\"bytes\":%" PRIu64 ",\"latency_ns\":{",
+		 sep, trace_op_name(i), op->calls, op->errors, op->bytes);
+	    for (p = 0; p < NPERCENTILES; p++)
+		emit(&t, "%s\"%s\":%" PRIu64, p ? "," : "", percentile_names[p],
+		     stats_percentile(op, percentiles[p]));
+	    emit(&t, "}}");
+	    sep = ",";
+	}
+	emit(&t, "}}\n");
+    } else {
+	emit(&t, "uptime %" PRIu64 "\nblock_size %" PRIu64 "\n"
+	     "data_blocks %" PRIu64 "\nfree_data_blocks %" PRIu64 "\n"
+	     "inodes %" PRIu64 "\nfree_inodes %" PRIu64 "\n"
+	     "icache_used %" PRIu64 "\nicache_size %" PRIu64 "\n",
+	     fs->uptime, fs->block_size, fs->data_blocks, fs->free_data_blocks,
+	     fs->inodes, fs->free_inodes, fs->icache_used, fs->icache_size);
+	for (i = 0; i < STATS_NCOUNTERS; i++)
+	    emit(&t, "%s %" PRIu64 "\n", counter_names[i], total->counters[i]);
+	for (i = 1; i < TRACE_NOPS; i++) {
+	    struct stats_op *op = &total->ops[i];
+	    if (op->calls == 0)
+		continue;
+	    emit(&t, "%s.calls %" PRIu64 "\n%s.errors %" PRIu64 "\n%s.bytes %" PRIu64 "\n",
+		 trace_op_name(i), op->calls, trace_op_name(i), op->errors,
+		 trace_op_name(i), op->bytes);
+	    for (p = 0; p < NPERCENTILES; p++)
+		emit(&t, "%s.%s_ns %" PRIu64 "\n", trace_op_name(i), percentile_names[p],
+		     stats_percentile(op, percentiles[p]));
+	}
+    }
+    free(total);
+
+    if (t.buf != NULL)
+	*length = t.len;
+    return t.buf;
+}
@@ -0,0 +1,77 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+
+#include "trace.h"
+
+// Latency histograms are log-linear, like HdrHistogram: values below
+// 2^STATS_SUB_BITS ns get a bucket each, and every power of two above
+// that is split into 2^STATS_SUB_BITS equal buckets, so any value is
+// known to within 1/16th.  Values past 2^STATS_MAX_BITS ns (about a
+// minute) land in the last bucket.
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 36
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+// Counters kept below the operations
+enum stats_counter {
+    STATS_BLOCK_READS,		// calls into the block layer
+    STATS_BLOCKS_READ,
+    STATS_BLOCK_WRITES,
+    STATS_BLOCKS_WRITTEN,
+    STATS_BLOCKS_PUNCHED,	// blocks of zeros left as holes rather than written
+    STATS_SYNCS,		// syncs of the image, however many callers shared each
+    STATS_CACHE_HITS,		// opens that let the kernel keep its pages
+    STATS_CACHE_MISSES,		// opens that made it drop them
+    STATS_JOURNAL_COMMITS,	// transactions written to the journal
+    STATS_JOURNAL_BLOCKS,	// blocks they took there
+    STATS_DELALLOC_BLOCKS,	// held file blocks given data blocks when written out
+    STATS_DELALLOC_DROPPED,	// held file blocks truncated or unlinked before that
+    STATS_PREALLOC_BLOCKS,	// blocks allocated from windows set aside for appending files
+    STATS_PREALLOC_TRIMMED,	// blocks of those windows given back unused
+    STATS_NCOUNTERS
+};
+
+// Op codes are the ones the trace uses (enum trace_op)
+struct stats_op {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes;		// moved by read and write
+    uint64_t latency[STATS_BUCKETS];	// ns
+};
+
+struct stats {
+    struct stats_op ops[TRACE_NOPS];
+    uint64_t counters[STATS_NCOUNTERS];
+};
+
+// Figures about the filesystem itself, filled in by the caller of
+// stats_render
+struct stats_fs {
+    uint64_t uptime;		// seconds since mount
+    uint64_t block_size;
+    uint64_t data_blocks;
+    uint64_t free_data_blocks;
+    uint64_t inodes;
+    uint64_t free_inodes;
+    uint64_t icache_used;	// in-core inode entries in use
+    uint64_t icache_size;
+};
+
+void stats_op(int op, int result, uint64_t latency);
+void stats_count(int counter, uint64_t n);
+void stats_merge(struct stats *total);
+uint64_t stats_percentile(const struct stats_op *op, double percent);
+const char *stats_counter_name(int counter);
+char *stats_render(const struct stats_fs *fs, int json, size_t *length);
+
+#endif
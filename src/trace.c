@@ -0,0 +1,149 @@
+/*
+  Binary operation trace.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "trace.h"
+
+int trace_active = 0;
+
+static struct trace_header *header = NULL;
+static struct trace_record *records = NULL;
+static size_t mapped = 0;
+static uint64_t base = 0;		// trace_now() at trace_open
+
+static const char *op_names[TRACE_NOPS] = {
+    [TRACE_GETATTR] = "getattr",
+    [TRACE_CREATE] = "create",
+    [TRACE_UNLINK] = "unlink",
+    [TRACE_OPEN] = "open",
+    [TRACE_RELEASE] = "release",
+    [TRACE_READ] = "read",
+    [TRACE_WRITE] = "write",
+    [TRACE_TRUNCATE] = "truncate",
+    [TRACE_FTRUNCATE] = "ftruncate",
+    [TRACE_UTIMENS] = "utimens",
+    [TRACE_MKDIR] = "mkdir",
+    [TRACE_RMDIR] = "rmdir",
+    [TRACE_OPENDIR] = "opendir",
+    [TRACE_READDIR] = "readdir",
+    [TRACE_SETXATTR] = "setxattr",
+    [TRACE_GETXATTR] = "getxattr",
+    [TRACE_LISTXATTR] = "listxattr",
+    [TRACE_FSYNC] = "fsync",
+    [TRACE_FSYNCDIR] = "fsyncdir",
+};
+
+/* Create the trace file and map it
+ * INPUT: the file to trace into and the number of records it holds
+ * OUTPUT: 0, or -errno if the file can't be set up
+ */
+int trace_open(const char *path, uint64_t capacity)
+{
+    struct timespec now;
+    size_t len;
+    void *map;
+    int fd;
+
+    if (capacity == 0)
+	return -EINVAL;
+    len = sizeof(struct trace_header) + capacity * sizeof(struct trace_record);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+	return -errno;
+    if (ftruncate(fd, len) < 0) {
+	int err = -errno;
+	close(fd);
+	return err;
+    }
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+	return -errno;
+
+    header = map;
+    records = (struct trace_record *) (header + 1);
+    mapped = len;
+    memcpy(header->magic, TRACE_MAGIC, sizeof(header->magic));
+    header->version = TRACE_VERSION;
+    header->record_size = sizeof(struct trace_record);
+    header->capacity = capacity;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header->start = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    header->next = 0;
+    base = trace_now();
+    __atomic_store_n(&trace_active, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/* Stop tracing and write the trace out */
+void trace_close()
+{
+    if (header == NULL)
+	return;
+    __atomic_store_n(&trace_active, 0, __ATOMIC_RELAXED);
+    msync(header, mapped, MS_SYNC);
+    munmap(header, mapped);
+    header = NULL;
+    records = NULL;
+}
+
+/* Monotonic clock in ns, for timing operations */
+uint64_t trace_now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Append one operation to the trace
+ * INPUT: what the operation was and did, trace_now() from when it
+ *        started and how long it took
+ * OUTPUT: none
+ */
+void trace_record(int op, int inode, off_t offset, size_t size, int result,
+		  uint64_t start, uint64_t latency)
+{
+    uint64_t n;
+    struct trace_record *r;
+
+    if (records == NULL)
+	return;
+    n = __atomic_fetch_add(&header->next, 1, __ATOMIC_RELAXED);
+    r = &records[n % header->capacity];
+    // mark the slot as being filled so a reader never takes a mix of
+    // this record and the one it replaces for a whole one
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->time = start - base;
+    r->latency = latency;
+    r->offset = offset;
+    r->size = size;
+    r->result = result;
+    r->inode = inode;
+    r->op = op;
+    r->unused = 0;
+    __atomic_store_n(&r->seq, n + 1, __ATOMIC_RELEASE);
+}
+
+/* Name of a trace op code, for printing */
+const char *trace_op_name(int op)
+{
+    if (op <= 0 || op >= TRACE_NOPS || op_names[op] == NULL)
+	return "unknown";
+    return op_names[op];
+}
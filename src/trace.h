@@ -0,0 +1,78 @@
+/*
+  Binary operation trace.
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  The trace file is a header followed by a ring of fixed-size records,
+  one per filesystem operation, written through a shared mapping so
+  recording one costs an atomic increment and a few stores.  Once the
+  ring is full the oldest records are overwritten.  sfs-trace decodes
+  the file after the fact.
+*/
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define TRACE_MAGIC "SFSTRACE"
+#define TRACE_VERSION 1
+#define TRACE_DEFAULT_RECORDS (1 << 20)
+
+enum trace_op {
+    TRACE_GETATTR = 1,
+    TRACE_CREATE,
+    TRACE_UNLINK,
+    TRACE_OPEN,
+    TRACE_RELEASE,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_TRUNCATE,
+    TRACE_FTRUNCATE,
+    TRACE_UTIMENS,
+    TRACE_MKDIR,
+    TRACE_RMDIR,
+    TRACE_OPENDIR,
+    TRACE_READDIR,
+    TRACE_SETXATTR,
+    TRACE_GETXATTR,
+    TRACE_LISTXATTR,
+    TRACE_FSYNC,
+    TRACE_FSYNCDIR,
+    TRACE_NOPS
+};
+
+struct trace_header {
+    char magic[8];		// TRACE_MAGIC, not NUL terminated
+    uint32_t version;
+    uint32_t record_size;	// sizeof(struct trace_record)
+    uint64_t capacity;		// records in the ring
+    uint64_t start;		// wall clock at trace_open, ns since the epoch
+    uint64_t next;		// records handed out so far
+    char unused[24];
+};
+
+struct trace_record {
+    uint64_t seq;		// position + 1 once complete, 0 while being filled
+    uint64_t time;		// start of the operation, ns after header start
+    uint64_t latency;		// ns
+    int64_t offset;
+    uint32_t size;
+    int32_t result;		// what the operation returned
+    int32_t inode;		// -1 if the path didn't resolve
+    uint16_t op;		// enum trace_op
+    uint16_t unused;
+};
+
+extern int trace_active;
+
+int trace_open(const char *path, uint64_t records);
+void trace_close(void);
+uint64_t trace_now(void);
+void trace_record(int op, int inode, off_t offset, size_t size, int result,
+		  uint64_t start, uint64_t latency);
+const char *trace_op_name(int op);
+
+#endif
@@ -0,0 +1,150 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Settings that can be changed while the filesystem is mounted.  Each
+  module registers the ints it is willing to have changed at init;
+  sfs_getxattr and sfs_setxattr on the root directory come through
+  here.  Values are stored with relaxed atomics, so whoever uses a
+  tunable just loads it each time and never needs a lock.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tunables.h"
+
+static struct tunable tunables[TUNABLES_MAX];
+static int ntunables = 0;
+// serializes setters, so changed() hooks never run concurrently
+static pthread_mutex_t set_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Add a tunable
+ * INPUT: its description, which is copied
+ * OUTPUT: 0, or -ENOSPC if the table is full
+ */
+int tunable_register(const struct tunable *t)
+{
+    if (ntunables == TUNABLES_MAX)
+	return -ENOSPC;
+    tunables[ntunables++] = *t;
+
+    return 0;
+}
+
+/* Forget every tunable, at unmount */
+void tunables_clear()
+{
+    ntunables = 0;
+}
+
+/* Find the tunable an attribute name refers to, NULL if none */
+static struct tunable *lookup(const char *attr)
+{
+    size_t plen = strlen(TUNABLE_PREFIX);
+    int i;
+
+    if (strncmp(attr, TUNABLE_PREFIX, plen) != 0)
+	return NULL;
+    for (i = 0; i < ntunables; i++)
+	if (strcmp(attr + plen, tunables[i].name) == 0)
+	    return &tunables[i];
+
+    return NULL;
+}
+
+/** Read a tunable, getxattr style
+ *
+ * The value is written in decimal, without a terminating NUL.  Returns
+ * its length (all that is done when @size is 0), -ENODATA for an
+ * unknown attribute or -ERANGE if @value is too small.
+ */
+int tunable_get(const char *attr, char *value, size_t size)
+{
+    struct tunable *t = lookup(attr);
+    char text[16];
+    int len;
+
+    if (t == NULL)
+	return -ENODATA;
+    len = snprintf(text, sizeof(text), "%d", __atomic_load_n(t->value, __ATOMIC_RELAXED));
+    if (size == 0)
+	return len;
+    if (size < (size_t) len)
+	return -ERANGE;
+    memcpy(value, text, len);
+
+    return len;
+}
+
+/** Change a tunable, setxattr style
+ *
+ * @value need not be NUL terminated.  Returns 0, -ENOTSUP for an
+ * unknown attribute, -EPERM for one fixed at mount or -EINVAL for a
+ * value that doesn't parse or is out of range.
+ */
+int tunable_set(const char *attr, const char *value, size_t size)
+{
+    struct tunable *t = lookup(attr);
+    char text[32], *end;
+    long n;
+
+    if (t == NULL)
+	return -ENOTSUP;
+    if (t->readonly)
+	return -EPERM;
+    if (size == 0 || size >= sizeof(text))
+	return -EINVAL;
+    memcpy(text, value, size);
+    text[size] = '\0';
+    // tolerate the newline echo leaves on
+    if (text[size - 1] == '\n')
+	text[size - 1] = '\0';
+
+    if (t->parse != NULL) {
+	n = t->parse(text);
+    } else {
+	n = strtol(text, &end, 10);
+	if (text[0] == '\0' || *end != '\0')
+	    return -EINVAL;
+    }
+    if (n < t->min || n > t->max)
+	return -EINVAL;
+
+    pthread_mutex_lock(&set_lock);
+    __atomic_store_n(t->value, (int) n, __ATOMIC_RELAXED);
+    if (t->changed != NULL)
+	t->changed(n);
+    pthread_mutex_unlock(&set_lock);
+
+    return 0;
+}
+
+/** List every tunable's attribute name, listxattr style
+ *
+ * Returns the length of the NUL separated list (all that is done when
+ * @size is 0), or -ERANGE if @list is too small.
+ */
+int tunable_list(char *list, size_t size)
+{
+    size_t len = 0, n;
+    int i;
+
+    for (i = 0; i < ntunables; i++)
+	len += strlen(TUNABLE_PREFIX) + strlen(tunables[i].name) + 1;
+    if (size == 0)
+	return len;
+    if (size < len)
+	return -ERANGE;
+    for (i = 0; i < ntunables; i++) {
+	n = sprintf(list, "%s%s", TUNABLE_PREFIX, tunables[i].name);
+	list += n + 1;
+    }
+
+    return len;
+}
@@ -0,0 +1,35 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _TUNABLES_H_
+#define _TUNABLES_H_
+
+#include <stddef.h>
+
+// Tunables are read and changed through extended attributes on the
+// root directory named TUNABLE_PREFIX followed by the tunable's name,
+// e.g. setfattr -n user.sfs.log_level -v debug mountdir
+#define TUNABLE_PREFIX "user.sfs."
+#define TUNABLES_MAX 32
+
+struct tunable {
+    const char *name;		// without TUNABLE_PREFIX
+    int *value;
+    int min;
+    int max;
+    int readonly;		// fixed at mount, shown for reference
+    int (*parse)(const char *text);	// text to value, -1 if invalid; NULL for plain numbers
+    void (*changed)(int value);	// called once a new value is in place; may be NULL
+};
+
+int tunable_register(const struct tunable *t);
+void tunables_clear(void);
+int tunable_get(const char *attr, char *value, size_t size);
+int tunable_set(const char *attr, const char *value, size_t size);
+int tunable_list(char *list, size_t size);
+
+#endif
@@ -0,0 +1,202 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  A fixed pool of worker threads, one queue per worker.  Work is
+  handed out round-robin; a worker whose own queue is empty steals
+  from the others before going to sleep, so one slow item only ever
+  holds up the worker running it.
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "workq.h"
+
+struct workq_item {
+    void (*fn)(void *);
+    void *arg;
+};
+
+// A growable ring of items
+struct workq_queue {
+    pthread_mutex_t lock;
+    struct workq_item *items;
+    int head;		// next item to take
+    int count;		// items queued
+    int size;		// room in items
+};
+
+static struct workq_queue *queues = NULL;
+static pthread_t *threads = NULL;
+static int nworkers = 0;
+static int next_queue = 0;
+
+// Idle workers sleep here until something is queued anywhere
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static int queued = 0;
+static int stopping = 0;
+
+static int queue_push(struct workq_queue *q, struct workq_item item)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->size) {
+	int size = q->size ? 2 * q->size : 64;
+	struct workq_item *items = malloc(size * sizeof(struct workq_item));
+	int i;
+	if (items == NULL) {
+	    pthread_mutex_unlock(&q->lock);
+	    return -1;
+	}
+	for (i = 0; i < q->count; i++)
+	    items[i] = q->items[(q->head + i) % q->size];
+	free(q->items);
+	q->items = items;
+	q->head = 0;
+	q->size = size;
+    }
+    q->items[(q->head + q->count) % q->size] = item;
+    q->count++;
+    pthread_mutex_unlock(&q->lock);
+
+    return 0;
+}
+
+static int queue_pop(struct workq_queue *q, struct workq_item *item)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+	*item = q->items[q->head];
+	q->head = (q->head + 1) % q->size;
+	q->count--;
+	found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return found;
+}
+
+// Take from our own queue first, then from everyone else's
+static int take(int self, struct workq_item *item)
+{
+    int i;
+
+    for (i = 0; i < nworkers; i++) {
+	if (queue_pop(&queues[(self + i) % nworkers], item)) {
+	    pthread_mutex_lock(&idle_lock);
+	    queued--;
+	    pthread_mutex_unlock(&idle_lock);
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+static void *worker(void *data)
+{
+    int self = (int) (long) data;
+    struct workq_item item;
+
+    for (;;) {
+	if (take(self, &item)) {
+	    item.fn(item.arg);
+	    continue;
+	}
+	pthread_mutex_lock(&idle_lock);
+	while (queued == 0 && !stopping)
+	    pthread_cond_wait(&idle_cond, &idle_lock);
+	if (queued == 0 && stopping) {
+	    pthread_mutex_unlock(&idle_lock);
+	    break;
+	}
+	pthread_mutex_unlock(&idle_lock);
+    }
+
+    return NULL;
+}
+
+/** Start @workers threads
+ *
+ * Returns 0 on success, -1 if the pool could not be set up.
+ */
+int workq_start(int workers)
+{
+    int i;
+
+    queues = calloc(workers, sizeof(struct workq_queue));
+    threads = calloc(workers, sizeof(pthread_t));
+    if (queues == NULL || threads == NULL)
+	return -1;
+    for (i = 0; i < workers; i++)
+	pthread_mutex_init(&queues[i].lock, NULL);
+    nworkers = workers;
+    stopping = 0;
+
+    for (i = 0; i < workers; i++) {
+	if (pthread_create(&threads[i], NULL, worker, (void *) (long) i) != 0) {
+	    nworkers = i;
+	    workq_stop();
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+/** Queue @fn to be called with @arg on some worker
+ *
+ * Only ever called from a single thread (the one reading requests),
+ * so the round-robin cursor needs no lock.  If the item cannot be
+ * queued it is run right here instead of being lost.
+ */
+void workq_submit(void (*fn)(void *), void *arg)
+{
+    struct workq_item item = { fn, arg };
+
+    // counted before it is pushed, so a worker that takes it at once
+    // never sees queued go below zero
+    pthread_mutex_lock(&idle_lock);
+    queued++;
+    pthread_mutex_unlock(&idle_lock);
+    if (queue_push(&queues[next_queue], item) != 0) {
+	pthread_mutex_lock(&idle_lock);
+	queued--;
+	pthread_mutex_unlock(&idle_lock);
+	fn(arg);
+	return;
+    }
+    next_queue = (next_queue + 1) % nworkers;
+
+    pthread_mutex_lock(&idle_lock);
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+/** Run everything still queued, then stop the workers */
+void workq_stop()
+{
+    int i;
+
+    pthread_mutex_lock(&idle_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+
+    for (i = 0; i < nworkers; i++)
+	pthread_join(threads[i], NULL);
+    for (i = 0; i < nworkers; i++) {
+	pthread_mutex_destroy(&queues[i].lock);
+	free(queues[i].items);
+    }
+    free(queues);
+    free(threads);
+    queues = NULL;
+    threads = NULL;
+    nworkers = 0;
+}
@@ -0,0 +1,15 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _WORKQ_H_
+#define _WORKQ_H_
+
+int workq_start(int workers);
+void workq_submit(void (*fn)(void *), void *arg);
+void workq_stop();
+
+#endif